@@ -0,0 +1,1365 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Benchmarks for the stages of a loudgain run, on synthetic signals that are
+ * generated on the spot. Results are printed as one JSON object per line. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/common.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/samplefmt.h>
+
+#include <ebur128.h>
+
+#include "scan.h"
+#include "bs1770.h"
+#include "tag.h"
+#include "list.h"
+#include "io.h"
+#include "printf.h"
+
+/* each micro-benchmark runs for at least this long */
+#define BENCH_MIN_TIME  0.5
+
+/* frame size for the conversion and meter benchmarks */
+#define BENCH_FRAME_LEN 4096
+
+/* largest differences in loudness and loudness range (LU) and in peaks
+ * (linear) between a serial and a segmented scan of the same file that are
+ * still accepted */
+#define BENCH_SEGMENT_TOLERANCE      0.1
+#define BENCH_SEGMENT_PEAK_TOLERANCE 1e-6
+
+/* largest difference between a --fast estimate and a full scan that is
+ * still accepted, and the windows used for the comparison */
+#define BENCH_FAST_TOLERANCE 0.5
+#define BENCH_FAST_WINDOWS   16
+#define BENCH_FAST_LEN       10
+
+/* largest differences in loudness (LU) and in peaks (dB) between a scan
+ * with -D and a full rate scan that are still accepted */
+#define BENCH_DOWNSAMPLE_TOLERANCE      0.1
+#define BENCH_DOWNSAMPLE_PEAK_TOLERANCE 0.2
+
+/* largest differences in loudness (LU) and in peaks (dB) between the
+ * builtin engine and libebur128 that are still accepted, and the length of
+ * the signal they are compared on */
+#define BENCH_ENGINE_TOLERANCE      0.01
+#define BENCH_ENGINE_PEAK_TOLERANCE 0.01
+#define BENCH_ENGINE_LEN            20
+
+typedef enum {
+	SIGNAL_SINE,
+	SIGNAL_NOISE,
+	SIGNAL_DYNAMIC,
+	SIGNAL_TONES,
+} bench_signal;
+
+static const char *signal_names[] = { "sine", "noise", "dynamic", "tones" };
+
+typedef struct {
+	bench_signal signal;
+	uint32_t     seed;
+} bench_gen;
+
+typedef struct {
+	const char   *container;
+	enum AVCodecID codec_id;
+	bench_signal  signal;
+	int           channels;
+	int           sample_rate;
+} bench_file;
+
+static const bench_file bench_files[] = {
+	{ "wav",  AV_CODEC_ID_PCM_S16LE, SIGNAL_SINE,  2, 44100 },
+	{ "wav",  AV_CODEC_ID_PCM_S16LE, SIGNAL_NOISE, 6, 48000 },
+	{ "flac", AV_CODEC_ID_FLAC,      SIGNAL_SINE,  2, 44100 },
+	{ "flac", AV_CODEC_ID_FLAC,      SIGNAL_NOISE, 2, 96000 },
+	{ "flac", AV_CODEC_ID_FLAC,      SIGNAL_NOISE, 6, 48000 },
+	{ "mp3",  AV_CODEC_ID_MP3,       SIGNAL_SINE,  2, 44100 },
+	{ "mp3",  AV_CODEC_ID_MP3,       SIGNAL_NOISE, 2, 48000 },
+};
+
+static const enum AVSampleFormat bench_formats[] = {
+	AV_SAMPLE_FMT_U8,
+	AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P,
+	AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S32P,
+	AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP,
+	AV_SAMPLE_FMT_DBL, AV_SAMPLE_FMT_DBLP,
+};
+
+static const int bench_channels[] = { 1, 2, 6 };
+static const int bench_rates[]    = { 44100, 48000, 96000 };
+
+/* every rate with its own true peak oversampling factor */
+static const int bench_engine_rates[] = { 44100, 48000, 96000, 192000 };
+
+static const struct {
+	const char *name;
+	unsigned    engine;
+} bench_engines[] = {
+	{ "ebur128", SCAN_ENGINE_EBUR128 },
+	{ "builtin", SCAN_ENGINE_BUILTIN },
+};
+
+/* uring files are queued on a ring before they're scanned, but for
+ * uring-noring, which checks what happens without one */
+static const struct {
+	const char *name;
+	unsigned    io;
+	bool        ring;
+} bench_ios[] = {
+	{ "default",      SCAN_IO_DEFAULT, false },
+	{ "mmap",         SCAN_IO_MMAP,    false },
+	{ "read",         SCAN_IO_READ,    false },
+	{ "uring",        SCAN_IO_URING,   true },
+	{ "uring-noring", SCAN_IO_URING,   false },
+};
+
+/* high rate files for the -D accuracy checks, which only use signals with
+ * nothing above 20kHz, like actual recordings */
+static const bench_file bench_hires[] = {
+	{ "flac", AV_CODEC_ID_FLAC, SIGNAL_SINE,  2, 88200 },
+	{ "flac", AV_CODEC_ID_FLAC, SIGNAL_TONES, 2, 88200 },
+	{ "flac", AV_CODEC_ID_FLAC, SIGNAL_SINE,  2, 96000 },
+	{ "flac", AV_CODEC_ID_FLAC, SIGNAL_TONES, 2, 96000 },
+	{ "flac", AV_CODEC_ID_FLAC, SIGNAL_TONES, 6, 96000 },
+	{ "flac", AV_CODEC_ID_FLAC, SIGNAL_TONES, 2, 192000 },
+};
+
+static const struct {
+	const char *name;
+	unsigned    measure;
+} bench_measures[] = {
+	{ "gain",     SCAN_MEASURE_GAIN },
+	{ "gain+lra", SCAN_MEASURE_GAIN_LRA },
+	{ "full",     SCAN_MEASURE_FULL },
+};
+
+#define BENCH_LEN(A) (sizeof(A) / sizeof((A)[0]))
+
+static double bench_now(void);
+static double bench_sample(bench_gen *gen, int ch, int64_t i, int rate);
+static AVFrame *bench_frame(enum AVSampleFormat fmt, int channels,
+                            int sample_rate, int nb_samples);
+static void bench_fill(AVFrame *frame, bench_gen *gen, int channels,
+                       int sample_rate, int64_t pos);
+static bool bench_encode(const char *path, const bench_file *file,
+                         double duration);
+
+static void bench_convert(void);
+static void bench_meter(void);
+static int bench_engine(void);
+static void bench_scan(const char *dir, double duration);
+static int bench_io(const char *dir, double duration);
+static void bench_io_queue(io_ring *ring, const char *dir, unsigned file);
+static int bench_segments(const char *dir);
+static int bench_fast(const char *dir);
+static int bench_downsample(const char *dir, double duration);
+static int bench_corpus(const char *dir);
+static int bench_compare(const char *path, unsigned nb_windows,
+                         double *full, double *fast, double *error,
+                         double *speedup);
+static void bench_tags(const char *dir, double duration);
+
+static inline void help(void);
+
+int main(int argc, char *argv[]) {
+	int rc, i;
+
+	int fails = 0;
+	double duration = 30;
+
+	char *dir = NULL, *corpus = NULL;
+	char tmp_dir[] = "/tmp/loudgain-bench.XXXXXX";
+
+	bool do_micro = true,
+	     do_macro = true;
+
+	while ((rc = getopt(argc, argv, "d:t:mMc:h?")) != -1) {
+		switch (rc) {
+			case 'd':
+				dir = optarg;
+				break;
+
+			case 't':
+				duration = atof(optarg);
+				if (duration <= 0)
+					fail_printf("Invalid duration");
+				break;
+
+			case 'm':
+				do_macro = false;
+				break;
+
+			case 'M':
+				do_micro = false;
+				break;
+
+			case 'c':
+				corpus = optarg;
+				do_micro = do_macro = false;
+				break;
+
+			case '?':
+			case 'h':
+				help();
+				return 0;
+		}
+	}
+
+	/* only the JSON results go to stdout */
+	quiet = 1;
+	use_progress = 0;
+
+	if (scan_init() < 0)
+		fail_printf("Could not initialize libav");
+
+	if (do_micro) {
+		bench_convert();
+		bench_meter();
+		fails += bench_engine();
+	}
+
+	if (do_macro) {
+		bool own_dir = (dir == NULL);
+
+		if (own_dir && ((dir = mkdtemp(tmp_dir)) == NULL))
+			sysf_printf("mkdtemp()");
+
+		bench_scan(dir, duration);
+		fails += bench_io(dir, duration);
+		fails += bench_segments(dir);
+		fails += bench_fast(dir);
+		fails += bench_downsample(dir, duration);
+
+		bench_tags(dir, duration);
+
+		if (own_dir) {
+			char path[PATH_MAX];
+
+			for (i = 0; i < BENCH_LEN(bench_files); i++) {
+				snprintf(path, sizeof(path), "%s/%d.%s", dir, i,
+				         bench_files[i].container);
+				unlink(path);
+			}
+
+			snprintf(path, sizeof(path), "%s/segments.flac", dir);
+			unlink(path);
+
+			snprintf(path, sizeof(path), "%s/fast.flac", dir);
+			unlink(path);
+
+			for (i = 0; i < BENCH_LEN(bench_hires); i++) {
+				snprintf(path, sizeof(path), "%s/hires-%d.%s",
+				         dir, i, bench_hires[i].container);
+				unlink(path);
+			}
+
+			rmdir(dir);
+		}
+	}
+
+	if (corpus != NULL)
+		fails += bench_corpus(corpus);
+
+	scan_deinit();
+
+	return fails > 0 ? 1 : 0;
+}
+
+/* sample conversion alone, for every input format libav may produce */
+static void bench_convert(void) {
+	unsigned f, c;
+
+	for (f = 0; f < BENCH_LEN(bench_formats); f++) {
+		for (c = 0; c < BENCH_LEN(bench_channels); c++) {
+			unsigned runs = 0, batch = 16;
+			double start, elapsed;
+
+			int channels = bench_channels[c];
+			enum AVSampleFormat fmt = bench_formats[f];
+
+			AVFrame *frame = bench_frame(
+				fmt, channels, 48000, BENCH_FRAME_LEN
+			);
+
+			start = bench_now();
+
+			do {
+				if (scan_bench_frame(frame, channels, 48000, 48000,
+				                     SCAN_ENGINE_EBUR128,
+				                     SCAN_MEASURE_GAIN,
+				                     batch, false) < 0)
+					fail_printf("Could not convert frame");
+				runs += batch;
+
+				elapsed = bench_now() - start;
+			} while (elapsed < BENCH_MIN_TIME);
+
+			printf("{\"bench\":\"convert\",\"format\":\"%s\","
+			       "\"channels\":%d,\"samples_per_sec\":%.0f}\n",
+			       av_get_sample_fmt_name(fmt), channels,
+			       (double) runs * BENCH_FRAME_LEN / elapsed);
+
+			av_frame_free(&frame);
+		}
+	}
+}
+
+/* conversion plus the meter and the histograms, for every engine and
+ * profile, and with -D for rates above 48kHz */
+static void bench_meter(void) {
+	int rc;
+	unsigned i, c, r;
+
+	for (i = 0; i < BENCH_LEN(bench_engines) * BENCH_LEN(bench_measures);
+	     i++) {
+		unsigned e = i / BENCH_LEN(bench_measures),
+		         m = i % BENCH_LEN(bench_measures);
+
+		for (c = 0; c < BENCH_LEN(bench_channels); c++) {
+			for (r = 0; r < BENCH_LEN(bench_rates) * 2; r++) {
+				unsigned runs = 0, batch = 16;
+				double start, elapsed;
+
+				int channels = bench_channels[c];
+				int rate     = bench_rates[r / 2];
+				bool down    = r % 2;
+
+				if (down && (rate <= 48000))
+					continue;
+
+				AVFrame *frame = bench_frame(
+					AV_SAMPLE_FMT_FLTP, channels, rate,
+					BENCH_FRAME_LEN
+				);
+
+				start = bench_now();
+
+				do {
+					rc = scan_bench_frame(
+						frame, channels, rate,
+						down ? 48000 : rate,
+						bench_engines[e].engine,
+						bench_measures[m].measure,
+						batch, true
+					);
+					if (rc < 0)
+						fail_printf("Could not measure frame");
+					runs += batch;
+
+					elapsed = bench_now() - start;
+				} while (elapsed < BENCH_MIN_TIME);
+
+				printf("{\"bench\":\"meter\",\"engine\":\"%s\","
+				       "\"measure\":\"%s\","
+				       "\"channels\":%d,\"sample_rate\":%d,"
+				       "\"downsample\":%s,"
+				       "\"samples_per_sec\":%.0f}\n",
+				       bench_engines[e].name,
+				       bench_measures[m].name, channels, rate,
+				       down ? "true" : "false",
+				       (double) runs * BENCH_FRAME_LEN /
+				       elapsed);
+
+				av_frame_free(&frame);
+			}
+		}
+	}
+}
+
+/* The builtin engine against libebur128 on the same samples, for every
+ * kernel the CPU can run: momentary and short-term loudness after every
+ * 100ms block, and the peaks at the end. Returns the number of
+ * configurations off by more than the BENCH_ENGINE_* tolerances. */
+static int bench_engine(void) {
+	unsigned i, r;
+	int fails = 0;
+
+	for (i = 0; i < (bs1770_isa_best() + 1) * BENCH_LEN(bench_channels);
+	     i++) {
+		bs1770_isa isa = i / BENCH_LEN(bench_channels);
+		int channels   = bench_channels[i % BENCH_LEN(bench_channels)];
+
+		for (r = 0; r < BENCH_LEN(bench_engine_rates); r++) {
+			bool ok;
+			int ch, b;
+
+			double elapsed[2] = { 0, 0 };
+			double loudness_dev = 0, sample_dev = 0, true_dev = 0;
+
+			int rate      = bench_engine_rates[r];
+			int block_len = (rate + 5) / 10;
+			int nb_blocks = BENCH_ENGINE_LEN * 10;
+
+			bench_gen gen = { SIGNAL_DYNAMIC, 1 };
+
+			ebur128_state *ref;
+			bs1770 *st;
+
+			float *block = malloc(sizeof(float) * block_len * channels);
+			if (block == NULL)
+				fail_printf("OOM");
+
+			bs1770_isa_limit(isa);
+
+			ref = ebur128_init(channels, rate,
+			                   EBUR128_MODE_M | EBUR128_MODE_S |
+			                   EBUR128_MODE_SAMPLE_PEAK |
+			                   EBUR128_MODE_TRUE_PEAK);
+			st = bs1770_new(channels, rate,
+			                BS1770_SHORT_TERM | BS1770_SAMPLE_PEAK |
+			                BS1770_TRUE_PEAK);
+			if ((ref == NULL) || (st == NULL))
+				fail_printf("Could not initialize the meters");
+
+			for (b = 0; b < nb_blocks; b++) {
+				int j;
+				double start, ref_m, ref_s;
+
+				for (j = 0; j < block_len; j++)
+					for (ch = 0; ch < channels; ch++)
+						block[j * channels + ch] = bench_sample(
+							&gen, ch,
+							(int64_t) b * block_len + j, rate
+						);
+
+				start = bench_now();
+				ebur128_add_frames_float(ref, block, block_len);
+				elapsed[0] += bench_now() - start;
+
+				start = bench_now();
+				bs1770_add(st, BS1770_FLT, block, block_len);
+				elapsed[1] += bench_now() - start;
+
+				/* silent windows are -HUGE_VAL for both */
+				if ((b >= 3) &&
+				    (ebur128_loudness_momentary(ref, &ref_m) ==
+				     EBUR128_SUCCESS) && isfinite(ref_m))
+					loudness_dev = FFMAX(loudness_dev, fabs(
+						bs1770_momentary(st) - ref_m
+					));
+
+				if ((b >= 29) &&
+				    (ebur128_loudness_shortterm(ref, &ref_s) ==
+				     EBUR128_SUCCESS) && isfinite(ref_s))
+					loudness_dev = FFMAX(loudness_dev, fabs(
+						bs1770_short_term(st) - ref_s
+					));
+			}
+
+			for (ch = 0; ch < channels; ch++) {
+				double peak;
+
+				if (ebur128_sample_peak(ref, ch, &peak) ==
+				    EBUR128_SUCCESS)
+					sample_dev = FFMAX(sample_dev, fabs(
+						20 * log10(bs1770_sample_peak(st, ch) /
+						           peak)
+					));
+
+				if (ebur128_true_peak(ref, ch, &peak) ==
+				    EBUR128_SUCCESS)
+					true_dev = FFMAX(true_dev, fabs(
+						20 * log10(bs1770_true_peak(st, ch) /
+						           peak)
+					));
+			}
+
+			ok = (loudness_dev <= BENCH_ENGINE_TOLERANCE) &&
+			     (sample_dev <= BENCH_ENGINE_PEAK_TOLERANCE) &&
+			     (true_dev <= BENCH_ENGINE_PEAK_TOLERANCE);
+
+			printf("{\"bench\":\"engine\",\"isa\":\"%s\","
+			       "\"channels\":%d,\"sample_rate\":%d,"
+			       "\"loudness_dev\":%.4f,"
+			       "\"sample_peak_dev_db\":%.4f,"
+			       "\"true_peak_dev_db\":%.4f,"
+			       "\"ebur128_samples_per_sec\":%.0f,"
+			       "\"builtin_samples_per_sec\":%.0f,"
+			       "\"ok\":%s}\n",
+			       bs1770_isa_name(isa), channels, rate,
+			       loudness_dev, sample_dev, true_dev,
+			       (double) nb_blocks * block_len / elapsed[0],
+			       (double) nb_blocks * block_len / elapsed[1],
+			       ok ? "true" : "false");
+
+			if (!ok)
+				fails++;
+
+			ebur128_destroy(&ref);
+			bs1770_free(st);
+			free(block);
+		}
+	}
+
+	bs1770_isa_limit(bs1770_isa_best());
+
+	return fails;
+}
+
+/* whole scan_file() runs, decoding included */
+static void bench_scan(const char *dir, double duration) {
+	unsigned i, m;
+
+	for (i = 0; i < BENCH_LEN(bench_files); i++) {
+		const bench_file *file = &bench_files[i];
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%u.%s", dir, i,
+		         file -> container);
+
+		if (!bench_encode(path, file, duration))
+			continue;
+
+		for (m = 0; m < BENCH_LEN(bench_measures); m++) {
+			unsigned runs = 0;
+			double start, elapsed;
+
+			scan_opts opts = {
+				.nb_segments = 1,
+				.measure     = bench_measures[m].measure,
+			};
+
+			start = bench_now();
+
+			do {
+				scan_job job;
+				memset(&job, 0, sizeof(job));
+
+				if (scan_file(&job, path, &opts) < 0)
+					fail_printf("%s: %s", path, job.error);
+
+				scan_job_free(&job);
+
+				runs++;
+
+				elapsed = bench_now() - start;
+			} while (elapsed < BENCH_MIN_TIME);
+
+			printf("{\"bench\":\"scan\",\"container\":\"%s\","
+			       "\"signal\":\"%s\",\"measure\":\"%s\","
+			       "\"channels\":%d,\"sample_rate\":%d,"
+			       "\"files_per_sec\":%.3f,"
+			       "\"samples_per_sec\":%.0f}\n",
+			       file -> container, signal_names[file -> signal],
+			       bench_measures[m].name, file -> channels,
+			       file -> sample_rate, runs / elapsed,
+			       runs * duration * file -> sample_rate / elapsed);
+		}
+	}
+}
+
+/* Whole scans of the files left by bench_scan() with every I/O method, from
+ * the page cache and with the file dropped from it before each run, which
+ * must all give the same results. Returns the number of mismatches. */
+static int bench_io(const char *dir, double duration) {
+	unsigned i, m, cold;
+	int fails = 0;
+
+	/* room for every file, queued again before each run, so that the
+	 * ones left unclaimed by earlier runs have to be evicted */
+	io_ring *ring = io_ring_open(BENCH_LEN(bench_files));
+
+	if (ring == NULL)
+		err_printf("io_uring is not available (%s), skipping uring",
+		           strerror(errno));
+
+	for (i = 0; i < BENCH_LEN(bench_files); i++) {
+		const bench_file *file = &bench_files[i];
+		char path[PATH_MAX];
+
+		double loudness = 0, peak = 0;
+
+		snprintf(path, sizeof(path), "%s/%u.%s", dir, i,
+		         file -> container);
+
+		if (access(path, R_OK) != 0)
+			continue;
+
+		for (m = 0; m < BENCH_LEN(bench_ios) * 2; m++) {
+			bool ok = true;
+			unsigned runs = 0;
+			double start, elapsed;
+
+			scan_opts opts = {
+				.nb_segments = 1,
+				.measure     = SCAN_MEASURE_GAIN,
+				.io          = bench_ios[m / 2].io,
+				.ring        = bench_ios[m / 2].ring ? ring : NULL,
+			};
+
+			if (bench_ios[m / 2].ring && (ring == NULL))
+				continue;
+
+			/* the file must actually come from the ring, which
+			 * scan_file() would quietly do without */
+			if (opts.ring != NULL) {
+				io_file f;
+
+				io_ring_queue(ring, path);
+				io_ring_submit(ring);
+
+				if (io_ring_take(ring, path, &f) == 0)
+					io_close(&f);
+				else
+					ok = false;
+			}
+
+			cold = m % 2;
+			start = bench_now();
+
+			do {
+				scan_job job;
+				memset(&job, 0, sizeof(job));
+
+				if (cold) {
+					int fd = open(path, O_RDONLY);
+
+					if (fd >= 0) {
+						posix_fadvise(fd, 0, 0,
+						              POSIX_FADV_DONTNEED);
+						close(fd);
+					}
+				}
+
+				if (opts.ring != NULL)
+					bench_io_queue(ring, dir, i);
+
+				if (scan_file(&job, path, &opts) < 0)
+					fail_printf("%s: %s", path, job.error);
+
+				scan_job_reduce(&job, NULL);
+
+				/* the first run is the reference */
+				if ((m == 0) && (runs == 0)) {
+					loudness = job.loudness;
+					peak     = job.sample_peak;
+				}
+
+				if ((job.loudness != loudness) ||
+				    (job.sample_peak != peak))
+					ok = false;
+
+				scan_job_free(&job);
+
+				runs++;
+
+				elapsed = bench_now() - start;
+			} while (elapsed < BENCH_MIN_TIME);
+
+			printf("{\"bench\":\"io\",\"io\":\"%s\","
+			       "\"container\":\"%s\",\"cold\":%s,"
+			       "\"channels\":%d,\"sample_rate\":%d,"
+			       "\"files_per_sec\":%.3f,"
+			       "\"samples_per_sec\":%.0f,\"ok\":%s}\n",
+			       bench_ios[m / 2].name, file -> container,
+			       cold ? "true" : "false", file -> channels,
+			       file -> sample_rate, runs / elapsed,
+			       runs * duration * file -> sample_rate / elapsed,
+			       ok ? "true" : "false");
+
+			if (!ok)
+				fails++;
+		}
+	}
+
+	io_ring_close(ring);
+
+	return fails;
+}
+
+/* Queue every file on the ring like a list of files would be, the one
+ * about to be scanned last so that it's the newest. */
+static void bench_io_queue(io_ring *ring, const char *dir, unsigned file) {
+	unsigned i;
+	char path[PATH_MAX];
+
+	for (i = 1; i <= BENCH_LEN(bench_files); i++) {
+		unsigned n = (file + i) % BENCH_LEN(bench_files);
+
+		snprintf(path, sizeof(path), "%s/%u.%s", dir, n,
+		         bench_files[n].container);
+
+		io_ring_queue(ring, path);
+	}
+
+	io_ring_submit(ring);
+}
+
+/* A file long enough to be split must give the same loudness, loudness
+ * range and peaks when scanned in segments as when scanned serially. Its
+ * level keeps changing, so that blocks missed or measured with cold filters
+ * at the segment boundaries show. Returns the number of mismatches. */
+static int bench_segments(const char *dir) {
+	unsigned n;
+	int fails = 0;
+	char path[PATH_MAX];
+
+	double serial_lufs = 0, serial_lra = 0, serial_peak = 0,
+	       serial_true_peak = 0;
+
+	const bench_file file = {
+		"flac", AV_CODEC_ID_FLAC, SIGNAL_DYNAMIC, 2, 44100
+	};
+
+	snprintf(path, sizeof(path), "%s/segments.flac", dir);
+
+	/* segments are at least 5 minutes long */
+	if (!bench_encode(path, &file, 4 * 300 + 10))
+		return 0;
+
+	for (n = 1; n <= 4; n *= 2) {
+		bool ok = true;
+		double start, elapsed;
+
+		scan_job job;
+		scan_result *result;
+
+		scan_opts opts = {
+			.nb_segments = n,
+			.measure     = SCAN_MEASURE_FULL,
+		};
+
+		memset(&job, 0, sizeof(job));
+
+		start = bench_now();
+
+		if (scan_file(&job, path, &opts) < 0)
+			fail_printf("%s: %s", path, job.error);
+
+		elapsed = bench_now() - start;
+
+		result = scan_get_track_result(&job, 0);
+
+		/* the job was reduced to its track values */
+		if (n == 1) {
+			serial_lufs      = result -> track_loudness;
+			serial_lra       = result -> track_loudness_range;
+			serial_peak      = result -> track_peak;
+			serial_true_peak = job.true_peak;
+		} else {
+			ok = (fabs(result -> track_loudness - serial_lufs) <=
+			      BENCH_SEGMENT_TOLERANCE) &&
+			     (fabs(result -> track_loudness_range - serial_lra) <=
+			      BENCH_SEGMENT_TOLERANCE) &&
+			     (fabs(result -> track_peak - serial_peak) <=
+			      BENCH_SEGMENT_PEAK_TOLERANCE) &&
+			     (fabs(job.true_peak - serial_true_peak) <=
+			      BENCH_SEGMENT_PEAK_TOLERANCE);
+		}
+
+		printf("{\"bench\":\"segments\",\"segments\":%u,"
+		       "\"loudness\":%.3f,\"lra\":%.3f,\"peak\":%.6f,"
+		       "\"true_peak\":%.6f,\"seconds\":%.3f,\"ok\":%s}\n",
+		       n, result -> track_loudness,
+		       result -> track_loudness_range, result -> track_peak,
+		       job.true_peak, elapsed, ok ? "true" : "false");
+
+		if (!ok)
+			fails++;
+
+		free(result);
+		scan_job_free(&job);
+	}
+
+	return fails;
+}
+
+/* A long file whose level keeps changing must give --fast estimates close
+ * to the loudness of a full scan. Returns the number of estimates that
+ * are off by more than BENCH_FAST_TOLERANCE. */
+static int bench_fast(const char *dir) {
+	unsigned n;
+	int fails = 0;
+	char path[PATH_MAX];
+
+	const bench_file file = {
+		"flac", AV_CODEC_ID_FLAC, SIGNAL_DYNAMIC, 2, 44100
+	};
+
+	snprintf(path, sizeof(path), "%s/fast.flac", dir);
+
+	if (!bench_encode(path, &file, 20 * 60))
+		return 0;
+
+	for (n = 4; n <= 32; n *= 2) {
+		bool ok;
+		double full, fast, error, speedup;
+
+		if (bench_compare(path, n, &full, &fast, &error, &speedup) < 0)
+			fail_printf("Could not scan '%s'", path);
+
+		ok = fabs(fast - full) <= BENCH_FAST_TOLERANCE;
+
+		printf("{\"bench\":\"fast\",\"windows\":%u,"
+		       "\"full\":%.3f,\"fast\":%.3f,\"error\":%.3f,"
+		       "\"speedup\":%.2f,\"ok\":%s}\n",
+		       n, full, fast, error, speedup, ok ? "true" : "false");
+
+		if (!ok)
+			fails++;
+	}
+
+	return fails;
+}
+
+/* Scans with -D must measure about the same loudness and peaks as scans
+ * at the full rate. Returns the number of files where they don't. */
+static int bench_downsample(const char *dir, double duration) {
+	unsigned i, d;
+	int fails = 0;
+
+	for (i = 0; i < BENCH_LEN(bench_hires); i++) {
+		bool ok;
+		char path[PATH_MAX];
+
+		double loudness[2], sample_peak[2], true_peak[2], elapsed[2];
+		double loudness_dev, sample_dev, true_dev;
+
+		const bench_file *file = &bench_hires[i];
+
+		snprintf(path, sizeof(path), "%s/hires-%u.%s", dir, i,
+		         file -> container);
+
+		if (!bench_encode(path, file, duration))
+			continue;
+
+		for (d = 0; d < 2; d++) {
+			double start;
+
+			scan_job job;
+
+			scan_opts opts = {
+				.nb_segments = 1,
+				.measure     = SCAN_MEASURE_FULL,
+				.downsample  = d,
+			};
+
+			memset(&job, 0, sizeof(job));
+
+			start = bench_now();
+
+			if (scan_file(&job, path, &opts) < 0)
+				fail_printf("%s: %s", path, job.error);
+
+			elapsed[d] = bench_now() - start;
+
+			scan_job_reduce(&job, NULL);
+
+			loudness[d]    = job.loudness;
+			sample_peak[d] = job.sample_peak;
+			true_peak[d]   = job.true_peak;
+
+			scan_job_free(&job);
+		}
+
+		/* peaks as dB differences */
+		loudness_dev = fabs(loudness[1] - loudness[0]);
+		sample_dev   = fabs(20 * log10(sample_peak[1] / sample_peak[0]));
+		true_dev     = fabs(20 * log10(true_peak[1] / true_peak[0]));
+
+		ok = (loudness_dev <= BENCH_DOWNSAMPLE_TOLERANCE) &&
+		     (sample_dev <= BENCH_DOWNSAMPLE_PEAK_TOLERANCE) &&
+		     (true_dev <= BENCH_DOWNSAMPLE_PEAK_TOLERANCE);
+
+		printf("{\"bench\":\"downsample\",\"signal\":\"%s\","
+		       "\"channels\":%d,\"sample_rate\":%d,"
+		       "\"loudness\":%.3f,\"loudness_dev\":%.3f,"
+		       "\"sample_peak_dev_db\":%.3f,"
+		       "\"true_peak_dev_db\":%.3f,\"speedup\":%.2f,"
+		       "\"ok\":%s}\n",
+		       signal_names[file -> signal], file -> channels,
+		       file -> sample_rate, loudness[0], loudness_dev,
+		       sample_dev, true_dev,
+		       (elapsed[1] > 0) ? elapsed[0] / elapsed[1] : 0,
+		       ok ? "true" : "false");
+
+		if (!ok)
+			fails++;
+	}
+
+	return fails;
+}
+
+/* --fast estimates against full scans on real files. Files too short to be
+ * sampled are only counted, and files that can't be scanned are skipped.
+ * Returns the number of estimates off by more than BENCH_FAST_TOLERANCE. */
+static int bench_corpus(const char *dir) {
+	char *path;
+	char *args[] = { (char *) dir };
+
+	int fails = 0;
+	unsigned nb_files = 0, nb_sampled = 0, nb_within = 0;
+	double max_dev = 0, sum_dev = 0, speedups = 0;
+
+	file_list *list = list_open(args, 1, NULL, '\n');
+	if (list == NULL)
+		fail_printf("Could not read '%s'", dir);
+
+	while ((path = list_next(list)) != NULL) {
+		double full, fast, error, speedup, dev;
+
+		int rc = bench_compare(path, BENCH_FAST_WINDOWS, &full, &fast,
+		                       &error, &speedup);
+
+		nb_files++;
+
+		/* not sampled, or silent */
+		if ((rc <= 0) || !isfinite(full) || !isfinite(fast)) {
+			free(path);
+			continue;
+		}
+
+		dev = fabs(fast - full);
+
+		nb_sampled++;
+		sum_dev  += dev;
+		speedups += speedup;
+
+		if (dev > max_dev)
+			max_dev = dev;
+
+		if (isfinite(error) && (dev <= error))
+			nb_within++;
+
+		if (dev > BENCH_FAST_TOLERANCE)
+			fails++;
+
+		printf("{\"bench\":\"corpus\",\"file\":");
+		stats_json_string(stdout, path);
+		printf(",\"full\":%.3f,\"fast\":%.3f,\"error\":%.3f,"
+		       "\"deviation\":%.3f,\"within\":%s,"
+		       "\"speedup\":%.2f}\n",
+		       full, fast, error, dev,
+		       (isfinite(error) && (dev <= error)) ? "true" : "false",
+		       speedup);
+
+		free(path);
+	}
+
+	list_close(list);
+
+	printf("{\"bench\":\"corpus_summary\",\"files\":%u,"
+	       "\"sampled\":%u,\"max_deviation\":%.3f,"
+	       "\"mean_deviation\":%.3f,\"within_error\":%.3f,"
+	       "\"over_tolerance\":%d,\"mean_speedup\":%.2f}\n",
+	       nb_files, nb_sampled, max_dev,
+	       nb_sampled ? sum_dev / nb_sampled : 0.0,
+	       nb_sampled ? (double) nb_within / nb_sampled : 0.0,
+	       fails, nb_sampled ? speedups / nb_sampled : 0.0);
+
+	return fails;
+}
+
+/* Scan path in full and with nb_windows windows. Returns 1 if the second
+ * scan was sampled, 0 if the file was too short for it and -1 on error. */
+static int bench_compare(const char *path, unsigned nb_windows,
+                         double *full, double *fast, double *error,
+                         double *speedup) {
+	unsigned i;
+	bool estimated = false;
+	double elapsed[2];
+
+	for (i = 0; i < 2; i++) {
+		double start;
+
+		scan_job job;
+
+		scan_opts opts = {
+			.nb_segments = 1,
+			.measure     = SCAN_MEASURE_GAIN,
+			.nb_windows  = (i == 0) ? 0 : nb_windows,
+			.window_len  = BENCH_FAST_LEN,
+		};
+
+		memset(&job, 0, sizeof(job));
+
+		start = bench_now();
+
+		if (scan_file(&job, path, &opts) < 0) {
+			err_printf("%s: %s", path, job.error);
+			scan_job_free(&job);
+
+			return -1;
+		}
+
+		elapsed[i] = bench_now() - start;
+
+		scan_job_reduce(&job, NULL);
+
+		if (i == 0) {
+			*full = job.loudness;
+		} else {
+			*fast  = job.loudness;
+			*error = job.loudness_error;
+
+			estimated = job.estimated;
+		}
+
+		scan_job_free(&job);
+	}
+
+	*speedup = (elapsed[1] > 0) ? elapsed[0] / elapsed[1] : 0;
+
+	return estimated ? 1 : 0;
+}
+
+/* tag_write_*() on the files generated by bench_scan() */
+static void bench_tags(const char *dir, double duration) {
+	unsigned i;
+
+	for (i = 0; i < BENCH_LEN(bench_files); i++) {
+		unsigned runs = 0;
+		double start, elapsed;
+		char path[PATH_MAX];
+
+		scan_result result;
+
+		const bench_file *file = &bench_files[i];
+
+		if ((file -> codec_id != AV_CODEC_ID_MP3) &&
+		    (file -> codec_id != AV_CODEC_ID_FLAC))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%u.%s", dir, i,
+		         file -> container);
+
+		if (access(path, F_OK) != 0)
+			continue;
+
+		memset(&result, 0, sizeof(result));
+
+		result.file     = path;
+		result.codec_id = file -> codec_id;
+
+		start = bench_now();
+
+		do {
+			/* a new value every time, so that something is
+			 * actually written */
+			result.track_gain = result.album_gain = runs * 0.01;
+			result.track_peak = result.album_peak = 0.5;
+
+			if (file -> codec_id == AV_CODEC_ID_MP3)
+				tag_write_mp3(&result);
+			else
+				tag_write_flac(&result);
+
+			runs++;
+
+			elapsed = bench_now() - start;
+		} while (elapsed < BENCH_MIN_TIME);
+
+		printf("{\"bench\":\"tags\",\"container\":\"%s\","
+		       "\"channels\":%d,\"sample_rate\":%d,\"seconds\":%.0f,"
+		       "\"files_per_sec\":%.3f}\n",
+		       file -> container, file -> channels,
+		       file -> sample_rate, duration, runs / elapsed);
+	}
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sample i of channel ch, in [-1, 1] */
+static double bench_sample(bench_gen *gen, int ch, int64_t i, int rate) {
+	switch (gen -> signal) {
+		case SIGNAL_SINE:
+			/* 997Hz at -6dBFS, a different phase on each
+			 * channel */
+			return 0.5 * sin(2 * M_PI * 997 * i / rate + ch);
+
+		case SIGNAL_NOISE:
+			/* uniform white noise at -12dBFS */
+			gen -> seed = gen -> seed * 1664525 + 1013904223;
+			return 0.25 * ((gen -> seed >> 8) / 8388608.0 - 1);
+
+		case SIGNAL_TONES: {
+			/* a few tones from 110Hz to 15kHz, the lowest one
+			 * slowly swelling, around -6dBFS at the loudest */
+			double t = (double) i / rate;
+
+			return 0.2 * (1 + 0.5 * sin(2 * M_PI * t / 7)) *
+			             sin(2 * M_PI * 110 * t + ch) +
+			       0.15 * sin(2 * M_PI * 440 * t) +
+			       0.1 * sin(2 * M_PI * 2500 * t + ch) +
+			       0.05 * sin(2 * M_PI * 9000 * t) +
+			       0.03 * sin(2 * M_PI * 15000 * t + ch);
+		}
+
+		case SIGNAL_DYNAMIC: {
+			/* white noise whose level drifts between about -38
+			 * and -14dBFS over minutes, like a live recording */
+			double t = (double) i / rate;
+			double db = -26 + 8 * sin(2 * M_PI * t / 97) +
+			                  4 * sin(2 * M_PI * t / 431);
+
+			gen -> seed = gen -> seed * 1664525 + 1013904223;
+			return pow(10, db / 20) *
+			       ((gen -> seed >> 8) / 8388608.0 - 1);
+		}
+	}
+
+	return 0;
+}
+
+static AVFrame *bench_frame(enum AVSampleFormat fmt, int channels,
+                            int sample_rate, int nb_samples) {
+	bench_gen gen = { SIGNAL_NOISE, 1 };
+
+	AVFrame *frame = av_frame_alloc();
+	if (frame == NULL)
+		fail_printf("OOM");
+
+	frame -> format         = fmt;
+	frame -> nb_samples     = nb_samples;
+	frame -> sample_rate    = sample_rate;
+	frame -> channel_layout = av_get_default_channel_layout(channels);
+
+	if (av_frame_get_buffer(frame, 0) < 0)
+		fail_printf("OOM");
+
+	bench_fill(frame, &gen, channels, sample_rate, 0);
+
+	return frame;
+}
+
+static void bench_fill(AVFrame *frame, bench_gen *gen, int channels,
+                       int sample_rate, int64_t pos) {
+	int i, c;
+
+	enum AVSampleFormat fmt = frame -> format;
+	bool planar = av_sample_fmt_is_planar(fmt);
+	int bps = av_get_bytes_per_sample(fmt);
+
+	for (i = 0; i < frame -> nb_samples; i++) {
+		for (c = 0; c < channels; c++) {
+			double v = bench_sample(gen, c, pos + i, sample_rate);
+
+			uint8_t *p = planar ?
+				frame -> extended_data[c] + i * bps :
+				frame -> extended_data[0] + (i * channels + c) * bps;
+
+			switch (av_get_packed_sample_fmt(fmt)) {
+				case AV_SAMPLE_FMT_U8:
+					*(uint8_t *) p = lrint(v * 127) + 128;
+					break;
+
+				case AV_SAMPLE_FMT_S16:
+					*(int16_t *) p = lrint(v * 32767);
+					break;
+
+				case AV_SAMPLE_FMT_S32:
+					*(int32_t *) p = lrint(v * 2147483647.0);
+					break;
+
+				case AV_SAMPLE_FMT_FLT:
+					*(float *) p = v;
+					break;
+
+				case AV_SAMPLE_FMT_DBL:
+					*(double *) p = v;
+					break;
+
+				default:
+					fail_printf("Invalid sample format");
+			}
+		}
+	}
+}
+
+/* Write duration seconds of the file's signal to path. Returns false if
+ * libav has no encoder for it. */
+static bool bench_encode(const char *path, const bench_file *file,
+                         double duration) {
+	int rc, got_packet;
+	int64_t pos = 0, len = duration * file -> sample_rate;
+
+	AVCodec *codec;
+	AVStream *stream;
+	AVCodecContext *ctx;
+	AVFormatContext *out;
+	AVFrame *frame;
+	AVPacket packet;
+
+	bench_gen gen = { file -> signal, 1 };
+
+	codec = avcodec_find_encoder(file -> codec_id);
+	if (codec == NULL) {
+		err_printf("No %s encoder, skipping", file -> container);
+		return false;
+	}
+
+	out = avformat_alloc_context();
+	if (out == NULL)
+		fail_printf("OOM");
+
+	out -> oformat = av_guess_format(NULL, path, NULL);
+	if (out -> oformat == NULL)
+		fail_printf("Unknown output format for '%s'", path);
+
+	snprintf(out -> filename, sizeof(out -> filename), "%s", path);
+
+	stream = avformat_new_stream(out, codec);
+	if (stream == NULL)
+		fail_printf("OOM");
+
+	ctx = stream -> codec;
+
+	ctx -> sample_fmt     = codec -> sample_fmts[0];
+	ctx -> sample_rate    = file -> sample_rate;
+	ctx -> channels       = file -> channels;
+	ctx -> channel_layout = av_get_default_channel_layout(file -> channels);
+	ctx -> bit_rate       = 64000 * file -> channels;
+	ctx -> time_base      = av_make_q(1, file -> sample_rate);
+
+	stream -> time_base   = ctx -> time_base;
+
+	if (out -> oformat -> flags & AVFMT_GLOBALHEADER)
+		ctx -> flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+	rc = avcodec_open2(ctx, codec, NULL);
+	if (rc < 0) {
+		char errbuf[2048];
+		av_strerror(rc, errbuf, 2048);
+
+		fail_printf("Could not open encoder: %s", errbuf);
+	}
+
+	rc = avio_open(&out -> pb, path, AVIO_FLAG_WRITE);
+	if (rc < 0) {
+		char errbuf[2048];
+		av_strerror(rc, errbuf, 2048);
+
+		fail_printf("Could not open '%s': %s", path, errbuf);
+	}
+
+	rc = avformat_write_header(out, NULL);
+	if (rc < 0)
+		fail_printf("Could not write header");
+
+	frame = av_frame_alloc();
+	if (frame == NULL)
+		fail_printf("OOM");
+
+	frame -> format         = ctx -> sample_fmt;
+	frame -> channel_layout = ctx -> channel_layout;
+	frame -> sample_rate    = ctx -> sample_rate;
+	frame -> nb_samples     = ctx -> frame_size ? ctx -> frame_size : 1024;
+
+	if (av_frame_get_buffer(frame, 0) < 0)
+		fail_printf("OOM");
+
+	av_init_packet(&packet);
+
+	/* the last frame is padded with more signal, rather than dealing with
+	 * encoders that can't take short frames */
+	do {
+		AVFrame *in = NULL;
+
+		packet.data = NULL;
+		packet.size = 0;
+
+		if (pos < len) {
+			bench_fill(frame, &gen, file -> channels,
+			           file -> sample_rate, pos);
+
+			frame -> pts = pos;
+			pos += frame -> nb_samples;
+
+			in = frame;
+		}
+
+		rc = avcodec_encode_audio2(ctx, &packet, in, &got_packet);
+		if (rc < 0)
+			fail_printf("Could not encode audio");
+
+		if (got_packet) {
+			packet.stream_index = stream -> index;
+
+			packet.pts = av_rescale_q(packet.pts, ctx -> time_base,
+			                          stream -> time_base);
+			packet.dts = av_rescale_q(packet.dts, ctx -> time_base,
+			                          stream -> time_base);
+
+			av_interleaved_write_frame(out, &packet);
+		}
+	} while ((pos < len) || got_packet);
+
+	av_write_trailer(out);
+
+	av_frame_free(&frame);
+
+	avcodec_close(ctx);
+	avio_close(out -> pb);
+	avformat_free_context(out);
+
+	return true;
+}
+
+static inline void help(void) {
+	#define CMD_HELP(CMDS, MSG) printf("  %-10s \t%s.\n", COLOR_YELLOW CMDS COLOR_OFF, MSG);
+
+	printf(COLOR_RED "Usage: " COLOR_OFF);
+	printf(COLOR_GREEN "loudgain-bench " COLOR_OFF);
+	puts("[OPTIONS]\n");
+
+	puts(COLOR_RED " Options:" COLOR_OFF);
+
+	CMD_HELP("-d DIR", "Generate test files in DIR and keep them");
+	CMD_HELP("-t SECS", "Length of the generated test files (default: 30)");
+	CMD_HELP("-m",     "Only run the micro-benchmarks");
+	CMD_HELP("-M",     "Only run the file benchmarks");
+	CMD_HELP("-c DIR", "Compare fast (-x) and full scans of the files in DIR");
+
+	puts("");
+}
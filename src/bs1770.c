@@ -0,0 +1,797 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* the SIMD kernels need GCC or clang for the target attributes and for
+ * detecting what the CPU supports */
+#if defined(__x86_64__) && defined(__GNUC__)
+# define BS1770_X86 1
+# include <immintrin.h>
+#endif
+
+#include "bs1770.h"
+
+/* frames converted to doubles at a time */
+#define BS1770_CHUNK 1024
+
+/* short-term loudness is measured over the last 30 100ms blocks */
+#define BS1770_BLOCKS 30
+
+/* length of the true peak interpolation filter, the same as libebur128's,
+ * and of its longest phase (with 2x oversampling) */
+#define BS1770_TP_TAPS 49
+#define BS1770_TP_LEN  ((BS1770_TP_TAPS + 1) / 2)
+
+#define BS1770_MAX(A, B) ((A) > (B) ? (A) : (B))
+
+/* denormals make the filters very slow once the input goes silent */
+#define BS1770_FLUSH(V) ((fabs(V) < DBL_MIN) ? 0.0 : (V))
+
+typedef void (*bs1770_kernel)(bs1770 *st, const double *in, size_t n);
+
+struct bs1770 {
+	int           channels;
+	unsigned      mode;
+
+	/* channels rounded up to a multiple of 4, the length of the per
+	 * channel arrays below */
+	int           stride;
+
+	bs1770_kernel filter;
+	bs1770_kernel true_peak_filter;
+
+	/* K-weighting as two biquads, b0 b1 b2 a1 a2 each */
+	double        kw[2][5];
+
+	/* z1 and z2 of both biquads, stride values each */
+	double       *state;
+
+	double       *weights;
+
+	/* sum of the squared K-weighted samples of the current 100ms block,
+	 * and weighted sums of the last BS1770_BLOCKS blocks */
+	double       *energy;
+	double        blocks[BS1770_BLOCKS];
+
+	unsigned long nb_blocks;
+	unsigned long block_len;
+	unsigned long block_fill;
+
+	double       *sample_peak;
+	double       *true_peak;
+
+	/* oversampling factor and taps of each phase, oldest sample first,
+	 * with the last tp_len samples of each channel stored twice in a row
+	 * so that they can always be read in order from tp_pos + 1 */
+	int           tp_factor;
+	int           tp_len;
+	double        tp_coeffs[BS1770_TP_LEN][4];
+	double       *tp_history;
+	unsigned      tp_pos;
+
+	/* the input converted to doubles */
+	double       *buf;
+};
+
+static void bs1770_filter_scalar(bs1770 *st, const double *in, size_t n);
+static void bs1770_tp_scalar(bs1770 *st, const double *in, size_t n);
+
+#ifdef BS1770_X86
+static void bs1770_filter_sse2(bs1770 *st, const double *in, size_t n);
+static void bs1770_tp_sse2(bs1770 *st, const double *in, size_t n);
+static void bs1770_filter_avx2(bs1770 *st, const double *in, size_t n);
+static void bs1770_tp_avx2(bs1770 *st, const double *in, size_t n);
+#endif
+
+static const struct {
+	const char   *name;
+	bs1770_kernel filter;
+	bs1770_kernel true_peak;
+} bs1770_kernels[] = {
+	[BS1770_ISA_SCALAR] = { "scalar", bs1770_filter_scalar, bs1770_tp_scalar },
+#ifdef BS1770_X86
+	[BS1770_ISA_SSE2]   = { "sse2",   bs1770_filter_sse2,   bs1770_tp_sse2 },
+	[BS1770_ISA_AVX2]   = { "avx2",   bs1770_filter_avx2,   bs1770_tp_avx2 },
+#endif
+};
+
+static bs1770_isa bs1770_limit = BS1770_ISA_AVX2;
+
+static void bs1770_init_filter(bs1770 *st, int sample_rate);
+static void bs1770_init_true_peak(bs1770 *st, int sample_rate);
+static void bs1770_peaks(bs1770 *st, size_t n);
+static void bs1770_block(bs1770 *st);
+static double bs1770_window(const bs1770 *st, unsigned long nb_blocks);
+
+bs1770 *bs1770_new(int channels, int sample_rate, unsigned mode) {
+	int c;
+	bs1770_isa isa = bs1770_isa_best();
+
+	bs1770 *st;
+
+	if ((channels <= 0) || (sample_rate < 10))
+		return NULL;
+
+	st = calloc(1, sizeof(bs1770));
+	if (st == NULL)
+		return NULL;
+
+	st -> channels = channels;
+	st -> mode     = mode;
+	st -> stride   = (channels + 3) & ~3;
+
+	st -> state       = calloc(4 * st -> stride, sizeof(double));
+	st -> weights     = calloc(st -> stride, sizeof(double));
+	st -> energy      = calloc(st -> stride, sizeof(double));
+	st -> sample_peak = calloc(st -> stride, sizeof(double));
+	st -> true_peak   = calloc(st -> stride, sizeof(double));
+	st -> buf         = malloc(BS1770_CHUNK * channels * sizeof(double));
+
+	if ((st -> state == NULL) || (st -> weights == NULL) ||
+	    (st -> energy == NULL) || (st -> sample_peak == NULL) ||
+	    (st -> true_peak == NULL) || (st -> buf == NULL)) {
+		bs1770_free(st);
+		return NULL;
+	}
+
+	if (isa > bs1770_limit)
+		isa = bs1770_limit;
+
+	st -> filter           = bs1770_kernels[isa].filter;
+	st -> true_peak_filter = bs1770_kernels[isa].true_peak;
+
+	/* the same default channel map as libebur128: L, R, C, LFE, Ls, Rs
+	 * and the rest unused, or L, R, Ls, Rs and L, R, C, Ls, Rs */
+	for (c = 0; c < channels; c++) {
+		int ch = c;
+
+		if ((channels == 4) && (c >= 2))
+			ch = c + 2;
+		else if ((channels == 5) && (c >= 3))
+			ch = c + 1;
+
+		switch (ch) {
+			case 0: case 1: case 2:
+				st -> weights[c] = 1.0;
+				break;
+
+			case 4: case 5:
+				st -> weights[c] = 1.41;
+				break;
+		}
+	}
+
+	st -> block_len = (sample_rate + 5) / 10;
+
+	bs1770_init_filter(st, sample_rate);
+
+	if (mode & BS1770_TRUE_PEAK) {
+		bs1770_init_true_peak(st, sample_rate);
+
+		st -> tp_history = calloc(channels * 2 * st -> tp_len,
+		                          sizeof(double));
+		if (st -> tp_history == NULL) {
+			bs1770_free(st);
+			return NULL;
+		}
+	}
+
+	return st;
+}
+
+void bs1770_free(bs1770 *st) {
+	if (st == NULL)
+		return;
+
+	free(st -> state);
+	free(st -> weights);
+	free(st -> energy);
+	free(st -> sample_peak);
+	free(st -> true_peak);
+	free(st -> tp_history);
+	free(st -> buf);
+
+	free(st);
+}
+
+void bs1770_reset(bs1770 *st) {
+	memset(st -> state, 0, 4 * st -> stride * sizeof(double));
+	memset(st -> energy, 0, st -> stride * sizeof(double));
+	memset(st -> sample_peak, 0, st -> stride * sizeof(double));
+	memset(st -> true_peak, 0, st -> stride * sizeof(double));
+	memset(st -> blocks, 0, sizeof(st -> blocks));
+
+	st -> nb_blocks  = 0;
+	st -> block_fill = 0;
+
+	if (st -> tp_history != NULL)
+		memset(st -> tp_history, 0,
+		       st -> channels * 2 * st -> tp_len * sizeof(double));
+
+	st -> tp_pos = 0;
+}
+
+#define BS1770_CONVERT(TYPE, SCALE)					\
+	do {								\
+		size_t i;						\
+		const TYPE *src = (const TYPE *) data + done * ch;	\
+									\
+		for (i = 0; i < n * ch; i++)				\
+			st -> buf[i] = src[i] * (SCALE);		\
+	} while (0)
+
+int bs1770_add(bs1770 *st, bs1770_format fmt, const void *data,
+               size_t nb_samples) {
+	size_t done = 0;
+	int ch = st -> channels;
+
+	/* without interpolation the true peak is the sample peak */
+	bool true_peak = (st -> mode & BS1770_TRUE_PEAK) &&
+	                 (st -> tp_factor > 1);
+	bool peaks = (st -> mode & BS1770_SAMPLE_PEAK) ||
+	             ((st -> mode & BS1770_TRUE_PEAK) && !true_peak);
+
+	if ((fmt != BS1770_S16) && (fmt != BS1770_S32) &&
+	    (fmt != BS1770_FLT) && (fmt != BS1770_DBL))
+		return -1;
+
+	while (done < nb_samples) {
+		size_t n = nb_samples - done;
+
+		if (n > BS1770_CHUNK)
+			n = BS1770_CHUNK;
+
+		if (n > st -> block_len - st -> block_fill)
+			n = st -> block_len - st -> block_fill;
+
+		/* the same scaling as libebur128 */
+		switch (fmt) {
+			case BS1770_S16:
+				BS1770_CONVERT(int16_t, 1.0 / 32768.0);
+				break;
+
+			case BS1770_S32:
+				BS1770_CONVERT(int32_t, 1.0 / 2147483648.0);
+				break;
+
+			case BS1770_FLT:
+				BS1770_CONVERT(float, 1.0);
+				break;
+
+			case BS1770_DBL:
+				BS1770_CONVERT(double, 1.0);
+				break;
+		}
+
+		if (peaks)
+			bs1770_peaks(st, n);
+
+		st -> filter(st, st -> buf, n);
+
+		if (true_peak) {
+			st -> true_peak_filter(st, st -> buf, n);
+			st -> tp_pos = (st -> tp_pos + n) % st -> tp_len;
+		}
+
+		done += n;
+
+		st -> block_fill += n;
+
+		if (st -> block_fill == st -> block_len)
+			bs1770_block(st);
+	}
+
+	return 0;
+}
+
+double bs1770_momentary(const bs1770 *st) {
+	return bs1770_window(st, 4);
+}
+
+double bs1770_short_term(const bs1770 *st) {
+	return bs1770_window(st, BS1770_BLOCKS);
+}
+
+double bs1770_sample_peak(const bs1770 *st, int ch) {
+	if ((ch < 0) || (ch >= st -> channels))
+		return 0.0;
+
+	return st -> sample_peak[ch];
+}
+
+/* like libebur128, never below the sample peak */
+double bs1770_true_peak(const bs1770 *st, int ch) {
+	if ((ch < 0) || (ch >= st -> channels) ||
+	    !(st -> mode & BS1770_TRUE_PEAK))
+		return 0.0;
+
+	return BS1770_MAX(st -> true_peak[ch], st -> sample_peak[ch]);
+}
+
+bs1770_isa bs1770_isa_best(void) {
+#ifdef BS1770_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return BS1770_ISA_AVX2;
+
+	if (__builtin_cpu_supports("sse2"))
+		return BS1770_ISA_SSE2;
+#endif
+
+	return BS1770_ISA_SCALAR;
+}
+
+void bs1770_isa_limit(bs1770_isa isa) {
+	bs1770_limit = isa;
+}
+
+const char *bs1770_isa_name(bs1770_isa isa) {
+	if (isa > bs1770_isa_best())
+		return NULL;
+
+	return bs1770_kernels[isa].name;
+}
+
+/* The K-weighting of BS.1770: a high shelf and a high pass, computed for
+ * the sample rate the same way as libebur128 does. */
+static void bs1770_init_filter(bs1770 *st, int sample_rate) {
+	double f0 = 1681.974450955533;
+	double G  = 3.999843853973347;
+	double Q  = 0.7071752369554196;
+
+	double K  = tan(M_PI * f0 / sample_rate);
+	double Vh = pow(10.0, G / 20.0);
+	double Vb = pow(Vh, 0.4996667741545416);
+
+	double a0 = 1.0 + K / Q + K * K;
+
+	st -> kw[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+	st -> kw[0][1] = 2.0 * (K * K - Vh) / a0;
+	st -> kw[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+	st -> kw[0][3] = 2.0 * (K * K - 1.0) / a0;
+	st -> kw[0][4] = (1.0 - K / Q + K * K) / a0;
+
+	f0 = 38.13547087602444;
+	Q  = 0.5003270373238773;
+	K  = tan(M_PI * f0 / sample_rate);
+
+	st -> kw[1][0] = 1.0;
+	st -> kw[1][1] = -2.0;
+	st -> kw[1][2] = 1.0;
+	st -> kw[1][3] = 2.0 * (K * K - 1.0) / (1.0 + K / Q + K * K);
+	st -> kw[1][4] = (1.0 - K / Q + K * K) / (1.0 + K / Q + K * K);
+}
+
+/* Hann windowed sinc interpolation, 4x below 96kHz, 2x below 192kHz and
+ * none above, split into one filter per phase like libebur128's. */
+static void bs1770_init_true_peak(bs1770 *st, int sample_rate) {
+	int j;
+
+	st -> tp_factor = (sample_rate < 96000) ? 4 :
+	                  (sample_rate < 192000) ? 2 : 1;
+
+	/* the sample peak is close enough */
+	if (st -> tp_factor == 1) {
+		st -> tp_len = 1;
+		return;
+	}
+
+	st -> tp_len = (BS1770_TP_TAPS + st -> tp_factor - 1) / st -> tp_factor;
+
+	for (j = 0; j < BS1770_TP_TAPS; j++) {
+		int lag = j / st -> tp_factor;
+
+		double m = j - (BS1770_TP_TAPS - 1) / 2.0;
+		double c = 1.0;
+
+		if (fabs(m) > 0.000001)
+			c = sin(m * M_PI / st -> tp_factor) /
+			    (m * M_PI / st -> tp_factor);
+
+		c *= 0.5 * (1 - cos(2 * M_PI * j / (BS1770_TP_TAPS - 1)));
+
+		if (fabs(c) > 0.000001)
+			st -> tp_coeffs[st -> tp_len - 1 - lag]
+			               [j % st -> tp_factor] = c;
+	}
+}
+
+static void bs1770_peaks(bs1770 *st, size_t n) {
+	size_t i;
+	int c, ch = st -> channels;
+
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < ch; c++) {
+			double v = fabs(st -> buf[i * ch + c]);
+
+			if (v > st -> sample_peak[c])
+				st -> sample_peak[c] = v;
+		}
+	}
+}
+
+static void bs1770_block(bs1770 *st) {
+	int c;
+	double sum = 0.0;
+
+	for (c = 0; c < st -> channels; c++) {
+		sum += st -> weights[c] * st -> energy[c];
+		st -> energy[c] = 0.0;
+	}
+
+	st -> blocks[st -> nb_blocks % BS1770_BLOCKS] = sum;
+
+	st -> nb_blocks++;
+	st -> block_fill = 0;
+}
+
+/* Loudness of the last nb_blocks 100ms blocks, blocks from before the
+ * start count as silence. */
+static double bs1770_window(const bs1770 *st, unsigned long nb_blocks) {
+	unsigned long i;
+	double sum = 0.0;
+
+	for (i = 1; (i <= nb_blocks) && (i <= st -> nb_blocks); i++)
+		sum += st -> blocks[(st -> nb_blocks - i) % BS1770_BLOCKS];
+
+	sum /= nb_blocks * st -> block_len;
+
+	if (sum <= 0.0)
+		return -HUGE_VAL;
+
+	return 10 * log10(sum) - 0.691;
+}
+
+static void bs1770_flush(bs1770 *st, int c, int lanes) {
+	int k, l;
+
+	for (k = 0; k < 4; k++)
+		for (l = c; l < c + lanes; l++)
+			st -> state[k * st -> stride + l] =
+				BS1770_FLUSH(st -> state[k * st -> stride + l]);
+}
+
+/* Both biquads, transposed direct form II, on one channel. */
+static void bs1770_filter_lane(bs1770 *st, const double *in, size_t n,
+                               int c) {
+	size_t i;
+
+	const double *k0 = st -> kw[0], *k1 = st -> kw[1];
+
+	double *z = st -> state + c;
+	int s = st -> stride, ch = st -> channels;
+
+	double z0 = z[0], z1 = z[s], z2 = z[2 * s], z3 = z[3 * s];
+	double sum = 0.0;
+
+	for (i = 0; i < n; i++) {
+		double x = in[i * ch + c];
+		double y = k0[0] * x + z0;
+
+		z0 = k0[1] * x - k0[3] * y + z1;
+		z1 = k0[2] * x - k0[4] * y;
+
+		x = y;
+		y = k1[0] * x + z2;
+
+		z2 = k1[1] * x - k1[3] * y + z3;
+		z3 = k1[2] * x - k1[4] * y;
+
+		sum += y * y;
+	}
+
+	z[0]     = z0;
+	z[s]     = z1;
+	z[2 * s] = z2;
+	z[3 * s] = z3;
+
+	bs1770_flush(st, c, 1);
+
+	st -> energy[c] += sum;
+}
+
+static void bs1770_filter_scalar(bs1770 *st, const double *in, size_t n) {
+	int c;
+
+	for (c = 0; c < st -> channels; c++)
+		bs1770_filter_lane(st, in, n, c);
+}
+
+/* The interpolation of one channel, at tp_factor times the rate. */
+static void bs1770_tp_lane(bs1770 *st, const double *in, size_t n, int c) {
+	size_t i;
+	int f, j;
+
+	int len = st -> tp_len, ch = st -> channels;
+	unsigned pos = st -> tp_pos;
+
+	double *h = st -> tp_history + c * 2 * len;
+	double peak = st -> true_peak[c];
+
+	for (i = 0; i < n; i++) {
+		const double *w = h + pos + 1;
+
+		h[pos] = h[pos + len] = in[i * ch + c];
+
+		for (f = 0; f < st -> tp_factor; f++) {
+			double y = 0.0;
+
+			for (j = 0; j < len; j++)
+				y += st -> tp_coeffs[j][f] * w[j];
+
+			peak = BS1770_MAX(peak, fabs(y));
+		}
+
+		if (++pos == (unsigned) len)
+			pos = 0;
+	}
+
+	st -> true_peak[c] = peak;
+}
+
+static void bs1770_tp_scalar(bs1770 *st, const double *in, size_t n) {
+	int c;
+
+	for (c = 0; c < st -> channels; c++)
+		bs1770_tp_lane(st, in, n, c);
+}
+
+#ifdef BS1770_X86
+
+/* The SIMD filters run the same biquads on 2 or 4 channels at once, the
+ * interpolation computes all the phases of one channel at once instead. */
+
+#define BS1770_SET(VEC, SET)						\
+	VEC b00 = SET(st -> kw[0][0]), b01 = SET(st -> kw[0][1]),	\
+	    b02 = SET(st -> kw[0][2]), a01 = SET(st -> kw[0][3]),	\
+	    a02 = SET(st -> kw[0][4]), b10 = SET(st -> kw[1][0]),	\
+	    b11 = SET(st -> kw[1][1]), b12 = SET(st -> kw[1][2]),	\
+	    a11 = SET(st -> kw[1][3]), a12 = SET(st -> kw[1][4])
+
+#define BS1770_BIQUADS(X, Y, ADD, SUB, MUL)				\
+	do {								\
+		Y  = ADD(MUL(b00, X), z0);				\
+		z0 = ADD(SUB(MUL(b01, X), MUL(a01, Y)), z1);		\
+		z1 = SUB(MUL(b02, X), MUL(a02, Y));			\
+									\
+		X  = Y;							\
+		Y  = ADD(MUL(b10, X), z2);				\
+		z2 = ADD(SUB(MUL(b11, X), MUL(a11, Y)), z3);		\
+		z3 = SUB(MUL(b12, X), MUL(a12, Y));			\
+	} while (0)
+
+static inline void bs1770_filter_pair(bs1770 *st, const double *in,
+                                      size_t n, int c) {
+	size_t i;
+
+	double *z = st -> state + c;
+	int s = st -> stride, ch = st -> channels;
+
+	BS1770_SET(__m128d, _mm_set1_pd);
+
+	__m128d z0 = _mm_loadu_pd(z),         z1 = _mm_loadu_pd(z + s),
+	        z2 = _mm_loadu_pd(z + 2 * s), z3 = _mm_loadu_pd(z + 3 * s);
+	__m128d sum = _mm_setzero_pd();
+
+	for (i = 0; i < n; i++) {
+		__m128d y, x = _mm_loadu_pd(in + i * ch + c);
+
+		BS1770_BIQUADS(x, y, _mm_add_pd, _mm_sub_pd, _mm_mul_pd);
+
+		sum = _mm_add_pd(sum, _mm_mul_pd(y, y));
+	}
+
+	_mm_storeu_pd(z, z0);
+	_mm_storeu_pd(z + s, z1);
+	_mm_storeu_pd(z + 2 * s, z2);
+	_mm_storeu_pd(z + 3 * s, z3);
+
+	bs1770_flush(st, c, 2);
+
+	_mm_storeu_pd(st -> energy + c,
+	              _mm_add_pd(_mm_loadu_pd(st -> energy + c), sum));
+}
+
+static void bs1770_filter_sse2(bs1770 *st, const double *in, size_t n) {
+	int c = 0;
+
+	for (; c + 2 <= st -> channels; c += 2)
+		bs1770_filter_pair(st, in, n, c);
+
+	for (; c < st -> channels; c++)
+		bs1770_filter_lane(st, in, n, c);
+}
+
+static void bs1770_tp_sse2(bs1770 *st, const double *in, size_t n) {
+	int c;
+
+	const __m128d sign = _mm_set1_pd(-0.0);
+
+	for (c = 0; c < st -> channels; c++) {
+		size_t i;
+		int j;
+
+		int len = st -> tp_len, ch = st -> channels;
+		unsigned pos = st -> tp_pos;
+
+		double *h = st -> tp_history + c * 2 * len;
+		double peak[2];
+
+		__m128d max = _mm_setzero_pd();
+
+		for (i = 0; i < n; i++) {
+			const double *w = h + pos + 1;
+
+			__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+
+			h[pos] = h[pos + len] = in[i * ch + c];
+
+			for (j = 0; j < len; j++) {
+				__m128d x = _mm_set1_pd(w[j]);
+
+				acc0 = _mm_add_pd(acc0, _mm_mul_pd(
+					_mm_loadu_pd(st -> tp_coeffs[j]), x));
+				acc1 = _mm_add_pd(acc1, _mm_mul_pd(
+					_mm_loadu_pd(st -> tp_coeffs[j] + 2), x));
+			}
+
+			max = _mm_max_pd(max, _mm_max_pd(
+				_mm_andnot_pd(sign, acc0),
+				_mm_andnot_pd(sign, acc1)
+			));
+
+			if (++pos == (unsigned) len)
+				pos = 0;
+		}
+
+		_mm_storeu_pd(peak, max);
+
+		st -> true_peak[c] = BS1770_MAX(st -> true_peak[c],
+		                                BS1770_MAX(peak[0], peak[1]));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void bs1770_filter_quad(bs1770 *st, const double *in,
+                                      size_t n, int c) {
+	size_t i;
+
+	double *z = st -> state + c;
+	int s = st -> stride, ch = st -> channels;
+
+	BS1770_SET(__m256d, _mm256_set1_pd);
+
+	__m256d z0 = _mm256_loadu_pd(z),         z1 = _mm256_loadu_pd(z + s),
+	        z2 = _mm256_loadu_pd(z + 2 * s), z3 = _mm256_loadu_pd(z + 3 * s);
+	__m256d sum = _mm256_setzero_pd();
+
+	for (i = 0; i < n; i++) {
+		__m256d y, x = _mm256_loadu_pd(in + i * ch + c);
+
+		BS1770_BIQUADS(x, y, _mm256_add_pd, _mm256_sub_pd,
+		               _mm256_mul_pd);
+
+		sum = _mm256_add_pd(sum, _mm256_mul_pd(y, y));
+	}
+
+	_mm256_storeu_pd(z, z0);
+	_mm256_storeu_pd(z + s, z1);
+	_mm256_storeu_pd(z + 2 * s, z2);
+	_mm256_storeu_pd(z + 3 * s, z3);
+
+	bs1770_flush(st, c, 4);
+
+	_mm256_storeu_pd(st -> energy + c,
+	                 _mm256_add_pd(_mm256_loadu_pd(st -> energy + c), sum));
+}
+
+__attribute__((target("avx2")))
+static void bs1770_filter_avx2(bs1770 *st, const double *in, size_t n) {
+	int c = 0;
+
+	for (; c + 4 <= st -> channels; c += 4)
+		bs1770_filter_quad(st, in, n, c);
+
+	for (; c + 2 <= st -> channels; c += 2)
+		bs1770_filter_pair(st, in, n, c);
+
+	for (; c < st -> channels; c++)
+		bs1770_filter_lane(st, in, n, c);
+}
+
+__attribute__((target("avx2")))
+static void bs1770_tp_avx2(bs1770 *st, const double *in, size_t n) {
+	int c;
+
+	const __m256d sign = _mm256_set1_pd(-0.0);
+
+	for (c = 0; c < st -> channels; c++) {
+		size_t i;
+		int j;
+
+		int len = st -> tp_len, ch = st -> channels;
+		unsigned pos = st -> tp_pos;
+
+		double *h = st -> tp_history + c * 2 * len;
+		double peak[4];
+
+		__m256d max = _mm256_setzero_pd();
+
+		for (i = 0; i < n; i++) {
+			const double *w = h + pos + 1;
+
+			/* two sums, to halve the chain of dependent adds */
+			__m256d acc = _mm256_setzero_pd(), acc1 = acc;
+
+			h[pos] = h[pos + len] = in[i * ch + c];
+
+			for (j = 0; j + 1 < len; j += 2) {
+				acc  = _mm256_add_pd(acc, _mm256_mul_pd(
+					_mm256_loadu_pd(st -> tp_coeffs[j]),
+					_mm256_set1_pd(w[j])
+				));
+				acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(
+					_mm256_loadu_pd(st -> tp_coeffs[j + 1]),
+					_mm256_set1_pd(w[j + 1])
+				));
+			}
+
+			if (j < len)
+				acc = _mm256_add_pd(acc, _mm256_mul_pd(
+					_mm256_loadu_pd(st -> tp_coeffs[j]),
+					_mm256_set1_pd(w[j])
+				));
+
+			acc = _mm256_add_pd(acc, acc1);
+
+			max = _mm256_max_pd(max, _mm256_andnot_pd(sign, acc));
+
+			if (++pos == (unsigned) len)
+				pos = 0;
+		}
+
+		_mm256_storeu_pd(peak, max);
+
+		st -> true_peak[c] = BS1770_MAX(
+			st -> true_peak[c],
+			BS1770_MAX(BS1770_MAX(peak[0], peak[1]),
+			           BS1770_MAX(peak[2], peak[3]))
+		);
+	}
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An in-tree replacement for the parts of libebur128 that loudgain uses:
+ * K-weighting, the energy of the last 400ms and 3s, and sample and true
+ * peaks. Filters run on several channels at once with SSE2 or AVX2 when
+ * the CPU has them. */
+
+/* what to measure on top of momentary loudness */
+#define BS1770_SHORT_TERM  (1 << 0)
+#define BS1770_SAMPLE_PEAK (1 << 1)
+#define BS1770_TRUE_PEAK   (1 << 2)
+
+typedef enum {
+	BS1770_S16,
+	BS1770_S32,
+	BS1770_FLT,
+	BS1770_DBL,
+} bs1770_format;
+
+typedef enum {
+	BS1770_ISA_SCALAR,
+	BS1770_ISA_SSE2,
+	BS1770_ISA_AVX2,
+} bs1770_isa;
+
+typedef struct bs1770 bs1770;
+
+/* NULL if out of memory or if the parameters are invalid */
+bs1770 *bs1770_new(int channels, int sample_rate, unsigned mode);
+void bs1770_free(bs1770 *st);
+
+/* start over as if just created, to measure another input */
+void bs1770_reset(bs1770 *st);
+
+/* interleaved samples, returns -1 on invalid formats */
+int bs1770_add(bs1770 *st, bs1770_format fmt, const void *data,
+               size_t nb_samples);
+
+/* Loudness of the last 400ms and 3s in LUFS, -HUGE_VAL if silent. The
+ * windows end at the last 100ms boundary, so they match libebur128 when
+ * asked right after one. */
+double bs1770_momentary(const bs1770 *st);
+double bs1770_short_term(const bs1770 *st);
+
+/* 0 if the peak wasn't measured. Like libebur128, the true peak is never
+ * below the sample peak, but only when that is measured too. */
+double bs1770_sample_peak(const bs1770 *st, int ch);
+double bs1770_true_peak(const bs1770 *st, int ch);
+
+/* The best kernels the CPU can run, and a cap on the kernels picked by
+ * bs1770_new() from then on, so that loudgain-bench can compare them. */
+bs1770_isa bs1770_isa_best(void);
+void bs1770_isa_limit(bs1770_isa isa);
+const char *bs1770_isa_name(bs1770_isa isa);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,610 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The cache file is a 16 byte header followed by an append-only list of
+ * records, each holding the key of a file and the summary of its scan with
+ * only the used part of each histogram stored. Records are appended under
+ * an exclusive flock(), so several processes can share the same cache. A
+ * torn record left behind by an interrupted process is cut off the next
+ * time the cache is opened.
+ *
+ * The whole file is mmap()ed when the cache is opened, and an in-memory
+ * hash table maps files, by device and inode, to their last record. Older
+ * records of the same file are dead: they were written before it changed,
+ * or by a scan with a different profile or engine. Records appended later,
+ * by this or any other process, are only seen the next time the cache is
+ * opened.
+ *
+ * When dead records outnumber live ones, the live ones are copied to a new
+ * file that replaces the cache. Processes that had the old one open keep
+ * reading it, and what they append to it is lost, which only costs them a
+ * rescan the next time.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scan.h"
+#include "cache.h"
+#include "printf.h"
+
+#define CACHE_MAGIC        "LGCACHE3"
+#define CACHE_RECORD_MAGIC 0x3152474c /* "LGR1" */
+
+/* byte order marker, caches are not portable across architectures */
+#define CACHE_ENDIAN       0x01020304
+
+typedef struct {
+	char     magic[8];
+	uint32_t endian;
+	uint32_t reserved;
+} cache_header;
+
+typedef struct {
+	uint32_t  magic;
+	uint32_t  size;       /* of the whole record, a multiple of 8 */
+	uint32_t  checksum;   /* of the whole record, with this set to 0 */
+	int32_t   codec_id;
+
+	cache_key key;
+
+	double    sample_peak;
+	double    true_peak;
+
+	uint32_t  measure;
+	uint32_t  engine;
+
+	/* only bins [first, first + count) of each histogram are stored,
+	 * after this header, the block histogram first */
+	uint16_t  block_first;
+	uint16_t  block_count;
+	uint16_t  short_term_first;
+	uint16_t  short_term_count;
+} cache_record;
+
+struct scan_cache {
+	int              fd;
+	bool             hash;
+
+	uint8_t         *map;
+	size_t           map_size;
+
+	/* open addressing table of record offsets, 0 is an empty slot */
+	size_t          *index;
+	size_t           index_size;
+
+	/* number of records, and of files they are for */
+	size_t           nb_records;
+	size_t           nb_live;
+
+	pthread_mutex_t  lock;
+};
+
+static uint32_t cache_checksum(const cache_record *rec);
+static uint64_t cache_fnv64(uint64_t hash, const void *data, size_t size);
+static bool cache_record_valid(scan_cache *cache, size_t off);
+static void cache_load(scan_cache *cache, const char *path);
+static void cache_compact(scan_cache *cache, const char *path);
+static size_t *cache_index_find(scan_cache *cache, const cache_key *key);
+static bool cache_index_add(scan_cache *cache, size_t off);
+static void cache_hist_range(const uint32_t *hist,
+                             uint16_t *first, uint16_t *count);
+
+scan_cache *cache_open(const char *path, bool hash) {
+	scan_cache *cache = calloc(1, sizeof(scan_cache));
+	if (cache == NULL)
+		fail_printf("OOM");
+
+	cache -> hash = hash;
+
+	cache -> fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (cache -> fd < 0)
+		sysf_printf("Could not open cache '%s'", path);
+
+	/* the exclusive lock keeps writers out while looking for a torn
+	 * record at the end of the file, and while compacting it */
+	if (flock(cache -> fd, LOCK_EX) < 0)
+		sysf_printf("flock()");
+
+	cache_load(cache, path);
+
+	if (cache -> nb_records - cache -> nb_live > cache -> nb_live)
+		cache_compact(cache, path);
+
+	flock(cache -> fd, LOCK_UN);
+
+	pthread_mutex_init(&cache -> lock, NULL);
+
+	return cache;
+}
+
+void cache_close(scan_cache *cache) {
+	if (cache == NULL)
+		return;
+
+	munmap(cache -> map, cache -> map_size);
+
+	close(cache -> fd);
+
+	pthread_mutex_destroy(&cache -> lock);
+
+	free(cache -> index);
+	free(cache);
+}
+
+int cache_key_get(scan_cache *cache, const char *file, cache_key *key) {
+	struct stat st;
+
+	memset(key, 0, sizeof(cache_key));
+
+	if (stat(file, &st) < 0)
+		return -1;
+
+	key -> dev        = st.st_dev;
+	key -> ino        = st.st_ino;
+	key -> size       = st.st_size;
+	key -> mtime_sec  = st.st_mtim.tv_sec;
+	key -> mtime_nsec = st.st_mtim.tv_nsec;
+
+	if (cache -> hash) {
+		ssize_t rc;
+		uint8_t buf[65536];
+
+		int fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+
+		key -> hash = 0xcbf29ce484222325ULL;
+
+		while ((rc = read(fd, buf, sizeof(buf))) > 0)
+			key -> hash = cache_fnv64(key -> hash, buf, rc);
+
+		close(fd);
+
+		if (rc < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+bool cache_lookup(scan_cache *cache, const cache_key *key,
+                  int *codec_id, unsigned *engine, scan_summary *summary) {
+	const cache_record *rec;
+	const uint32_t *hist;
+
+	size_t *slot = cache_index_find(cache, key);
+
+	/* only the last record of a file is used, older ones are stale */
+	if (*slot == 0)
+		return false;
+
+	rec  = (cache_record *) (cache -> map + *slot);
+	hist = (const uint32_t *) (rec + 1);
+
+	if (memcmp(&rec -> key, key, sizeof(*key)))
+		return false;
+
+	memset(summary, 0, sizeof(scan_summary));
+
+	memcpy(summary -> block_hist + rec -> block_first, hist,
+	       rec -> block_count * sizeof(uint32_t));
+	hist += rec -> block_count;
+
+	memcpy(summary -> short_term_hist + rec -> short_term_first, hist,
+	       rec -> short_term_count * sizeof(uint32_t));
+
+	summary -> sample_peak = rec -> sample_peak;
+	summary -> true_peak   = rec -> true_peak;
+	summary -> measure     = rec -> measure;
+
+	*codec_id = rec -> codec_id;
+	*engine   = rec -> engine;
+
+	return true;
+}
+
+void cache_store(scan_cache *cache, const cache_key *key,
+                 int codec_id, unsigned engine, const scan_summary *summary) {
+	size_t size;
+	uint32_t *hist;
+
+	cache_record *rec;
+	cache_record hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	cache_hist_range(summary -> block_hist,
+	                 &hdr.block_first, &hdr.block_count);
+	cache_hist_range(summary -> short_term_hist,
+	                 &hdr.short_term_first, &hdr.short_term_count);
+
+	size = sizeof(cache_record) +
+	       (hdr.block_count + hdr.short_term_count) * sizeof(uint32_t);
+	size = (size + 7) & ~(size_t) 7;
+
+	rec = calloc(1, size);
+	if (rec == NULL)
+		fail_printf("OOM");
+
+	*rec = hdr;
+
+	rec -> magic       = CACHE_RECORD_MAGIC;
+	rec -> size        = size;
+	rec -> codec_id    = codec_id;
+	rec -> key         = *key;
+	rec -> sample_peak = summary -> sample_peak;
+	rec -> true_peak   = summary -> true_peak;
+	rec -> measure     = summary -> measure;
+	rec -> engine      = engine;
+
+	hist = (uint32_t *) (rec + 1);
+
+	memcpy(hist, summary -> block_hist + hdr.block_first,
+	       hdr.block_count * sizeof(uint32_t));
+	hist += hdr.block_count;
+
+	memcpy(hist, summary -> short_term_hist + hdr.short_term_first,
+	       hdr.short_term_count * sizeof(uint32_t));
+
+	rec -> checksum = cache_checksum(rec);
+
+	pthread_mutex_lock(&cache -> lock);
+
+	if (flock(cache -> fd, LOCK_EX) < 0)
+		sysf_printf("flock()");
+
+	if (write(cache -> fd, rec, size) != (ssize_t) size)
+		err_printf("Could not write to cache");
+
+	flock(cache -> fd, LOCK_UN);
+
+	pthread_mutex_unlock(&cache -> lock);
+
+	free(rec);
+}
+
+int cache_scan_file(scan_cache *cache, scan_job *job, const char *file,
+                    const scan_opts *opts) {
+	int rc;
+	bool have_key;
+	unsigned engine;
+
+	cache_key key;
+
+	stats_mark mark;
+	scan_stats *stats = opts -> stats ? &job -> stats : NULL;
+
+	if (cache == NULL)
+		return scan_file(job, file, opts);
+
+	stats_begin(stats, &mark);
+
+	/* before scanning, so that a file changed meanwhile isn't stored
+	 * under its new key */
+	have_key = cache_key_get(cache, file, &key) == 0;
+
+	job -> summary = calloc(1, sizeof(scan_summary));
+	if (job -> summary == NULL)
+		fail_printf("OOM");
+
+	/* entries measured with a cheaper profile, or with another engine,
+	 * are no good */
+	if (have_key &&
+	    cache_lookup(cache, &key, &job -> codec_id, &engine,
+	                 job -> summary) &&
+	    ((job -> summary -> measure & opts -> measure) == opts -> measure) &&
+	    (engine == opts -> engine)) {
+		job -> file = strdup(file);
+		if (job -> file == NULL)
+			fail_printf("OOM");
+
+		job -> error[0]       = '\0';
+		job -> loudness_error = 0.0;
+		job -> estimated      = false;
+		job -> downsampled    = false;
+
+		if (stats != NULL) {
+			stats -> cached = 1;
+			stats_stop(&mark, &stats -> scan);
+		}
+
+		return 0;
+	}
+
+	free(job -> summary);
+	job -> summary = NULL;
+
+	rc = scan_file(job, file, opts);
+
+	/* estimates are no substitute for a full scan, and neither is
+	 * loudness measured at a lower rate */
+	if ((rc == 0) && have_key && !job -> estimated && !job -> downsampled)
+		cache_store(cache, &key, job -> codec_id, opts -> engine,
+		            job -> summary);
+
+	return rc;
+}
+
+/* FNV-1a of the whole record, with the checksum field taken as 0 */
+static uint32_t cache_checksum(const cache_record *rec) {
+	size_t i;
+	uint32_t hash = 0x811c9dc5;
+
+	const uint8_t *data = (const uint8_t *) rec;
+
+	size_t skip = offsetof(cache_record, checksum);
+
+	for (i = 0; i < rec -> size; i++) {
+		uint8_t byte = data[i];
+
+		if ((i >= skip) && (i < skip + sizeof(rec -> checksum)))
+			byte = 0;
+
+		hash ^= byte;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+static uint64_t cache_fnv64(uint64_t hash, const void *data, size_t size) {
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= ((const uint8_t *) data)[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static bool cache_record_valid(scan_cache *cache, size_t off) {
+	size_t size;
+
+	cache_record *rec;
+
+	if (off + sizeof(cache_record) > cache -> map_size)
+		return false;
+
+	rec  = (cache_record *) (cache -> map + off);
+	size = rec -> size;
+
+	if ((rec -> magic != CACHE_RECORD_MAGIC) ||
+	    (size % 8 != 0) ||
+	    (size > cache -> map_size - off) ||
+	    (rec -> block_first + rec -> block_count > SCAN_HIST_BINS) ||
+	    (rec -> short_term_first + rec -> short_term_count > SCAN_HIST_BINS) ||
+	    (sizeof(cache_record) + (rec -> block_count +
+	     rec -> short_term_count) * sizeof(uint32_t) > size))
+		return false;
+
+	return cache_checksum(rec) == rec -> checksum;
+}
+
+/* Map the cache, cut off a torn record at its end, and index it. Called
+ * with the lock held. */
+static void cache_load(scan_cache *cache, const char *path) {
+	int rc;
+	size_t off;
+
+	struct stat st;
+
+	if (fstat(cache -> fd, &st) < 0)
+		sysf_printf("fstat()");
+
+	if (st.st_size == 0) {
+		cache_header hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+		hdr.endian = CACHE_ENDIAN;
+
+		if (write(cache -> fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+			sysf_printf("Could not initialize cache");
+
+		st.st_size = sizeof(hdr);
+	}
+
+	cache -> map_size = st.st_size;
+	cache -> map = mmap(
+		NULL, cache -> map_size, PROT_READ, MAP_SHARED, cache -> fd, 0
+	);
+	if (cache -> map == MAP_FAILED)
+		sysf_printf("mmap()");
+
+	if ((cache -> map_size < sizeof(cache_header)) ||
+	    memcmp(cache -> map, CACHE_MAGIC, 8) ||
+	    (((cache_header *) cache -> map) -> endian != CACHE_ENDIAN))
+		fail_printf("Invalid cache file '%s'", path);
+
+	off = sizeof(cache_header);
+
+	cache -> nb_records = 0;
+	cache -> nb_live    = 0;
+
+	while (cache_record_valid(cache, off)) {
+		off += ((cache_record *) (cache -> map + off)) -> size;
+		cache -> nb_records++;
+	}
+
+	if (off != cache -> map_size) {
+		err_printf("Discarding corrupted tail of cache '%s'", path);
+
+		rc = ftruncate(cache -> fd, off);
+		if (rc < 0)
+			sysf_printf("ftruncate()");
+
+		cache -> map_size = off;
+	}
+
+	cache -> index_size = 64;
+
+	while (cache -> index_size < cache -> nb_records * 2)
+		cache -> index_size *= 2;
+
+	cache -> index = calloc(cache -> index_size, sizeof(size_t));
+	if (cache -> index == NULL)
+		fail_printf("OOM");
+
+	for (off = sizeof(cache_header); off < cache -> map_size;
+	     off += ((cache_record *) (cache -> map + off)) -> size) {
+		if (cache_index_add(cache, off))
+			cache -> nb_live++;
+	}
+}
+
+/* Replace the cache with a copy holding only the last record of each file.
+ * Called with the lock held. If anything fails, the cache is left as it
+ * is. */
+static void cache_compact(scan_cache *cache, const char *path) {
+	int fd;
+	size_t off;
+	bool ok;
+
+	struct stat st;
+
+	char *tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (tmp == NULL)
+		fail_printf("OOM");
+
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	fd = mkostemp(tmp, O_APPEND | O_CLOEXEC);
+	if (fd < 0) {
+		err_printf("Could not compact cache '%s'", path);
+		free(tmp);
+		return;
+	}
+
+	if (fstat(cache -> fd, &st) == 0)
+		fchmod(fd, st.st_mode & 0777);
+
+	ok = write(fd, cache -> map, sizeof(cache_header)) ==
+	     sizeof(cache_header);
+
+	for (off = sizeof(cache_header); ok && (off < cache -> map_size);
+	     off += ((cache_record *) (cache -> map + off)) -> size) {
+		const cache_record *rec =
+			(cache_record *) (cache -> map + off);
+
+		if (*cache_index_find(cache, &rec -> key) != off)
+			continue;
+
+		ok = write(fd, rec, rec -> size) == (ssize_t) rec -> size;
+	}
+
+	/* the new file must be complete before it replaces the old one, and
+	 * locked, so that processes opening it wait until it's loaded */
+	ok = ok && (fsync(fd) == 0) && (flock(fd, LOCK_EX) == 0) &&
+	     (rename(tmp, path) == 0);
+
+	if (!ok) {
+		err_printf("Could not compact cache '%s'", path);
+
+		unlink(tmp);
+		close(fd);
+		free(tmp);
+		return;
+	}
+
+	free(tmp);
+
+	/* the lock on the old file goes with it */
+	munmap(cache -> map, cache -> map_size);
+	close(cache -> fd);
+	free(cache -> index);
+
+	cache -> fd = fd;
+
+	cache_load(cache, path);
+}
+
+/* Slot of the index for the file of the given key, holding the offset of
+ * its last record, or 0 if there's none. */
+static size_t *cache_index_find(scan_cache *cache, const cache_key *key) {
+	size_t mask = cache -> index_size - 1;
+
+	size_t i = cache_fnv64(
+		0xcbf29ce484222325ULL, &key -> dev, sizeof(key -> dev)
+	);
+
+	i = cache_fnv64(i, &key -> ino, sizeof(key -> ino)) & mask;
+
+	for (; cache -> index[i] != 0; i = (i + 1) & mask) {
+		const cache_record *rec =
+			(cache_record *) (cache -> map + cache -> index[i]);
+
+		if ((rec -> key.dev == key -> dev) &&
+		    (rec -> key.ino == key -> ino))
+			break;
+	}
+
+	return &cache -> index[i];
+}
+
+/* Index the record at off, replacing any older one of the same file.
+ * Returns whether the file wasn't indexed yet. */
+static bool cache_index_add(scan_cache *cache, size_t off) {
+	const cache_record *rec = (cache_record *) (cache -> map + off);
+
+	size_t *slot = cache_index_find(cache, &rec -> key);
+	bool    new  = (*slot == 0);
+
+	*slot = off;
+
+	return new;
+}
+
+static void cache_hist_range(const uint32_t *hist,
+                             uint16_t *first, uint16_t *count) {
+	int lo = 0, hi = SCAN_HIST_BINS;
+
+	while ((lo < hi) && (hist[lo] == 0))
+		lo++;
+
+	while ((hi > lo) && (hist[hi - 1] == 0))
+		hi--;
+
+	*first = lo;
+	*count = hi - lo;
+}
@@ -0,0 +1,74 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct scan_cache scan_cache;
+
+/* Identity of a file on disk. Results are only reused for files whose key
+ * matches exactly. */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+
+	int64_t  mtime_sec;
+	int64_t  mtime_nsec;
+
+	/* FNV-1a of the file's contents, 0 unless hashing is enabled */
+	uint64_t hash;
+} cache_key;
+
+scan_cache *cache_open(const char *path, bool hash);
+void cache_close(scan_cache *cache);
+
+int cache_key_get(scan_cache *cache, const char *file, cache_key *key);
+
+/* results are stored along with the SCAN_ENGINE_* that measured them */
+bool cache_lookup(scan_cache *cache, const cache_key *key,
+                  int *codec_id, unsigned *engine, scan_summary *summary);
+void cache_store(scan_cache *cache, const cache_key *key,
+                 int codec_id, unsigned engine, const scan_summary *summary);
+
+/* Same as scan_file(), but the results of a full scan with the same
+ * engine and at least the same measurements are reused from the cache if
+ * the file didn't change, and stored in it otherwise. The cache can be
+ * NULL. */
+int cache_scan_file(scan_cache *cache, scan_job *job, const char *file,
+                    const scan_opts *opts);
+
+#ifdef __cplusplus
+}
+#endif
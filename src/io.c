@@ -0,0 +1,853 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reads are kept aligned to IO_ALIGN and the kernel is asked to read ahead
+ * of them by up to IO_READAHEAD bytes. Whatever was read is dropped from
+ * the page cache in steps of IO_DROP bytes, and when the file is closed,
+ * so that scanning a large library doesn't push everything else out of
+ * it. Mapped files are copied straight out of the mapping instead of going
+ * through read(), and get the same hints.
+ *
+ * An io_ring works ahead of all that: it submits the opens, stats and first
+ * reads of the files about to be scanned as a batch, which matters most on
+ * network filesystems where each of those is a round trip. The io_file is
+ * then read from what the ring read, and carries on with pread().
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <libavformat/avio.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+
+#include "io.h"
+
+/* a multiple of the page size on every common architecture */
+#define IO_ALIGN     65536
+
+#define IO_READAHEAD (8 << 20)
+#define IO_DROP      (8 << 20)
+
+#define IO_ALIGN_DOWN(X) ((X) & ~((int64_t) IO_ALIGN - 1))
+
+static void io_readahead(io_file *f);
+static void io_drop(io_file *f, bool all);
+
+int io_open(io_file *f, const char *path, bool map) {
+	int err;
+	struct stat st;
+
+	f -> map      = NULL;
+	f -> head     = NULL;
+	f -> head_len = 0;
+
+	f -> fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (f -> fd < 0)
+		return -1;
+
+	/* pipes and devices can't be mapped or hinted */
+	if (fstat(f -> fd, &st) < 0)
+		err = errno;
+	else if (!S_ISREG(st.st_mode))
+		err = EINVAL;
+	else
+		err = 0;
+
+	if (err != 0) {
+		close(f -> fd);
+		f -> fd = -1;
+
+		errno = err;
+		return -1;
+	}
+
+	f -> size  = st.st_size;
+	f -> pos   = 0;
+	f -> drop  = 0;
+	f -> ahead = 0;
+
+	if (map && (f -> size > 0)) {
+		void *data = mmap(NULL, f -> size, PROT_READ, MAP_SHARED,
+		                  f -> fd, 0);
+
+		if (data == MAP_FAILED) {
+			err = errno;
+			close(f -> fd);
+			f -> fd = -1;
+
+			errno = err;
+			return -1;
+		}
+
+		f -> map = data;
+
+		madvise(data, f -> size, MADV_SEQUENTIAL);
+	}
+
+	posix_fadvise(f -> fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return 0;
+}
+
+void io_close(io_file *f) {
+	if (f -> fd < 0)
+		return;
+
+	io_drop(f, true);
+
+	if (f -> map != NULL)
+		munmap((void *) f -> map, f -> size);
+
+	free(f -> head);
+
+	close(f -> fd);
+
+	f -> fd   = -1;
+	f -> map  = NULL;
+	f -> head = NULL;
+}
+
+int io_read(void *opaque, uint8_t *buf, int size) {
+	io_file *f = opaque;
+	int64_t n;
+
+	io_readahead(f);
+
+	if (f -> pos < f -> head_len) {
+		n = FFMIN(size, f -> head_len - f -> pos);
+
+		memcpy(buf, f -> head + f -> pos, n);
+	} else if (f -> map != NULL) {
+		n = FFMIN(size, f -> size - f -> pos);
+
+		if (n > 0)
+			memcpy(buf, f -> map + f -> pos, n);
+	} else {
+		/* stop at the next boundary, so that the following reads
+		 * are aligned again */
+		if (f -> pos % IO_ALIGN)
+			size = FFMIN(size, IO_ALIGN - f -> pos % IO_ALIGN);
+
+		do {
+			n = pread(f -> fd, buf, size, f -> pos);
+		} while ((n < 0) && (errno == EINTR));
+
+		if (n < 0)
+			return AVERROR(errno);
+	}
+
+	if (n <= 0)
+		return AVERROR_EOF;
+
+	f -> pos += n;
+
+	io_drop(f, false);
+
+	return n;
+}
+
+int64_t io_seek(void *opaque, int64_t offset, int whence) {
+	io_file *f = opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return f -> size;
+
+		case SEEK_SET:
+			break;
+
+		case SEEK_CUR:
+			offset += f -> pos;
+			break;
+
+		case SEEK_END:
+			offset += f -> size;
+			break;
+
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if ((offset < 0) || (offset > f -> size))
+		return AVERROR(EINVAL);
+
+	/* everything read since the mark is dropped, however little, as
+	 * the mark is about to move past it and close wouldn't see it */
+	io_drop(f, true);
+
+	f -> pos   = offset;
+	f -> drop  = IO_ALIGN_DOWN(offset);
+	f -> ahead = offset;
+
+	return offset;
+}
+
+void io_prefetch(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, 0, IO_PREFETCH, POSIX_FADV_WILLNEED);
+
+	close(fd);
+}
+
+int io_location(const char *path, uint64_t *dev, uint64_t *location) {
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	*dev      = st.st_dev;
+	*location = st.st_ino;
+
+#ifdef FS_IOC_FIEMAP
+	if (S_ISREG(st.st_mode)) {
+		/* room for the header and a single extent */
+		uint64_t buf[(sizeof(struct fiemap) +
+		              sizeof(struct fiemap_extent)) /
+		             sizeof(uint64_t) + 1];
+		struct fiemap *map = (struct fiemap *) buf;
+
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0)
+			return 0;
+
+		memset(buf, 0, sizeof(buf));
+
+		map -> fm_start        = 0;
+		map -> fm_length       = FIEMAP_MAX_OFFSET;
+		map -> fm_extent_count = 1;
+
+		/* empty files have no extents and nothing to read */
+		if (ioctl(fd, FS_IOC_FIEMAP, map) == 0)
+			*location = (map -> fm_mapped_extents > 0) ?
+			            map -> fm_extents[0].fe_physical : 0;
+
+		close(fd);
+	}
+#endif
+
+	return 0;
+}
+
+/* Keep at least IO_CHUNK bytes past the read position requested. */
+static void io_readahead(io_file *f) {
+	int64_t start, end;
+
+	if ((f -> pos + IO_CHUNK <= f -> ahead) || (f -> ahead >= f -> size))
+		return;
+
+	start = IO_ALIGN_DOWN(FFMAX(f -> ahead, f -> pos));
+	end   = FFMIN(f -> pos + IO_READAHEAD, f -> size);
+
+	if (f -> map != NULL)
+		madvise((void *) (f -> map + start), end - start, MADV_WILLNEED);
+	else
+		posix_fadvise(f -> fd, start, end - start, POSIX_FADV_WILLNEED);
+
+	f -> ahead = end;
+}
+
+/* Drop what was read since the last time from the page cache, once there
+ * is at least IO_DROP bytes of it, or all of it. Pages still mapped by this
+ * process have to be unmapped first, or the kernel keeps them. */
+static void io_drop(io_file *f, bool all) {
+	int64_t end = all ? f -> pos : IO_ALIGN_DOWN(f -> pos);
+
+	if ((end <= f -> drop) || (!all && (end - f -> drop < IO_DROP)))
+		return;
+
+	if (f -> map != NULL)
+		madvise((void *) (f -> map + f -> drop), end - f -> drop,
+		        MADV_DONTNEED);
+
+	posix_fadvise(f -> fd, f -> drop, end - f -> drop,
+	              POSIX_FADV_DONTNEED);
+
+	f -> drop = end;
+}
+
+#ifdef HAVE_IO_URING
+
+/* what a completion is for, in the low bits of its user_data */
+#define IO_RING_OPEN  0
+#define IO_RING_STAT  1
+#define IO_RING_READ  2
+#define IO_RING_SHIFT 2
+
+/* a file queued with io_ring_queue() */
+typedef struct {
+	/* NULL if the slot is free */
+	char         *path;
+
+	/* -1 until opened, and errno of the open or read if they failed */
+	int           fd;
+	int           error;
+
+	/* requests still in flight, the slot can't be reused until then */
+	unsigned      pending;
+
+	bool          have_stat;
+	struct statx  stat;
+
+	uint8_t      *head;
+	int64_t       head_len;
+
+	/* when it was queued, the oldest unclaimed file goes first when
+	 * there's no room left */
+	unsigned long seq;
+} io_ring_file;
+
+struct io_ring {
+	int                  fd;
+
+	/* the rings are shared by the list and the scan threads */
+	pthread_mutex_t      lock;
+
+	void                *sq_ptr;
+	void                *cq_ptr;
+	size_t               sq_size;
+	size_t               cq_size;
+
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	unsigned             sq_entries;
+
+	struct io_uring_sqe *sqes;
+	size_t               sqes_size;
+
+	/* queued but not yet submitted */
+	unsigned             to_submit;
+
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	io_ring_file        *files;
+	unsigned             nb_files;
+	unsigned long        seq;
+
+	/* set if io_uring_enter() failed, in which case requests that are
+	 * still in flight are left alone and nothing more is queued */
+	bool                 broken;
+};
+
+static bool io_ring_supported(int fd);
+static bool io_ring_push(io_ring *ring, const struct io_uring_sqe *sqe);
+static int io_ring_enter(io_ring *ring, unsigned min_complete);
+static void io_ring_reap(io_ring *ring);
+static void io_ring_complete(io_ring *ring, uint64_t data, int res);
+static void io_ring_release(io_ring_file *file);
+
+io_ring *io_ring_open(unsigned depth) {
+	int err;
+	unsigned i;
+	struct io_uring_params params;
+
+	io_ring *ring = calloc(1, sizeof(io_ring));
+	if (ring == NULL)
+		return NULL;
+
+	ring -> files = calloc(depth, sizeof(io_ring_file));
+	if (ring -> files == NULL) {
+		free(ring);
+		return NULL;
+	}
+
+	ring -> nb_files = depth;
+
+	for (i = 0; i < depth; i++)
+		ring -> files[i].fd = -1;
+
+	memset(&params, 0, sizeof(params));
+
+	/* an open, a stat and a read per file, the completion ring is
+	 * twice as large as this */
+	ring -> fd = syscall(__NR_io_uring_setup, depth * 3, &params);
+	if (ring -> fd < 0) {
+		err = errno;
+		free(ring -> files);
+		free(ring);
+
+		errno = err;
+		return NULL;
+	}
+
+	ring -> sq_size = params.sq_off.array +
+	                  params.sq_entries * sizeof(unsigned);
+	ring -> cq_size = params.cq_off.cqes +
+	                  params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring -> sq_size = ring -> cq_size =
+			FFMAX(ring -> sq_size, ring -> cq_size);
+
+	ring -> sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring -> sq_ptr = mmap(NULL, ring -> sq_size, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_POPULATE, ring -> fd,
+	                      IORING_OFF_SQ_RING);
+
+	if ((ring -> sq_ptr != MAP_FAILED) &&
+	    (params.features & IORING_FEAT_SINGLE_MMAP))
+		ring -> cq_ptr = ring -> sq_ptr;
+	else if (ring -> sq_ptr != MAP_FAILED)
+		ring -> cq_ptr = mmap(NULL, ring -> cq_size,
+		                      PROT_READ | PROT_WRITE,
+		                      MAP_SHARED | MAP_POPULATE, ring -> fd,
+		                      IORING_OFF_CQ_RING);
+	else
+		ring -> cq_ptr = MAP_FAILED;
+
+	ring -> sqes = (ring -> cq_ptr == MAP_FAILED) ? MAP_FAILED :
+	               mmap(NULL, ring -> sqes_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring -> fd,
+	                    IORING_OFF_SQES);
+
+	if ((ring -> sqes == MAP_FAILED) || !io_ring_supported(ring -> fd)) {
+		err = (ring -> sqes == MAP_FAILED) ? errno : ENOSYS;
+
+		if (ring -> sqes != MAP_FAILED)
+			munmap(ring -> sqes, ring -> sqes_size);
+
+		if ((ring -> cq_ptr != MAP_FAILED) &&
+		    (ring -> cq_ptr != ring -> sq_ptr))
+			munmap(ring -> cq_ptr, ring -> cq_size);
+
+		if (ring -> sq_ptr != MAP_FAILED)
+			munmap(ring -> sq_ptr, ring -> sq_size);
+
+		close(ring -> fd);
+		free(ring -> files);
+		free(ring);
+
+		errno = err;
+		return NULL;
+	}
+
+	ring -> sq_head    = (unsigned *) ((uint8_t *) ring -> sq_ptr +
+	                                   params.sq_off.head);
+	ring -> sq_tail    = (unsigned *) ((uint8_t *) ring -> sq_ptr +
+	                                   params.sq_off.tail);
+	ring -> sq_mask    = (unsigned *) ((uint8_t *) ring -> sq_ptr +
+	                                   params.sq_off.ring_mask);
+	ring -> sq_array   = (unsigned *) ((uint8_t *) ring -> sq_ptr +
+	                                   params.sq_off.array);
+	ring -> sq_entries = params.sq_entries;
+
+	ring -> cq_head    = (unsigned *) ((uint8_t *) ring -> cq_ptr +
+	                                   params.cq_off.head);
+	ring -> cq_tail    = (unsigned *) ((uint8_t *) ring -> cq_ptr +
+	                                   params.cq_off.tail);
+	ring -> cq_mask    = (unsigned *) ((uint8_t *) ring -> cq_ptr +
+	                                   params.cq_off.ring_mask);
+	ring -> cqes       = (struct io_uring_cqe *) (
+		(uint8_t *) ring -> cq_ptr + params.cq_off.cqes
+	);
+
+	pthread_mutex_init(&ring -> lock, NULL);
+
+	return ring;
+}
+
+void io_ring_close(io_ring *ring) {
+	unsigned i;
+
+	if (ring == NULL)
+		return;
+
+	/* wait for whatever is still in flight before freeing buffers the
+	 * kernel may be writing to */
+	for (i = 0; i < ring -> nb_files; i++) {
+		while (!ring -> broken && (ring -> files[i].pending > 0)) {
+			io_ring_enter(ring, 1);
+			io_ring_reap(ring);
+		}
+
+		if (ring -> files[i].pending == 0)
+			io_ring_release(&ring -> files[i]);
+	}
+
+	munmap(ring -> sqes, ring -> sqes_size);
+
+	if (ring -> cq_ptr != ring -> sq_ptr)
+		munmap(ring -> cq_ptr, ring -> cq_size);
+
+	munmap(ring -> sq_ptr, ring -> sq_size);
+
+	close(ring -> fd);
+
+	pthread_mutex_destroy(&ring -> lock);
+
+	free(ring -> files);
+	free(ring);
+}
+
+void io_ring_queue(io_ring *ring, const char *path) {
+	unsigned i;
+	io_ring_file *file = NULL;
+	struct io_uring_sqe sqe;
+
+	if (ring == NULL)
+		return;
+
+	pthread_mutex_lock(&ring -> lock);
+
+	io_ring_reap(ring);
+
+	for (i = 0; i < ring -> nb_files; i++) {
+		io_ring_file *f = &ring -> files[i];
+
+		if (f -> path == NULL) {
+			file = f;
+			break;
+		}
+
+		/* files skipped without being scanned are never claimed */
+		if ((f -> pending == 0) &&
+		    ((file == NULL) || (f -> seq < file -> seq)))
+			file = f;
+	}
+
+	/* the ring needs room for all three requests */
+	if (ring -> broken || (file == NULL) ||
+	    (ring -> sq_entries - (*ring -> sq_tail -
+	     __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE)) < 3)) {
+		pthread_mutex_unlock(&ring -> lock);
+		return;
+	}
+
+	io_ring_release(file);
+
+	file -> path = strdup(path);
+	file -> head = malloc(IO_RING_HEAD);
+
+	if ((file -> path == NULL) || (file -> head == NULL)) {
+		io_ring_release(file);
+		pthread_mutex_unlock(&ring -> lock);
+		return;
+	}
+
+	file -> seq = ring -> seq++;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode     = IORING_OP_OPENAT;
+	sqe.fd         = AT_FDCWD;
+	sqe.addr       = (uintptr_t) file -> path;
+	sqe.open_flags = O_RDONLY | O_CLOEXEC;
+	sqe.user_data  = ((file - ring -> files) << IO_RING_SHIFT) |
+	                 IO_RING_OPEN;
+
+	io_ring_push(ring, &sqe);
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode      = IORING_OP_STATX;
+	sqe.fd          = AT_FDCWD;
+	sqe.addr        = (uintptr_t) file -> path;
+	sqe.len         = STATX_SIZE | STATX_MODE;
+	sqe.off         = (uintptr_t) &file -> stat;
+	sqe.user_data   = ((file - ring -> files) << IO_RING_SHIFT) |
+	                  IO_RING_STAT;
+
+	io_ring_push(ring, &sqe);
+
+	file -> pending = 2;
+
+	pthread_mutex_unlock(&ring -> lock);
+}
+
+void io_ring_submit(io_ring *ring) {
+	if (ring == NULL)
+		return;
+
+	pthread_mutex_lock(&ring -> lock);
+	io_ring_enter(ring, 0);
+	pthread_mutex_unlock(&ring -> lock);
+}
+
+int io_ring_take(io_ring *ring, const char *path, io_file *f) {
+	unsigned i;
+	struct stat st;
+	io_ring_file *file = NULL;
+
+	if (ring == NULL)
+		return -1;
+
+	pthread_mutex_lock(&ring -> lock);
+
+	for (i = 0; i < ring -> nb_files; i++) {
+		if ((ring -> files[i].path != NULL) &&
+		    !strcmp(ring -> files[i].path, path)) {
+			file = &ring -> files[i];
+			break;
+		}
+	}
+
+	while ((file != NULL) && !ring -> broken && (file -> pending > 0)) {
+		io_ring_enter(ring, 1);
+		io_ring_reap(ring);
+	}
+
+	/* io_open() reports errors as usual, or gives a pipe the default
+	 * treatment */
+	if ((file == NULL) || (file -> pending > 0) || (file -> fd < 0) ||
+	    (file -> error != 0) ||
+	    (file -> have_stat && !S_ISREG(file -> stat.stx_mode))) {
+		if ((file != NULL) && (file -> pending == 0))
+			io_ring_release(file);
+
+		pthread_mutex_unlock(&ring -> lock);
+		return -1;
+	}
+
+	if (file -> have_stat) {
+		f -> size = file -> stat.stx_size;
+	} else if (fstat(file -> fd, &st) == 0) {
+		f -> size = st.st_size;
+	} else {
+		io_ring_release(file);
+		pthread_mutex_unlock(&ring -> lock);
+		return -1;
+	}
+
+	f -> fd       = file -> fd;
+	f -> map      = NULL;
+	f -> head     = file -> head;
+	f -> head_len = file -> head_len;
+	f -> pos      = 0;
+	f -> drop     = 0;
+	f -> ahead    = 0;
+
+	/* the io_file owns them now */
+	file -> fd   = -1;
+	file -> head = NULL;
+
+	io_ring_release(file);
+
+	pthread_mutex_unlock(&ring -> lock);
+
+	posix_fadvise(f -> fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return 0;
+}
+
+/* Whether the kernel knows every operation the ring uses. */
+static bool io_ring_supported(int fd) {
+	bool ok;
+	struct io_uring_probe *probe;
+
+	const unsigned nb_ops = 256;
+
+	probe = calloc(1, sizeof(struct io_uring_probe) +
+	                  nb_ops * sizeof(struct io_uring_probe_op));
+	if (probe == NULL)
+		return false;
+
+	ok = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	              probe, nb_ops) == 0) &&
+	     (probe -> ops_len > IORING_OP_READ) &&
+	     (probe -> ops_len > IORING_OP_OPENAT) &&
+	     (probe -> ops_len > IORING_OP_STATX) &&
+	     (probe -> ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	     (probe -> ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+	     (probe -> ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+
+	return ok;
+}
+
+/* Add a request to the submission ring, submitting what's there already if
+ * it's full. Called with the lock held. */
+static bool io_ring_push(io_ring *ring, const struct io_uring_sqe *sqe) {
+	unsigned index, tail = *ring -> sq_tail;
+
+	if ((tail - __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE) >=
+	     ring -> sq_entries) &&
+	    ((io_ring_enter(ring, 0) < 0) ||
+	     (tail - __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE) >=
+	      ring -> sq_entries)))
+		return false;
+
+	index = tail & *ring -> sq_mask;
+
+	ring -> sqes[index]     = *sqe;
+	ring -> sq_array[index] = index;
+
+	__atomic_store_n(ring -> sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring -> to_submit++;
+
+	return true;
+}
+
+/* Submit what was queued and wait for at least min_complete completions.
+ * Called with the lock held. */
+static int io_ring_enter(io_ring *ring, unsigned min_complete) {
+	int rc;
+
+	if (ring -> broken || ((ring -> to_submit == 0) && (min_complete == 0)))
+		return 0;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, ring -> fd, ring -> to_submit,
+		             min_complete,
+		             min_complete ? IORING_ENTER_GETEVENTS : 0,
+		             NULL, 0);
+	} while ((rc < 0) && (errno == EINTR));
+
+	if (rc < 0) {
+		ring -> broken = true;
+		return -1;
+	}
+
+	ring -> to_submit -= FFMIN((unsigned) rc, ring -> to_submit);
+
+	return 0;
+}
+
+/* Handle every completion available. Called with the lock held. */
+static void io_ring_reap(io_ring *ring) {
+	unsigned head = *ring -> cq_head;
+
+	while (head != __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring -> cqes[head & *ring -> cq_mask];
+
+		io_ring_complete(ring, cqe -> user_data, cqe -> res);
+
+		head++;
+	}
+
+	__atomic_store_n(ring -> cq_head, head, __ATOMIC_RELEASE);
+
+	/* reads of files that were just opened */
+	io_ring_enter(ring, 0);
+}
+
+static void io_ring_complete(io_ring *ring, uint64_t data, int res) {
+	struct io_uring_sqe sqe;
+	io_ring_file *file = &ring -> files[data >> IO_RING_SHIFT];
+
+	file -> pending--;
+
+	switch (data & ((1 << IO_RING_SHIFT) - 1)) {
+		case IO_RING_OPEN:
+			if (res < 0) {
+				file -> error = -res;
+				break;
+			}
+
+			file -> fd = res;
+
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode    = IORING_OP_READ;
+			sqe.fd        = file -> fd;
+			sqe.addr      = (uintptr_t) file -> head;
+			sqe.len       = IO_RING_HEAD;
+			sqe.off       = 0;
+			sqe.user_data = (data & ~(uint64_t) IO_RING_OPEN) |
+			                IO_RING_READ;
+
+			if (io_ring_push(ring, &sqe))
+				file -> pending++;
+			break;
+
+		case IO_RING_STAT:
+			file -> have_stat = (res == 0);
+			break;
+
+		case IO_RING_READ:
+			/* a failed read is only retried by pread() later */
+			file -> head_len = FFMAX(res, 0);
+			break;
+	}
+}
+
+/* Close and free whatever the slot still holds. */
+static void io_ring_release(io_ring_file *file) {
+	if (file -> fd >= 0)
+		close(file -> fd);
+
+	free(file -> head);
+	free(file -> path);
+
+	memset(file, 0, sizeof(io_ring_file));
+	file -> fd = -1;
+}
+
+#else
+
+io_ring *io_ring_open(unsigned depth) {
+	errno = ENOSYS;
+	return NULL;
+}
+
+void io_ring_close(io_ring *ring) {
+}
+
+void io_ring_queue(io_ring *ring, const char *path) {
+}
+
+void io_ring_submit(io_ring *ring) {
+}
+
+int io_ring_take(io_ring *ring, const char *path, io_file *f) {
+	return -1;
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A local file read through a custom AVIOContext, either mapped or with
+ * large aligned reads, telling the kernel that it's read sequentially and
+ * that what was read already won't be needed again. */
+typedef struct {
+	int            fd;
+
+	/* the whole file if it's mapped, else NULL */
+	const uint8_t *map;
+
+	/* the first head_len bytes, if they were read by an io_ring */
+	uint8_t       *head;
+	int64_t        head_len;
+
+	int64_t        size;
+	int64_t        pos;
+
+	/* start of what was read since pages were last dropped, and end of
+	 * what readahead was asked for */
+	int64_t        drop;
+	int64_t        ahead;
+} io_file;
+
+/* size of the reads, and of the AVIOContext buffer, when not mapped */
+#define IO_CHUNK (1 << 20)
+
+/* -1 and errno on failure */
+int io_open(io_file *f, const char *path, bool map);
+void io_close(io_file *f);
+
+/* AVIOContext callbacks, opaque is the io_file */
+int io_read(void *opaque, uint8_t *buf, int size);
+int64_t io_seek(void *opaque, int64_t offset, int whence);
+
+/* how much of a file io_prefetch() asks for */
+#define IO_PREFETCH (16 << 20)
+
+/* Ask the kernel to start reading the beginning of a file in the
+ * background. Errors are ignored, the file is only a hint. */
+void io_prefetch(const char *path);
+
+/* Where a file's data starts on its device, or its inode number if the
+ * filesystem can't tell. Files are best read in this order. Returns -1 if
+ * the file can't be accessed. */
+int io_location(const char *path, uint64_t *dev, uint64_t *location);
+
+/* An io_uring that opens, stats and reads the beginning of queued files,
+ * many at a time, so that opening them later costs no round trips. */
+typedef struct io_ring io_ring;
+
+/* how much of each queued file is read */
+#define IO_RING_HEAD (256 << 10)
+
+/* files queued per scan thread when not told otherwise */
+#define IO_RING_AHEAD 16
+
+/* Room for depth queued files. NULL and errno if io_uring, or any of the
+ * operations needed, isn't available. */
+io_ring *io_ring_open(unsigned depth);
+void io_ring_close(io_ring *ring);
+
+/* queue a file, only submitted with the next io_ring_submit() */
+void io_ring_queue(io_ring *ring, const char *path);
+void io_ring_submit(io_ring *ring);
+
+/* Open a queued file with what the ring has read of it, waiting for that
+ * if needed. Returns -1 if the file wasn't queued or couldn't be opened,
+ * in which case io_open() can still be tried. */
+int io_ring_take(io_ring *ring, const char *path, io_file *f);
+
+#ifdef __cplusplus
+}
+#endif
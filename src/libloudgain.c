@@ -0,0 +1,275 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "libloudgain.h"
+#include "scan.h"
+#include "tag.h"
+
+struct lg_scanner {
+	scan_opts     opts;
+	double        pre_gain;
+
+	/* merged histograms of everything scanned since the last reset */
+	scan_summary *album;
+	unsigned      nb_tracks;
+
+	char          error[SCAN_ERROR_LEN];
+};
+
+static int lg_error(lg_scanner *lg, const char *msg);
+static int lg_finish(lg_scanner *lg, scan_job *job, int rc,
+                     lg_result *result);
+static int lg_update_tags(lg_scanner *lg, const char *file,
+                          const lg_result *result, bool write);
+
+void lg_options_default(lg_options *opts) {
+	opts -> measure     = LG_MEASURE_FULL;
+	opts -> nb_segments = 1;
+	opts -> fast_probe  = false;
+	opts -> nb_windows  = 0;
+	opts -> window_len  = 10;
+	opts -> downsample  = false;
+	opts -> engine      = LG_ENGINE_EBUR128;
+	opts -> io          = LG_IO_DEFAULT;
+	opts -> pre_gain    = 0.0;
+}
+
+lg_scanner *lg_scanner_new(const lg_options *opts) {
+	lg_scanner *lg;
+
+	if (scan_init() < 0)
+		return NULL;
+
+	lg = calloc(1, sizeof(lg_scanner));
+	if (lg == NULL)
+		return NULL;
+
+	lg -> album = calloc(1, sizeof(scan_summary));
+	if (lg -> album == NULL) {
+		free(lg);
+		return NULL;
+	}
+
+	/* scanners are used by one thread at a time, like contexts */
+	lg -> opts.context = scan_context_new();
+	if (lg -> opts.context == NULL) {
+		free(lg -> album);
+		free(lg);
+		return NULL;
+	}
+
+	lg -> opts.measure     = opts -> measure & SCAN_MEASURE_FULL;
+	lg -> opts.nb_segments = opts -> nb_segments;
+	lg -> opts.fast_probe  = opts -> fast_probe;
+	lg -> opts.nb_windows  = opts -> nb_windows;
+	lg -> opts.window_len  = opts -> window_len;
+	lg -> opts.downsample  = opts -> downsample;
+	lg -> opts.engine      = (opts -> engine == LG_ENGINE_BUILTIN) ?
+	                         SCAN_ENGINE_BUILTIN : SCAN_ENGINE_EBUR128;
+	lg -> opts.io          = (opts -> io == LG_IO_MMAP) ? SCAN_IO_MMAP :
+	                         (opts -> io == LG_IO_READ) ? SCAN_IO_READ :
+	                         SCAN_IO_DEFAULT;
+	lg -> pre_gain         = opts -> pre_gain;
+
+	lg -> album -> measure = lg -> opts.measure;
+
+	return lg;
+}
+
+void lg_scanner_free(lg_scanner *lg) {
+	if (lg == NULL)
+		return;
+
+	scan_context_free(lg -> opts.context);
+
+	free(lg -> album);
+	free(lg);
+}
+
+const char *lg_scanner_error(const lg_scanner *lg) {
+	return lg -> error;
+}
+
+int lg_scan_file(lg_scanner *lg, const char *file, lg_result *result) {
+	int rc;
+	scan_job job;
+
+	memset(&job, 0, sizeof(job));
+
+	rc = scan_file(&job, file, &lg -> opts);
+
+	return lg_finish(lg, &job, rc, result);
+}
+
+int lg_scan_buffer(lg_scanner *lg, const void *data, size_t size,
+                   const char *name, lg_result *result) {
+	int rc;
+	scan_job job;
+
+	memset(&job, 0, sizeof(job));
+
+	rc = scan_buffer(&job, name, data, size, &lg -> opts);
+
+	return lg_finish(lg, &job, rc, result);
+}
+
+int lg_scanner_album(lg_scanner *lg, lg_album *album) {
+	scan_album *scan;
+
+	if (lg -> nb_tracks == 0)
+		return lg_error(lg, "Nothing was scanned");
+
+	scan = scan_get_album_result(lg -> album, lg -> pre_gain);
+	if (scan == NULL)
+		return lg_error(lg, "OOM");
+
+	album -> nb_tracks      = lg -> nb_tracks;
+	album -> gain           = scan -> gain;
+	album -> peak           = scan -> peak;
+	album -> loudness       = scan -> loudness;
+	album -> loudness_range = scan -> loudness_range;
+
+	free(scan);
+
+	lg -> error[0] = '\0';
+
+	return 0;
+}
+
+void lg_scanner_reset_album(lg_scanner *lg) {
+	memset(lg -> album, 0, sizeof(scan_summary));
+
+	lg -> album -> measure = lg -> opts.measure;
+	lg -> nb_tracks        = 0;
+}
+
+void lg_result_set_album(lg_result *result, const lg_album *album) {
+	result -> album_gain           = album -> gain;
+	result -> album_peak           = album -> peak;
+	result -> album_loudness       = album -> loudness;
+	result -> album_loudness_range = album -> loudness_range;
+}
+
+int lg_write_tags(lg_scanner *lg, const char *file, const lg_result *result) {
+	return lg_update_tags(lg, file, result, true);
+}
+
+int lg_clear_tags(lg_scanner *lg, const char *file, const lg_result *result) {
+	return lg_update_tags(lg, file, result, false);
+}
+
+static int lg_error(lg_scanner *lg, const char *msg) {
+	strncpy(lg -> error, msg, SCAN_ERROR_LEN - 1);
+	lg -> error[SCAN_ERROR_LEN - 1] = '\0';
+
+	return -1;
+}
+
+/* Turn a finished job into a result, adding it to the album. */
+static int lg_finish(lg_scanner *lg, scan_job *job, int rc,
+                     lg_result *result) {
+	scan_result *scan;
+	double loudness_error;
+
+	if (rc < 0) {
+		lg_error(lg, job -> error);
+		scan_job_free(job);
+
+		return -1;
+	}
+
+	scan_job_reduce(job, lg -> album);
+	lg -> nb_tracks++;
+
+	loudness_error = job -> estimated ? job -> loudness_error : 0.0;
+
+	scan = scan_get_track_result(job, lg -> pre_gain);
+	scan_job_free(job);
+
+	if (scan == NULL)
+		return lg_error(lg, "OOM");
+
+	memset(result, 0, sizeof(lg_result));
+
+	result -> codec_id             = scan -> codec_id;
+	result -> track_gain           = scan -> track_gain;
+	result -> track_peak           = scan -> track_peak;
+	result -> track_loudness       = scan -> track_loudness;
+	result -> track_loudness_range = scan -> track_loudness_range;
+	result -> track_loudness_error = loudness_error;
+
+	free(scan);
+
+	lg -> error[0] = '\0';
+
+	return 0;
+}
+
+static int lg_update_tags(lg_scanner *lg, const char *file,
+                          const lg_result *result, bool write) {
+	int rc;
+	scan_result scan;
+
+	scan.file                 = (char *) file;
+	scan.codec_id             = result -> codec_id;
+	scan.track_gain           = result -> track_gain;
+	scan.track_peak           = result -> track_peak;
+	scan.track_loudness       = result -> track_loudness;
+	scan.track_loudness_range = result -> track_loudness_range;
+	scan.album_gain           = result -> album_gain;
+	scan.album_peak           = result -> album_peak;
+	scan.album_loudness       = result -> album_loudness;
+	scan.album_loudness_range = result -> album_loudness_range;
+
+	switch (scan.codec_id) {
+		case AV_CODEC_ID_MP3:
+			rc = write ? tag_write_mp3(&scan) : tag_clear_mp3(&scan);
+			break;
+
+		case AV_CODEC_ID_FLAC:
+			rc = write ? tag_write_flac(&scan) : tag_clear_flac(&scan);
+			break;
+
+		default:
+			return lg_error(lg, "File type not supported");
+	}
+
+	if (rc < 0)
+		return lg_error(lg, "Could not write tags");
+
+	lg -> error[0] = '\0';
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* what to measure on top of integrated loudness and sample peak */
+#define LG_MEASURE_LRA       (1 << 0)
+#define LG_MEASURE_TRUE_PEAK (1 << 1)
+
+#define LG_MEASURE_GAIN      0
+#define LG_MEASURE_GAIN_LRA  LG_MEASURE_LRA
+#define LG_MEASURE_FULL      (LG_MEASURE_LRA | LG_MEASURE_TRUE_PEAK)
+
+/* what measures loudness and peaks */
+#define LG_ENGINE_EBUR128    0
+#define LG_ENGINE_BUILTIN    1
+
+/* how files are read, see loudgain(1)'s --io */
+#define LG_IO_DEFAULT        0
+#define LG_IO_MMAP           1
+#define LG_IO_READ           2
+
+typedef struct {
+	/* LG_MEASURE_* flags */
+	unsigned measure;
+
+	/* maximum number of threads a single long input is split across */
+	unsigned nb_segments;
+
+	/* skip or limit stream probing when the container header has
+	 * enough information */
+	bool     fast_probe;
+
+	/* if not zero, only measure this many windows of window_len seconds
+	 * spread over long inputs and estimate the loudness from them */
+	unsigned nb_windows;
+	unsigned window_len;
+
+	/* measure the loudness of inputs above 48kHz at 48kHz, which is
+	 * cheaper and ignores anything above 24kHz */
+	bool     downsample;
+
+	/* LG_ENGINE_* */
+	unsigned engine;
+
+	/* LG_IO_* */
+	unsigned io;
+
+	/* pre-amp added to the gains, in dB */
+	double   pre_gain;
+} lg_options;
+
+typedef struct {
+	/* libavcodec's ID of the audio codec */
+	int    codec_id;
+
+	double track_gain;
+	double track_peak;
+
+	double track_loudness;
+	double track_loudness_range;
+
+	/* uncertainty of an estimated track_loudness in LU, NAN if it
+	 * could not be computed and 0 if the input was measured in full */
+	double track_loudness_error;
+
+	/* only set by lg_result_set_album() */
+	double album_gain;
+	double album_peak;
+
+	double album_loudness;
+	double album_loudness_range;
+} lg_result;
+
+typedef struct {
+	/* number of inputs the values were computed from */
+	unsigned nb_tracks;
+
+	double   gain;
+	double   peak;
+
+	double   loudness;
+	double   loudness_range;
+} lg_album;
+
+/* A scanner holds options, the last error and the album measured so far,
+ * and is used by one thread at a time. Any number of scanners can be used
+ * at once, nothing in the library ever exits the process or prints. */
+typedef struct lg_scanner lg_scanner;
+
+/* the library is built with hidden visibility, only these are exported */
+#pragma GCC visibility push(default)
+
+void lg_options_default(lg_options *opts);
+
+/* NULL if out of memory or if libav could not be initialized */
+lg_scanner *lg_scanner_new(const lg_options *opts);
+void lg_scanner_free(lg_scanner *lg);
+
+/* description of the last error, empty if there was none */
+const char *lg_scanner_error(const lg_scanner *lg);
+
+/* These return 0 and fill in the track values of result, or -1 on error.
+ * name is only used as a format hint for buffers, and can be NULL. The
+ * buffer is not copied and must stay valid until lg_scan_buffer()
+ * returns. Every input scanned successfully is added to the album. */
+int lg_scan_file(lg_scanner *lg, const char *file, lg_result *result);
+int lg_scan_buffer(lg_scanner *lg, const void *data, size_t size,
+                   const char *name, lg_result *result);
+
+/* album values of everything scanned since the last reset, -1 if nothing
+ * was scanned */
+int lg_scanner_album(lg_scanner *lg, lg_album *album);
+void lg_scanner_reset_album(lg_scanner *lg);
+
+void lg_result_set_album(lg_result *result, const lg_album *album);
+
+/* Write the track and album values of result as ReplayGain tags to the
+ * given file, or delete them. Only MP3 and FLAC are supported. */
+int lg_write_tags(lg_scanner *lg, const char *file, const lg_result *result);
+int lg_clear_tags(lg_scanner *lg, const char *file, const lg_result *result);
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,458 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "io.h"
+#include "printf.h"
+
+/* a directory being walked, with its sorted entries */
+typedef struct list_dir {
+	char            *path;
+
+	struct dirent  **entries;
+	int              nb_entries;
+	int              pos;
+
+	struct list_dir *parent;
+} list_dir;
+
+/* a file of a list in disk order */
+typedef struct {
+	char     *path;
+
+	/* length of the directory part of path */
+	size_t    dir_len;
+
+	uint64_t  dev;
+	uint64_t  location;
+
+	/* least location of the files in the same directory */
+	uint64_t  dir_location;
+
+	/* position in the list as it was found */
+	size_t    index;
+} list_entry;
+
+struct file_list {
+	char    **args;
+	unsigned  nb_args;
+	unsigned  next_arg;
+
+	FILE     *from;
+	char      sep;
+
+	char     *line;
+	size_t    line_size;
+
+	list_dir *dir;
+
+	/* every file, once read for list_disk_order() */
+	bool        disk_order;
+	bool        sorted;
+	list_entry *entries;
+	size_t      nb_entries;
+	size_t      nb_alloc;
+	size_t      next_entry;
+
+	/* ring of files already handed to io_prefetch(), or queued on the
+	 * io_ring, the oldest of which is returned next */
+	char      **ahead;
+	unsigned    nb_ahead;
+	unsigned    ahead_len;
+	unsigned    ahead_pos;
+
+	io_ring    *ring;
+};
+
+static const char *list_exts[] = {
+	"aac", "aif", "aiff", "ape", "flac", "m4a", "mp2", "mp3", "mp4",
+	"mpc", "oga", "ogg", "opus", "wav", "wma", "wv"
+};
+
+static char *list_walk(file_list *list);
+static char *list_sorted(file_list *list);
+static int list_cmp_dir(const void *a, const void *b);
+static int list_cmp_location(const void *a, const void *b);
+static int list_cmp_disk(const void *a, const void *b);
+static char *list_from(file_list *list);
+static void list_push(file_list *list, const char *path);
+static void list_pop(file_list *list);
+static bool list_is_audio(const char *name);
+
+file_list *list_open(char **args, unsigned nb_args, const char *from, char sep) {
+	file_list *list = calloc(1, sizeof(file_list));
+	if (list == NULL)
+		fail_printf("OOM");
+
+	list -> args    = args;
+	list -> nb_args = nb_args;
+	list -> sep     = sep;
+
+	if (from == NULL)
+		return list;
+
+	if (!strcmp(from, "-"))
+		list -> from = stdin;
+	else
+		list -> from = fopen(from, "r");
+
+	if (list -> from == NULL)
+		sysf_printf("Could not open '%s'", from);
+
+	return list;
+}
+
+void list_close(file_list *list) {
+	size_t i;
+
+	if (list == NULL)
+		return;
+
+	while (list -> dir != NULL)
+		list_pop(list);
+
+	for (i = list -> next_entry; i < list -> nb_entries; i++)
+		free(list -> entries[i].path);
+
+	free(list -> entries);
+
+	for (i = 0; i < list -> ahead_len; i++)
+		free(list -> ahead[(list -> ahead_pos + i) % list -> nb_ahead]);
+
+	free(list -> ahead);
+
+	if ((list -> from != NULL) && (list -> from != stdin))
+		fclose(list -> from);
+
+	free(list -> line);
+	free(list);
+}
+
+void list_disk_order(file_list *list) {
+	list -> disk_order = true;
+}
+
+void list_prefetch(file_list *list, unsigned n, struct io_ring *ring) {
+	if (n == 0)
+		return;
+
+	list -> ring = ring;
+
+	/* the file about to be returned, and n more after it */
+	list -> ahead = calloc(n + 1, sizeof(char *));
+	if (list -> ahead == NULL)
+		fail_printf("OOM");
+
+	list -> nb_ahead = n + 1;
+}
+
+char *list_next(file_list *list) {
+	char *path;
+
+	if (list -> nb_ahead == 0)
+		return list_sorted(list);
+
+	/* the io_ring is only refilled once half of it was used, so that
+	 * files are submitted in batches rather than one at a time */
+	if ((list -> ring == NULL) ||
+	    (list -> ahead_len <= list -> nb_ahead / 2)) {
+		unsigned len = list -> ahead_len;
+
+		while (list -> ahead_len < list -> nb_ahead) {
+			path = list_sorted(list);
+			if (path == NULL)
+				break;
+
+			if (list -> ring != NULL)
+				io_ring_queue(list -> ring, path);
+			else
+				io_prefetch(path);
+
+			list -> ahead[(list -> ahead_pos + list -> ahead_len++) %
+			              list -> nb_ahead] = path;
+		}
+
+		if (list -> ahead_len > len)
+			io_ring_submit(list -> ring);
+	}
+
+	if (list -> ahead_len == 0)
+		return NULL;
+
+	path = list -> ahead[list -> ahead_pos];
+
+	list -> ahead_pos = (list -> ahead_pos + 1) % list -> nb_ahead;
+	list -> ahead_len--;
+
+	return path;
+}
+
+/* next file in disk order if asked for, else as found */
+static char *list_sorted(file_list *list) {
+	size_t i, start;
+	char *path;
+
+	if (!list -> disk_order)
+		return list_walk(list);
+
+	if (list -> sorted) {
+		if (list -> next_entry >= list -> nb_entries)
+			return NULL;
+
+		return list -> entries[list -> next_entry++].path;
+	}
+
+	while ((path = list_walk(list)) != NULL) {
+		list_entry *entry;
+		const char *slash = strrchr(path, '/');
+
+		if (list -> nb_entries == list -> nb_alloc) {
+			list -> nb_alloc = list -> nb_alloc ?
+			                   list -> nb_alloc * 2 : 64;
+			list -> entries  = realloc(list -> entries,
+			                   list -> nb_alloc * sizeof(list_entry));
+			if (list -> entries == NULL)
+				fail_printf("OOM");
+		}
+
+		entry = &list -> entries[list -> nb_entries];
+
+		entry -> path    = path;
+		entry -> dir_len = slash ? (size_t) (slash - path) : 0;
+		entry -> index   = list -> nb_entries++;
+
+		/* files that can't be accessed go last, they'll only fail */
+		if (io_location(path, &entry -> dev, &entry -> location) < 0) {
+			entry -> dev      = UINT64_MAX;
+			entry -> location = UINT64_MAX;
+		}
+	}
+
+	/* each directory goes where its first file on disk is */
+	qsort(list -> entries, list -> nb_entries, sizeof(list_entry),
+	      list_cmp_location);
+
+	for (start = 0; start < list -> nb_entries; start = i) {
+		for (i = start; i < list -> nb_entries; i++) {
+			if (list_cmp_dir(&list -> entries[start],
+			                 &list -> entries[i]) != 0)
+				break;
+
+			list -> entries[i].dir_location =
+				list -> entries[start].location;
+		}
+	}
+
+	qsort(list -> entries, list -> nb_entries, sizeof(list_entry),
+	      list_cmp_disk);
+
+	list -> sorted = true;
+
+	return list_sorted(list);
+}
+
+#define LIST_CMP(A, B)						\
+	do {							\
+		if ((A) != (B))					\
+			return ((A) < (B)) ? -1 : 1;		\
+	} while (0)
+
+/* 0 for entries in the same directory of the same device */
+static int list_cmp_dir(const void *a, const void *b) {
+	const list_entry *x = a, *y = b;
+
+	LIST_CMP(x -> dev, y -> dev);
+	LIST_CMP(x -> dir_len, y -> dir_len);
+
+	return strncmp(x -> path, y -> path, x -> dir_len);
+}
+
+/* by directory, then by where on disk */
+static int list_cmp_location(const void *a, const void *b) {
+	int rc;
+	const list_entry *x = a, *y = b;
+
+	rc = list_cmp_dir(a, b);
+	if (rc != 0)
+		return rc;
+
+	LIST_CMP(x -> location, y -> location);
+	LIST_CMP(x -> index, y -> index);
+
+	return 0;
+}
+
+/* directories by where their first file is, then as above */
+static int list_cmp_disk(const void *a, const void *b) {
+	const list_entry *x = a, *y = b;
+
+	LIST_CMP(x -> dev, y -> dev);
+	LIST_CMP(x -> dir_location, y -> dir_location);
+
+	return list_cmp_location(a, b);
+}
+
+/* next file as found, walking directories */
+static char *list_walk(file_list *list) {
+	while (1) {
+		char *path;
+		struct stat st;
+
+		if (list -> dir != NULL) {
+			list_dir *dir = list -> dir;
+			struct dirent *ent;
+
+			if (dir -> pos >= dir -> nb_entries) {
+				list_pop(list);
+				continue;
+			}
+
+			ent = dir -> entries[dir -> pos++];
+
+			if (!strcmp(ent -> d_name, ".") ||
+			    !strcmp(ent -> d_name, ".."))
+				continue;
+
+			if (asprintf(&path, "%s/%s", dir -> path,
+			             ent -> d_name) < 0)
+				fail_printf("OOM");
+
+			/* don't follow symlinks to directories, they could
+			 * make the walk loop forever */
+			if ((lstat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+				list_push(list, path);
+				free(path);
+				continue;
+			}
+
+			if ((stat(path, &st) == 0) && S_ISREG(st.st_mode) &&
+			    list_is_audio(ent -> d_name))
+				return path;
+
+			free(path);
+			continue;
+		}
+
+		if (list -> next_arg < list -> nb_args)
+			path = strdup(list -> args[list -> next_arg++]);
+		else
+			path = list_from(list);
+
+		if (path == NULL)
+			return NULL;
+
+		/* files named explicitly are taken as they are */
+		if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+			list_push(list, path);
+			free(path);
+			continue;
+		}
+
+		return path;
+	}
+}
+
+/* next non-empty entry of the list file */
+static char *list_from(file_list *list) {
+	ssize_t len;
+
+	if (list -> from == NULL)
+		return NULL;
+
+	while ((len = getdelim(&list -> line, &list -> line_size,
+	                       list -> sep, list -> from)) >= 0) {
+		if ((len > 0) && (list -> line[len - 1] == list -> sep))
+			list -> line[--len] = '\0';
+
+		if (len > 0)
+			return strdup(list -> line);
+	}
+
+	return NULL;
+}
+
+static void list_push(file_list *list, const char *path) {
+	list_dir *dir = calloc(1, sizeof(list_dir));
+	if (dir == NULL)
+		fail_printf("OOM");
+
+	dir -> nb_entries = scandir(path, &dir -> entries, NULL, alphasort);
+	if (dir -> nb_entries < 0) {
+		err_printf("Could not read directory '%s'", path);
+		free(dir);
+		return;
+	}
+
+	dir -> path = strdup(path);
+	if (dir -> path == NULL)
+		fail_printf("OOM");
+
+	dir -> parent = list -> dir;
+	list -> dir   = dir;
+}
+
+static void list_pop(file_list *list) {
+	int i;
+	list_dir *dir = list -> dir;
+
+	for (i = 0; i < dir -> nb_entries; i++)
+		free(dir -> entries[i]);
+
+	list -> dir = dir -> parent;
+
+	free(dir -> entries);
+	free(dir -> path);
+	free(dir);
+}
+
+static bool list_is_audio(const char *name) {
+	unsigned i;
+	const char *ext = strrchr(name, '.');
+
+	if (ext == NULL)
+		return false;
+
+	for (i = 0; i < sizeof(list_exts) / sizeof(list_exts[0]); i++) {
+		if (!strcasecmp(ext + 1, list_exts[i]))
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,55 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+
+typedef struct file_list file_list;
+
+struct io_ring;
+
+/* Files come from the given arguments first, then from the given list file
+ * ("-" for stdin, NULL for none) with one name per sep-terminated entry.
+ * Directories are walked recursively, in name order, picking up files
+ * with a known audio extension. */
+file_list *list_open(char **args, unsigned nb_args, const char *from, char sep);
+void list_close(file_list *list);
+
+/* next file name, to be freed by the caller, or NULL at the end */
+char *list_next(file_list *list);
+
+/* Return files in the order their data is laid out on disk instead, with
+ * the files of each directory kept together. The whole list is read on
+ * the first list_next() call. */
+void list_disk_order(file_list *list);
+
+/* Have the kernel start reading the n files after the one list_next()
+ * returns, so they're cached by the time they're scanned. If ring isn't
+ * NULL they're queued on it instead, to be taken by io_ring_take(). */
+void list_prefetch(file_list *list, unsigned n, struct io_ring *ring);
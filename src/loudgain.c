@@ -31,18 +31,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 
 #include <math.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/common.h>
+#include <libavutil/log.h>
 
 #include "scan.h"
+#include "cache.h"
 #include "tag.h"
+#include "list.h"
+#include "io.h"
+#include "output.h"
+#include "serve.h"
 #include "printf.h"
 
-const char *short_opts = "rackd:oqs:h?";
+const char *short_opts = "rackd:oO:qs:ej:S:m:Fx:DE:I:C:Hf:0Rp:T:L:h?";
 
 static struct option long_opts[] = {
 	{ "track",     no_argument,       NULL, 'r' },
@@ -54,28 +64,150 @@ static struct option long_opts[] = {
 	{ "db-gain",   required_argument, NULL, 'd' },
 
 	{ "output",    no_argument,       NULL, 'o' },
+	{ "output-format", required_argument, NULL, 'O' },
 	{ "quiet",     no_argument,       NULL, 'q' },
 
 	{ "tag-mode",  required_argument, NULL, 's' },
+	{ "skip-existing", no_argument,   NULL, 'e' },
+
+	{ "jobs",      required_argument, NULL, 'j' },
+	{ "segments",  required_argument, NULL, 'S' },
+
+	{ "measure",   required_argument, NULL, 'm' },
+	{ "fast-probe", no_argument,      NULL, 'F' },
+	{ "fast",       required_argument, NULL, 'x' },
+	{ "downsample", no_argument,      NULL, 'D' },
+	{ "engine",     required_argument, NULL, 'E' },
+	{ "io",         required_argument, NULL, 'I' },
+
+	{ "cache",      required_argument, NULL, 'C' },
+	{ "cache-hash", no_argument,       NULL, 'H' },
+
+	{ "files-from", required_argument, NULL, 'f' },
+	{ "null",       no_argument,       NULL, '0' },
+	{ "disk-order", no_argument,       NULL, 'R' },
+	{ "prefetch",   required_argument, NULL, 'p' },
+
+	{ "stats",      required_argument, NULL, 'T' },
+
+	{ "serve",      required_argument, NULL, 'L' },
 
 	{ "help",      no_argument,       NULL, 'h' },
 	{ 0, 0, 0, 0 }
 };
 
+typedef struct {
+	char            *file;
+	unsigned         index;
+	scan_job         job;
+
+	/* result read from existing tags, if the file was skipped */
+	scan_result     *tagged;
+
+	bool             done;
+} scan_slot;
+
+typedef struct {
+	file_list       *list;
+
+	/* a ring of queue_len slots, or every file if queue_len is 0 */
+	scan_slot      **slots;
+	unsigned         nb_slots;
+
+	/* files taken from the list so far, all of them once eof is set */
+	unsigned         nb_files;
+	bool             eof;
+
+	const scan_opts *opts;
+	scan_cache      *cache;
+
+	/* histograms of all the tracks, NULL if not in album mode, and how
+	 * many tracks were merged into them */
+	scan_summary    *album;
+	unsigned         nb_album;
+
+	/* streaming records, written by the scan threads, or NULL */
+	output          *output;
+	double           pre_gain;
+	bool             no_clip;
+
+	bool             check_tags;
+	bool             tagged_album;
+	bool             scan_untagged;
+
+	/* next file to scan, and number of files the writer is done with;
+	 * scanning stops queue_len files ahead of the writer (0 = never) */
+	unsigned         next;
+	unsigned         written;
+	unsigned         queue_len;
+	unsigned         nb_done;
+
+	/* number of files to prefetch past the last one taken by a scan
+	 * thread when every file is pulled up front (queue_len = 0), and
+	 * number of files prefetched so far */
+	unsigned         prefetch;
+	unsigned         nb_ahead;
+
+	/* only one thread at a time reads the file list, without holding
+	 * lock so that the others can carry on meanwhile */
+	pthread_mutex_t  list_lock;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+} scan_pool;
+
+/* how many scanned files per scan thread may wait for the tag writer */
+#define SCAN_QUEUE_LEN 4
+
+/* default length of the windows measured with --fast, in seconds */
+#define FAST_WINDOW_LEN 10
+
+static void write_tags(char mode, scan_result *scan);
+static void write_record(scan_pool *pool, scan_slot *slot);
+static void *scan_worker(void *arg);
+static scan_slot *scan_pool_slot(scan_pool *pool, unsigned i);
+static bool scan_pool_pull(scan_pool *pool);
+static scan_slot *scan_pool_wait(scan_pool *pool, unsigned i);
+static void scan_pool_release(scan_pool *pool, unsigned i);
+static void scan_pool_ahead(scan_pool *pool, unsigned i);
 static inline void help(void);
 
 int main(int argc, char *argv[]) {
 	int rc, i;
 
 	char mode = 's';
-	unsigned nb_files = 0;
+	unsigned nb_threads = 1;
+
+	scan_opts opts = {
+		.nb_segments = 1, .measure = SCAN_MEASURE_FULL, .progress = progress_bar
+	};
+	scan_pool pool;
+	scan_slot *slot;
+	pthread_t *threads;
+
+	scan_summary *album_sum = NULL;
+	scan_album *album = NULL;
 
 	double pre_gain = 0.f;
 
+	char *cache_path = NULL;
+	char *files_from = NULL;
+	char *stats_path = NULL;
+	char *serve_path = NULL;
+
+	stats_report *report = NULL;
+	scan_cache *cache = NULL;
+	output *out = NULL;
+	char list_sep    = '\n';
+	unsigned prefetch = 0;
+
 	bool no_clip    = false,
 	     warn_clip  = true,
 	     do_album   = false,
-	     tab_output = false;
+	     tab_output = false,
+	     cache_hash = false,
+	     skip_tagged = false,
+	     disk_order = false,
+	     failed     = false;
 
 	while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) !=-1) {
 		switch (rc) {
@@ -110,6 +242,19 @@ int main(int argc, char *argv[]) {
 				tab_output = true;
 				break;
 
+			case 'O':
+				if (!strcmp(optarg, "json"))
+					out = output_new(stdout, OUTPUT_JSON);
+				else if (!strcmp(optarg, "csv"))
+					out = output_new(stdout, OUTPUT_CSV);
+				else
+					fail_printf("Invalid output format '%s'",
+					            optarg);
+
+				if (out == NULL)
+					fail_printf("OOM");
+				break;
+
 			case 'q':
 				quiet = 1;
 				break;
@@ -118,6 +263,153 @@ int main(int argc, char *argv[]) {
 				mode = optarg[0];
 				break;
 
+			case 'e':
+				skip_tagged = true;
+				break;
+
+			case 'j': {
+				char *rest = NULL;
+				long n = strtol(optarg, &rest, 10);
+
+				if (!rest ||
+				    (rest == optarg) ||
+				    (*rest != '\0') ||
+				    (n < 0))
+					fail_printf("Invalid number of jobs");
+
+				if (n == 0)
+					n = sysconf(_SC_NPROCESSORS_ONLN);
+
+				nb_threads = FFMAX(n, 1);
+				break;
+			}
+
+			case 'S': {
+				char *rest = NULL;
+				long n = strtol(optarg, &rest, 10);
+
+				if (!rest ||
+				    (rest == optarg) ||
+				    (*rest != '\0') ||
+				    (n < 0))
+					fail_printf("Invalid number of segments");
+
+				if (n == 0)
+					n = sysconf(_SC_NPROCESSORS_ONLN);
+
+				opts.nb_segments = FFMAX(n, 1);
+				break;
+			}
+
+			case 'm':
+				if (!strcmp(optarg, "gain"))
+					opts.measure = SCAN_MEASURE_GAIN;
+				else if (!strcmp(optarg, "gain+lra"))
+					opts.measure = SCAN_MEASURE_GAIN_LRA;
+				else if (!strcmp(optarg, "full"))
+					opts.measure = SCAN_MEASURE_FULL;
+				else
+					fail_printf("Invalid measurement profile '%s'",
+					            optarg);
+				break;
+
+			case 'F':
+				opts.fast_probe = true;
+				break;
+
+			case 'x': {
+				char *rest = NULL;
+				long n = strtol(optarg, &rest, 10), len = FAST_WINDOW_LEN;
+
+				if (rest && (*rest == 'x')) {
+					char *len_str = rest + 1;
+					len = strtol(len_str, &rest, 10);
+
+					if (rest == len_str)
+						rest = NULL;
+				}
+
+				if (!rest ||
+				    (rest == optarg) ||
+				    (*rest != '\0') ||
+				    (n < 1) || (len < 1))
+					fail_printf("Invalid fast mode windows '%s'",
+					            optarg);
+
+				opts.nb_windows = n;
+				opts.window_len = len;
+				break;
+			}
+
+			case 'D':
+				opts.downsample = true;
+				break;
+
+			case 'E':
+				if (!strcmp(optarg, "ebur128"))
+					opts.engine = SCAN_ENGINE_EBUR128;
+				else if (!strcmp(optarg, "builtin"))
+					opts.engine = SCAN_ENGINE_BUILTIN;
+				else
+					fail_printf("Invalid loudness engine '%s'",
+					            optarg);
+				break;
+
+			case 'I':
+				if (!strcmp(optarg, "default"))
+					opts.io = SCAN_IO_DEFAULT;
+				else if (!strcmp(optarg, "mmap"))
+					opts.io = SCAN_IO_MMAP;
+				else if (!strcmp(optarg, "read"))
+					opts.io = SCAN_IO_READ;
+				else if (!strcmp(optarg, "uring"))
+					opts.io = SCAN_IO_URING;
+				else
+					fail_printf("Invalid I/O method '%s'", optarg);
+				break;
+
+			case 'C':
+				cache_path = optarg;
+				break;
+
+			case 'H':
+				cache_hash = true;
+				break;
+
+			case 'f':
+				files_from = optarg;
+				break;
+
+			case '0':
+				list_sep = '\0';
+				break;
+
+			case 'R':
+				disk_order = true;
+				break;
+
+			case 'p': {
+				char *rest = NULL;
+				long n = strtol(optarg, &rest, 10);
+
+				if (!rest ||
+				    (rest == optarg) ||
+				    (*rest != '\0') ||
+				    (n < 0))
+					fail_printf("Invalid number of files to prefetch");
+
+				prefetch = n;
+				break;
+			}
+
+			case 'T':
+				stats_path = optarg;
+				break;
+
+			case 'L':
+				serve_path = optarg;
+				break;
+
 			case '?':
 			case 'h':
 				help();
@@ -125,29 +417,209 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	nb_files = argc - optind;
+	/* requests can only skip, write or delete tags */
+	if ((serve_path != NULL) && ((mode == '\0') || !strchr("sid", mode)))
+		fail_printf("Invalid tag mode '%c' for --serve", mode);
+
+	if (scan_init() < 0)
+		fail_printf("Could not initialize libav");
+
+	/* errors are reported per file instead */
+	av_log_set_level(AV_LOG_QUIET);
+
+	if (cache_path != NULL)
+		cache = cache_open(cache_path, cache_hash);
+
+	if (serve_path != NULL) {
+		serve_opts serve = {
+			.scan       = opts,
+			.cache      = cache,
+			.tag_mode   = mode,
+			.nb_threads = nb_threads,
+			.pre_gain   = pre_gain,
+			.no_clip    = no_clip,
+		};
 
-	scan_init(nb_files);
+		rc = serve_run(serve_path, &serve);
 
-	for (i = optind; i < argc; i++) {
-		ok_printf("Scanning '%s'...", argv[i]);
+		cache_close(cache);
+		scan_deinit();
 
-		scan_file(argv[i], i - optind);
+		return rc;
 	}
 
-	if (tab_output)
+	if (stats_path != NULL) {
+		opts.stats = true;
+		report     = stats_report_new();
+	}
+
+	/* records carry timings, and stdout is all theirs */
+	if (out != NULL) {
+		opts.stats    = true;
+		opts.progress = NULL;
+	}
+
+	/* a single progress bar can't follow several files at once */
+	if (nb_threads > 1)
+		use_progress = 0;
+
+	memset(&pool, 0, sizeof(pool));
+
+	pthread_mutex_init(&pool.list_lock, NULL);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	pool.list  = list_open(argv + optind, argc - optind, files_from, list_sep);
+	pool.opts  = &opts;
+	pool.cache = cache;
+
+	if (disk_order)
+		list_disk_order(pool.list);
+
+	/* the ring is only useful when files are queued on it ahead of
+	 * time, and aligned reads are what it falls back to */
+	if (opts.io == SCAN_IO_URING) {
+		unsigned ahead = prefetch ? prefetch : IO_RING_AHEAD;
+
+		/* room for the files returned but not yet opened too */
+		opts.ring = io_ring_open(2 * (ahead * nb_threads + 1));
+
+		if (opts.ring == NULL) {
+			err_printf("io_uring is not available (%s), "
+			           "using aligned reads", strerror(errno));
+			opts.io = SCAN_IO_READ;
+		} else {
+			prefetch = ahead;
+		}
+	}
+
+	/* album gain needs every track before any tag can be written, so
+	 * only in track mode memory doesn't grow with the number of files */
+	pool.queue_len = do_album ? 0 : nb_threads * SCAN_QUEUE_LEN;
+
+	/* every scan thread has a file of its own to read ahead of, but
+	 * when the whole list is read up front that's done as files are
+	 * taken, instead of for all of them at once (which would also
+	 * overflow the io_ring) */
+	if (do_album)
+		pool.prefetch = prefetch * nb_threads;
+	else
+		list_prefetch(pool.list, prefetch * nb_threads, opts.ring);
+
+	if (pool.queue_len > 0) {
+		pool.nb_slots = pool.queue_len;
+		pool.slots    = calloc(pool.nb_slots, sizeof(scan_slot *));
+		if (pool.slots == NULL)
+			fail_printf("OOM");
+
+		for (i = 0; i < pool.nb_slots; i++) {
+			pool.slots[i] = calloc(1, sizeof(scan_slot));
+			if (pool.slots[i] == NULL)
+				fail_printf("OOM");
+		}
+	} else {
+		while (scan_pool_pull(&pool));
+	}
+
+	if (do_album) {
+		album_sum = calloc(1, sizeof(scan_summary));
+		if (album_sum == NULL)
+			fail_printf("OOM");
+
+		album_sum -> measure = opts.measure;
+	}
+
+	pool.album    = album_sum;
+	pool.output   = out;
+	pool.pre_gain = pre_gain;
+	pool.no_clip  = no_clip;
+
+	/* check mode only reads tags, and when skipping tagged files there's
+	 * no point in looking at tags that are about to be deleted */
+	pool.check_tags    = (mode == 'c') ||
+	                     (skip_tagged && (mode != 'd') && (mode != 'r'));
+	pool.tagged_album  = do_album;
+	pool.scan_untagged = (mode != 'c');
+
+	/* album gain needs every track of the album, so either all files
+	 * are skipped or none is */
+	if (pool.check_tags && do_album && (mode != 'c')) {
+		for (i = 0; i < pool.nb_files; i++) {
+			scan_slot *slot = pool.slots[i];
+
+			slot -> tagged = tag_read(slot -> file, true);
+			if (slot -> tagged == NULL)
+				break;
+		}
+
+		if (i < pool.nb_files) {
+			for (i = 0; i < pool.nb_files; i++) {
+				free(pool.slots[i] -> tagged);
+				pool.slots[i] -> tagged = NULL;
+			}
+
+			pool.check_tags = false;
+		}
+	}
+
+
+	threads = malloc(sizeof(pthread_t) * nb_threads);
+	if (threads == NULL)
+		fail_printf("OOM");
+
+	for (i = 0; i < nb_threads; i++) {
+		rc = pthread_create(&threads[i], NULL, scan_worker, &pool);
+		if (rc != 0)
+			fail_printf("Could not create worker thread");
+	}
+
+	/* the main thread writes tags and prints results as files finish
+	 * scanning, in the order they were given */
+	if (do_album) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.nb_done < pool.nb_files)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		album = scan_get_album_result(album_sum, pre_gain);
+		if (album == NULL)
+			fail_printf("OOM");
+
+		if ((out != NULL) && (pool.nb_album > 0))
+			output_album(out, pool.nb_album, album);
+	}
+
+	if (tab_output && (out == NULL))
 		printf("File\tMP3 gain\tdB gain\tMax Amplitude\tMax global_gain\tMin global_gain\n");
 
-	for (i = 0; i < nb_files; i++) {
+	for (i = 0; (slot = scan_pool_wait(&pool, i)) != NULL; i++) {
 		bool will_clip = false;
+		bool from_tags = slot -> tagged != NULL;
+
+		scan_result *scan;
+
+		if (from_tags)
+			scan = slot -> tagged;
+		else
+			scan = scan_get_track_result(&slot -> job, pre_gain);
+
+		if (scan == NULL) {
+			if (slot -> job.error[0] != '\0') {
+				err_printf("Could not scan '%s': %s",
+				           slot -> file, slot -> job.error);
+				failed = true;
+			}
 
-		scan_result *scan = scan_get_track_result(i, pre_gain);
+			if (report != NULL)
+				stats_report_add(report, slot -> file,
+				                 &slot -> job.stats);
 
-		if (scan == NULL)
+			scan_pool_release(&pool, i);
 			continue;
+		}
 
-		if (do_album)
-			scan_set_album_result(scan, pre_gain);
+		if (do_album && !from_tags)
+			scan_set_album_result(scan, album);
 
 		if ((scan -> track_gain > (1.f / scan -> track_peak)) ||
 		    (scan -> album_gain > (1.f / scan -> album_peak)))
@@ -165,84 +637,40 @@ int main(int argc, char *argv[]) {
 			will_clip = false;
 		}
 
-		switch (mode) {
-			case 'c': /* check tags */
-				break;
-
-			case 'd': /* delete tags */
-				switch (scan -> codec_id) {
-					case AV_CODEC_ID_MP3:
-						tag_clear_mp3(scan);
-						break;
-
-					case AV_CODEC_ID_FLAC:
-						tag_clear_flac(scan);
-						break;
-
-					default:
-						err_printf("File type not supported");
-						break;
-				}
-				break;
-
-			case 'i': /* ID3v2 tags */
-				switch (scan -> codec_id) {
-					case AV_CODEC_ID_MP3:
-						tag_clear_mp3(scan);
-						tag_write_mp3(scan);
-						break;
-
-					case AV_CODEC_ID_FLAC:
-						tag_clear_flac(scan);
-						tag_write_flac(scan);
-						break;
-
-					default:
-						err_printf("File type not supported");
-						break;
-				}
-				break;
-
-			case 'a': /* APEv2 tags */
-				err_printf("APEv2 tags are not supported");
-				break;
-
-			case 'v': /* Vorbis Comments tags */
-				err_printf("Vorbis Comment tags are not supported");
-				break;
-
-			case 's': /* skip tags */
-				break;
-
-			case 'r': /* force re-calculation */
-				break;
+		/* files that were skipped already have the right tags */
+		if (!from_tags) {
+			stats_mark mark;
+			scan_stats *stats = opts.stats ? &slot -> job.stats : NULL;
 
-			default:
-				err_printf("Invalid tag mode");
-				break;
+			stats_begin(stats, &mark);
+			write_tags(mode, scan);
+			stats_end(stats, STATS_TAGS, &mark);
 		}
 
-		if (tab_output) {
+		if (out != NULL) {
+			/* already written by the scan thread */
+		} else if (tab_output) {
 			printf("%s\t", scan -> file);
 			printf("%d\t", 0);
 			printf("%f\t", scan -> track_gain);
 			printf("%f\t", scan -> track_peak * 32768.0);
 			printf("%d\t", 0);
 			printf("%d\n", 0);
-
-			if ((i == (nb_files - 1)) && do_album) {
-				printf("%s\t", "Album");
-				printf("%d\t", 0);
-				printf("%f\t", scan -> album_gain);
-				printf("%f\t", scan -> album_peak * 32768.0);
-				printf("%d\t", 0);
-				printf("%d\n", 0);
-			}
 		} else {
 			printf("\nTrack: %s\n", scan -> file);
 
-			printf(" Loudness: %5.1f LUFS\n", scan -> track_loudness);
-			printf(" Range:    %5.1f LU\n", scan -> track_loudness_range);
+			/* tags only store gain and peak */
+			if (!from_tags) {
+				printf(" Loudness: %5.1f LUFS", scan -> track_loudness);
+
+				if (slot -> job.estimated)
+					printf(" (estimated, +/- %.1f LU)",
+					       slot -> job.loudness_error);
+
+				printf("\n");
+				printf(" Range:    %5.1f LU\n", scan -> track_loudness_range);
+			}
+
 			printf(" Gain:     %5.1f dB\n", scan -> track_gain);
 			printf(" Peak:     %5.1f\n", scan -> track_peak);
 		}
@@ -251,11 +679,370 @@ int main(int argc, char *argv[]) {
 			err_printf("The track will clip");
 
 		free(scan);
+
+		if (report != NULL)
+			stats_report_add(report, slot -> file, &slot -> job.stats);
+
+		scan_pool_release(&pool, i);
 	}
 
+	/* after all tracks, whether the last one could be scanned or not */
+	if (tab_output && (out == NULL) && do_album && (pool.nb_album > 0)) {
+		double gain = album -> gain;
+
+		if (no_clip)
+			gain = FFMIN(gain, 1.0 / album -> peak);
+
+		printf("%s\t", "Album");
+		printf("%d\t", 0);
+		printf("%f\t", gain);
+		printf("%f\t", album -> peak * 32768.0);
+		printf("%d\t", 0);
+		printf("%d\n", 0);
+	}
+
+	for (i = 0; i < nb_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_mutex_destroy(&pool.list_lock);
+
+	for (i = 0; i < pool.nb_slots; i++)
+		free(pool.slots[i]);
+
+	free(pool.slots);
+
+	list_close(pool.list);
+
+	io_ring_close(opts.ring);
+
+	free(album);
+	free(album_sum);
+
+	if (report != NULL) {
+		FILE *out = stdout;
+
+		if (strcmp(stats_path, "-") && !(out = fopen(stats_path, "w")))
+			sysf_printf("Could not open '%s'", stats_path);
+
+		stats_report_write(report, out, nb_threads);
+
+		if (out != stdout)
+			fclose(out);
+
+		stats_report_free(report);
+	}
+
+	output_free(out);
+
+	cache_close(cache);
+
 	scan_deinit();
 
-	return 0;
+	return failed ? 1 : 0;
+}
+
+static void write_tags(char mode, scan_result *scan) {
+	int rc = 0;
+
+	switch (mode) {
+		case 'c': /* check tags */
+			break;
+
+		case 'd': /* delete tags */
+			switch (scan -> codec_id) {
+				case AV_CODEC_ID_MP3:
+					rc = tag_clear_mp3(scan);
+					break;
+
+				case AV_CODEC_ID_FLAC:
+					rc = tag_clear_flac(scan);
+					break;
+
+				default:
+					err_printf("File type not supported");
+					break;
+			}
+			break;
+
+		case 'i': /* ID3v2 tags */
+			switch (scan -> codec_id) {
+				case AV_CODEC_ID_MP3:
+					rc = tag_write_mp3(scan);
+					break;
+
+				case AV_CODEC_ID_FLAC:
+					rc = tag_write_flac(scan);
+					break;
+
+				default:
+					err_printf("File type not supported");
+					break;
+			}
+			break;
+
+		case 'a': /* APEv2 tags */
+			err_printf("APEv2 tags are not supported");
+			break;
+
+		case 'v': /* Vorbis Comments tags */
+			err_printf("Vorbis Comment tags are not supported");
+			break;
+
+		case 's': /* skip tags */
+			break;
+
+		case 'r': /* force re-calculation */
+			break;
+
+		default:
+			err_printf("Invalid tag mode");
+			break;
+	}
+
+	if (rc < 0)
+		err_printf("Could not write tags to '%s'", scan -> file);
+}
+
+/* Write the streaming record of a file as soon as it's done, before the
+ * writer gets to it. Gains are the track ones, album gain comes later. */
+static void write_record(scan_pool *pool, scan_slot *slot) {
+	scan_result *scan = slot -> tagged;
+	const char *error = NULL;
+
+	if (scan == NULL) {
+		scan = scan_get_track_result(&slot -> job, pool -> pre_gain);
+
+		if ((scan != NULL) && pool -> no_clip)
+			scan -> track_gain = FFMIN(scan -> track_gain,
+			                           1.0 / scan -> track_peak);
+	}
+
+	if (scan == NULL)
+		error = (slot -> job.error[0] != '\0') ? slot -> job.error
+		                                       : "Not scanned";
+
+	output_track(pool -> output, slot -> index, slot -> file, scan,
+	             slot -> tagged ? NULL : &slot -> job, error);
+
+	if (scan != slot -> tagged)
+		free(scan);
+}
+
+/* whether the given file doesn't need to be scanned, because of its tags */
+static bool scan_pool_skip(scan_pool *pool, scan_slot *slot) {
+	if (!pool -> check_tags)
+		return false;
+
+	if (slot -> tagged == NULL) {
+		stats_mark mark;
+		scan_stats *stats = pool -> opts -> stats ? &slot -> job.stats : NULL;
+
+		stats_begin(stats, &mark);
+		slot -> tagged = tag_read(slot -> file, pool -> tagged_album);
+		stats_end(stats, STATS_TAGS, &mark);
+	}
+
+	if (slot -> tagged != NULL) {
+		ok_printf("Skipping '%s', already tagged", slot -> file);
+		return true;
+	}
+
+	if (!pool -> scan_untagged) {
+		err_printf("No ReplayGain tags in '%s'", slot -> file);
+		return true;
+	}
+
+	return false;
+}
+
+/* next file to scan, or NULL once there are no more */
+static scan_slot *scan_pool_next(scan_pool *pool) {
+	scan_slot *slot = NULL;
+
+	pthread_mutex_lock(&pool -> list_lock);
+	pthread_mutex_lock(&pool -> lock);
+
+	while ((pool -> queue_len > 0) &&
+	       (pool -> next - pool -> written >= pool -> queue_len))
+		pthread_cond_wait(&pool -> cond, &pool -> lock);
+
+	pthread_mutex_unlock(&pool -> lock);
+
+	if ((pool -> next < pool -> nb_files) || scan_pool_pull(pool)) {
+		pthread_mutex_lock(&pool -> lock);
+		slot = scan_pool_slot(pool, pool -> next++);
+		pthread_mutex_unlock(&pool -> lock);
+
+		scan_pool_ahead(pool, slot -> index);
+	}
+
+	pthread_mutex_unlock(&pool -> list_lock);
+
+	return slot;
+}
+
+static void *scan_worker(void *arg) {
+	scan_pool *pool = arg;
+	scan_slot *slot;
+
+	while ((slot = scan_pool_next(pool)) != NULL) {
+		if (scan_pool_skip(pool, slot) == false) {
+			ok_printf("Scanning '%s'...", slot -> file);
+
+			cache_scan_file(pool -> cache, &slot -> job, slot -> file,
+			                pool -> opts);
+		}
+
+		pthread_mutex_lock(&pool -> lock);
+
+		if ((pool -> album != NULL) && (slot -> job.summary != NULL))
+			pool -> nb_album++;
+
+		scan_job_reduce(&slot -> job, pool -> album);
+
+		pthread_mutex_unlock(&pool -> lock);
+
+		if (pool -> output != NULL)
+			write_record(pool, slot);
+
+		pthread_mutex_lock(&pool -> lock);
+
+		slot -> done = true;
+		pool -> nb_done++;
+
+		pthread_cond_broadcast(&pool -> cond);
+		pthread_mutex_unlock(&pool -> lock);
+	}
+
+	return NULL;
+}
+
+static scan_slot *scan_pool_slot(scan_pool *pool, unsigned i) {
+	if (pool -> queue_len > 0)
+		return pool -> slots[i % pool -> queue_len];
+
+	return pool -> slots[i];
+}
+
+/* Take the next file from the list into a new slot. Called either before
+ * the scan threads are started, or with list_lock held. */
+static bool scan_pool_pull(scan_pool *pool) {
+	scan_slot *slot;
+	char *file = list_next(pool -> list);
+
+	pthread_mutex_lock(&pool -> lock);
+
+	if (file == NULL) {
+		pool -> eof = true;
+
+		pthread_cond_broadcast(&pool -> cond);
+		pthread_mutex_unlock(&pool -> lock);
+
+		return false;
+	}
+
+	if (pool -> queue_len == 0) {
+		if (pool -> nb_files == pool -> nb_slots) {
+			pool -> nb_slots = FFMAX(pool -> nb_slots * 2, 64);
+			pool -> slots    = realloc(pool -> slots,
+			                    pool -> nb_slots * sizeof(scan_slot *));
+			if (pool -> slots == NULL)
+				fail_printf("OOM");
+
+			memset(pool -> slots + pool -> nb_files, 0,
+			       (pool -> nb_slots - pool -> nb_files) *
+			       sizeof(scan_slot *));
+		}
+
+		pool -> slots[pool -> nb_files] = calloc(1, sizeof(scan_slot));
+		if (pool -> slots[pool -> nb_files] == NULL)
+			fail_printf("OOM");
+	}
+
+	slot = scan_pool_slot(pool, pool -> nb_files);
+	slot -> file  = file;
+	slot -> index = pool -> nb_files++;
+
+	pthread_mutex_unlock(&pool -> lock);
+
+	return true;
+}
+
+/* wait for the given file to finish scanning, NULL if there's no such file */
+static scan_slot *scan_pool_wait(scan_pool *pool, unsigned i) {
+	scan_slot *slot = NULL;
+
+	pthread_mutex_lock(&pool -> lock);
+
+	while (1) {
+		if ((i < pool -> nb_files) && scan_pool_slot(pool, i) -> done) {
+			slot = scan_pool_slot(pool, i);
+			break;
+		}
+
+		if (pool -> eof && (i >= pool -> nb_files))
+			break;
+
+		pthread_cond_wait(&pool -> cond, &pool -> lock);
+	}
+
+	pthread_mutex_unlock(&pool -> lock);
+
+	return slot;
+}
+
+/* Prefetch the files up to pool -> prefetch past the i-th, which was just
+ * taken by a scan thread, or queue them on the io_ring. Only used when
+ * every file was pulled before the scan threads started, with list_lock
+ * held. */
+static void scan_pool_ahead(scan_pool *pool, unsigned i) {
+	unsigned end   = FFMIN(i + 1 + pool -> prefetch, pool -> nb_files);
+	unsigned start = pool -> nb_ahead;
+
+	io_ring *ring = pool -> opts -> ring;
+
+	if (pool -> prefetch == 0)
+		return;
+
+	/* like list_next(), the io_ring is only refilled once half of it
+	 * was taken, so that files are submitted in batches */
+	if ((ring != NULL) && (pool -> nb_ahead > i + 1 + pool -> prefetch / 2))
+		return;
+
+	for (; pool -> nb_ahead < end; pool -> nb_ahead++) {
+		const char *file = pool -> slots[pool -> nb_ahead] -> file;
+
+		if (ring != NULL)
+			io_ring_queue(ring, file);
+		else
+			io_prefetch(file);
+	}
+
+	if (pool -> nb_ahead > start)
+		io_ring_submit(ring);
+}
+
+/* free the given file's slot and let the scan threads move on past it */
+static void scan_pool_release(scan_pool *pool, unsigned i) {
+	scan_slot *slot;
+
+	pthread_mutex_lock(&pool -> lock);
+
+	slot = scan_pool_slot(pool, i);
+
+	scan_job_free(&slot -> job);
+	free(slot -> file);
+
+	memset(slot, 0, sizeof(scan_slot));
+
+	pool -> written = i + 1;
+
+	pthread_cond_broadcast(&pool -> cond);
+	pthread_mutex_unlock(&pool -> lock);
 }
 
 static inline void help(void) {
@@ -263,7 +1050,7 @@ static inline void help(void) {
 
 	printf(COLOR_RED "Usage: " COLOR_OFF);
 	printf(COLOR_GREEN "loudgain " COLOR_OFF);
-	puts("[OPTIONS] FILES...\n");
+	puts("[OPTIONS] FILES|DIRECTORIES...\n");
 
 	puts(COLOR_RED " Options:" COLOR_OFF);
 
@@ -279,13 +1066,55 @@ static inline void help(void) {
 
 	puts("");
 
+	CMD_HELP("--tag-mode c", "-s c",  "Show ReplayGain tags stored in files, without scanning");
 	CMD_HELP("--tag-mode d", "-s d",  "Delete ReplayGain tags from files");
 	CMD_HELP("--tag-mode i", "-s i",  "Write ReplayGain tags to files");
 	CMD_HELP("--tag-mode s", "-s s",  "Don't write ReplayGain tags (default)");
 
+	CMD_HELP("--skip-existing", "-e", "Don't scan files that already have ReplayGain tags");
+
+	puts("");
+
+	CMD_HELP("--jobs",     "-j",  "Scan this many files in parallel (0 = all CPUs)");
+	CMD_HELP("--segments", "-S",  "Split long files across this many threads (0 = all CPUs)");
+
+	puts("");
+
+	CMD_HELP("--measure gain",     "-m gain",     "Loudness and sample peak only (fastest)");
+	CMD_HELP("--measure gain+lra", "-m gain+lra", "Also loudness range (a few % slower)");
+	CMD_HELP("--measure full",     "-m full",     "Also true peak (default, 2-3x slower)");
+
+	CMD_HELP("--fast-probe", "-F", "Trust the container header instead of probing streams");
+	CMD_HELP("--fast N[xSECS]", "-x N[xSECS]", "Only measure N windows of SECS (default 10) seconds and estimate the rest");
+	CMD_HELP("--downsample", "-D", "Measure the loudness of inputs above 48kHz at 48kHz");
+	CMD_HELP("--engine ENGINE", "-E ENGINE", "Measure with 'ebur128' (default) or the SIMD 'builtin' engine");
+	CMD_HELP("--io METHOD", "-I METHOD", "Read files with 'default', 'mmap', 'read' (aligned reads with readahead hints) or 'uring' (the same, opened ahead in batches through io_uring)");
+
+	puts("");
+
+	CMD_HELP("--cache",      "-C",  "Reuse and store scan results in the given cache file");
+	CMD_HELP("--cache-hash", "-H",  "Also match cached files by a hash of their contents");
+
+	puts("");
+
+	CMD_HELP("--files-from", "-f",  "Also read file names from the given file (- for stdin)");
+	CMD_HELP("--null",       "-0",  "File names read with -f are null-terminated");
+	CMD_HELP("--disk-order", "-R",  "Scan files in the order they are stored on disk");
+	CMD_HELP("--prefetch N", "-p N", "Start reading the next N files while scanning");
+
+	puts("");
+
+	CMD_HELP("--stats", "-T",  "Write per-stage timings as JSON to the given file (- for stdout)");
+
+	puts("");
+
+	CMD_HELP("--serve", "-L",  "Serve JSON scan requests on the given Unix socket");
+
 	puts("");
 
 	CMD_HELP("--output", "-o",  "Database-friendly tab-delimited list output");
+	CMD_HELP("--output-format json", "-O json", "Write a JSON record per track as soon as it's scanned");
+	CMD_HELP("--output-format csv",  "-O csv",  "Write a CSV record per track as soon as it's scanned");
 	CMD_HELP("--quiet",  "-q",  "Don't print status messages");
 
 	puts("");
@@ -0,0 +1,258 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "scan.h"
+#include "output.h"
+
+struct output {
+	FILE            *file;
+	output_format    format;
+
+	/* number of fields written so far in the current record */
+	unsigned         nb_fields;
+
+	pthread_mutex_t  lock;
+};
+
+/* CSV columns, JSON records have the same keys in the same order */
+static const char *output_columns =
+	"type,index,file,source,loudness,loudness_error,range,gain,peak,"
+	"sample_peak,true_peak,scan_seconds,cpu_seconds,bytes_read,tracks,error";
+
+static void output_begin(output *out);
+static void output_end(output *out);
+static void output_none(output *out);
+static void output_field(output *out, const char *key);
+static void output_string(output *out, const char *key, const char *str);
+static void output_number(output *out, const char *key,
+                          double value, bool valid);
+static void output_uint(output *out, const char *key,
+                        uint64_t value, bool valid);
+
+output *output_new(FILE *file, output_format format) {
+	output *out = calloc(1, sizeof(output));
+	if (out == NULL)
+		return NULL;
+
+	out -> file   = file;
+	out -> format = format;
+
+	pthread_mutex_init(&out -> lock, NULL);
+
+	if (format == OUTPUT_CSV) {
+		fprintf(file, "%s\n", output_columns);
+		fflush(file);
+	}
+
+	return out;
+}
+
+void output_free(output *out) {
+	if (out == NULL)
+		return;
+
+	pthread_mutex_destroy(&out -> lock);
+	free(out);
+}
+
+void output_track(output *out, unsigned index, const char *file,
+                  const scan_result *scan, const scan_job *job,
+                  const char *error) {
+	const char *source = NULL;
+	bool scanned = (scan != NULL) && (job != NULL);
+
+	if (scan != NULL)
+		source = (job == NULL) ? "tags" :
+		         job -> stats.cached ? "cache" : "scan";
+
+	pthread_mutex_lock(&out -> lock);
+
+	output_begin(out);
+
+	output_string(out, "type", "track");
+	output_uint(out, "index", index, true);
+	output_string(out, "file", file);
+	output_string(out, "source", source);
+
+	output_number(out, "loudness",
+	              scanned ? job -> loudness : 0.0, scanned);
+
+	/* only set for --fast estimates */
+	output_number(out, "loudness_error",
+	              scanned ? job -> loudness_error : 0.0,
+	              scanned && job -> estimated);
+
+	output_number(out, "range",
+	              scanned ? job -> loudness_range : 0.0, scanned);
+	output_number(out, "gain",
+	              scan ? scan -> track_gain : 0.0, scan != NULL);
+	output_number(out, "peak",
+	              scan ? scan -> track_peak : 0.0, scan != NULL);
+	output_number(out, "sample_peak",
+	              scanned ? job -> sample_peak : 0.0, scanned);
+
+	/* zero if it wasn't measured */
+	output_number(out, "true_peak", scanned ? job -> true_peak : 0.0,
+	              scanned && (job -> true_peak > 0.0));
+
+	output_number(out, "scan_seconds",
+	              scanned ? job -> stats.scan.wall_ns / 1e9 : 0.0, scanned);
+	output_number(out, "cpu_seconds",
+	              scanned ? job -> stats.scan.cpu_ns / 1e9 : 0.0, scanned);
+	output_uint(out, "bytes_read",
+	            scanned ? job -> stats.bytes_read : 0, scanned);
+
+	output_none(out);
+	output_string(out, "error", error);
+
+	output_end(out);
+
+	pthread_mutex_unlock(&out -> lock);
+}
+
+void output_album(output *out, unsigned nb_tracks, const scan_album *album) {
+	unsigned i;
+
+	pthread_mutex_lock(&out -> lock);
+
+	output_begin(out);
+
+	output_string(out, "type", "album");
+
+	/* index, file and source */
+	for (i = 0; i < 3; i++)
+		output_none(out);
+
+	output_number(out, "loudness", album -> loudness, true);
+	output_none(out);
+	output_number(out, "range", album -> loudness_range, true);
+	output_number(out, "gain", album -> gain, true);
+	output_number(out, "peak", album -> peak, true);
+
+	/* peaks and timings */
+	for (i = 0; i < 5; i++)
+		output_none(out);
+
+	output_uint(out, "tracks", nb_tracks, true);
+	output_none(out);
+
+	output_end(out);
+
+	pthread_mutex_unlock(&out -> lock);
+}
+
+static void output_begin(output *out) {
+	out -> nb_fields = 0;
+
+	if (out -> format == OUTPUT_JSON)
+		fputc('{', out -> file);
+}
+
+/* flushed right away, so that consumers can keep up with the scan */
+static void output_end(output *out) {
+	if (out -> format == OUTPUT_JSON)
+		fputc('}', out -> file);
+
+	fputc('\n', out -> file);
+	fflush(out -> file);
+}
+
+/* an empty CSV column, JSON records leave the key out instead */
+static void output_none(output *out) {
+	if ((out -> format == OUTPUT_CSV) && (out -> nb_fields++ > 0))
+		fputc(',', out -> file);
+}
+
+static void output_field(output *out, const char *key) {
+	if (out -> nb_fields++ > 0)
+		fputc(',', out -> file);
+
+	if (out -> format == OUTPUT_JSON)
+		fprintf(out -> file, "\"%s\":", key);
+}
+
+static void output_string(output *out, const char *key, const char *str) {
+	if (str == NULL) {
+		output_none(out);
+		return;
+	}
+
+	output_field(out, key);
+
+	if (out -> format == OUTPUT_JSON) {
+		stats_json_string(out -> file, str);
+		return;
+	}
+
+	fputc('"', out -> file);
+
+	for (; *str != '\0'; str++) {
+		if (*str == '"')
+			fputc('"', out -> file);
+
+		fputc(*str, out -> file);
+	}
+
+	fputc('"', out -> file);
+}
+
+static void output_number(output *out, const char *key,
+                          double value, bool valid) {
+	if (!valid) {
+		output_none(out);
+		return;
+	}
+
+	output_field(out, key);
+
+	/* silence has no loudness */
+	if (isfinite(value))
+		fprintf(out -> file, "%.6f", value);
+	else if (out -> format == OUTPUT_JSON)
+		fputs("null", out -> file);
+}
+
+static void output_uint(output *out, const char *key,
+                        uint64_t value, bool valid) {
+	if (!valid) {
+		output_none(out);
+		return;
+	}
+
+	output_field(out, key);
+
+	fprintf(out -> file, "%llu", (unsigned long long) value);
+}
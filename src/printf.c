@@ -43,6 +43,7 @@
 #include "util.h"
 
 int use_syslog = 0;
+int use_progress = 1;
 int quiet = 0;
 
 static void do_log(const char *prefix, const char *fmt, va_list args);
@@ -109,7 +110,7 @@ void progress_bar(unsigned ctrl, unsigned x, unsigned n, unsigned w) {
 
 	switch (ctrl) {
 		case 0: /* init */
-			if (quiet)
+			if (quiet || !use_progress)
 				break;
 
 			if (!isatty(fileno(stream)))
@@ -157,7 +158,7 @@ void progress_bar(unsigned ctrl, unsigned x, unsigned n, unsigned w) {
 
 static void do_log(const char *pre, const char *fmt, va_list args) {
 	int rc;
-	static char format[LINE_MAX];
+	char format[LINE_MAX];
 
 	rc = snprintf(format, LINE_MAX, "%s%s\n", use_syslog ? "" : pre, fmt);
 	if (rc < 0) fail_printf("EIO");
@@ -28,234 +28,757 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <math.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <ebur128.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavformat/avio.h>
 #include <libavresample/avresample.h>
 #include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/common.h>
+#include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
 
 #include "scan.h"
-#include "printf.h"
+#include "bs1770.h"
+#include "io.h"
 
-static void scan_frame(ebur128_state *ebur128, AVFrame *frame,
-                       AVAudioResampleContext *avr);
-static void scan_av_log(void *avcl, int level, const char *fmt, va_list args);
+/* Copies nb_samples samples from offset of the planes in to out, as
+ * interleaved samples of the same type, and returns their peak scaled to
+ * 1.0 like libebur128 does. Packed inputs are only read, not copied. */
+typedef double (*scan_kernel)(uint8_t *out, uint8_t *const *in,
+                              int channels, int offset, int nb_samples);
 
-static ebur128_state **scan_states   = NULL;
-static enum AVCodecID *scan_codecs   = NULL;
-static char          **scan_files    = NULL;
-static int             scan_nb_files = 0;
+typedef struct {
+	AVAudioResampleContext *avr;
 
-#define LUFS_TO_RG(L) (-18 - L)
+	int                 channels;
+	uint64_t            in_layout;
+	enum AVSampleFormat in_fmt;
 
-int scan_init(unsigned nb_files) {
-	av_register_all();
+	/* kernel for the last format seen by scan_frame_native(), NULL if
+	 * it needs the resampler */
+	enum AVSampleFormat kernel_fmt;
+	scan_kernel         kernel;
+
+	/* rate of the input and of what's fed to the meter, which only
+	 * differ when downsampling */
+	int                 in_rate;
+	int                 out_rate;
 
-	av_log_set_callback(scan_av_log);
+	/* input planes, moved forward to the first sample to convert */
+	uint8_t           **in_data;
 
-	scan_nb_files = nb_files;
+	uint8_t            *out_data;
+	int                 out_size;
+} scan_conv;
+
+/* what to scan: a file, or a memory buffer if data isn't NULL, in which
+ * case file is only used as a hint for probing the format */
+typedef struct {
+	const char    *file;
+	const uint8_t *data;
+	int64_t        size;
+
+	/* SCAN_IO_*, for files */
+	unsigned       io;
+	io_ring       *ring;
+} scan_source;
+
+/* read position of an input in a memory buffer */
+typedef struct {
+	const uint8_t *data;
+	int64_t        size;
+	int64_t        pos;
+} scan_mem;
+
+typedef struct {
+	AVFormatContext *container;
+	AVCodecContext  *ctx;
+	AVStream        *stream;
+	int              stream_id;
+
+	/* only used for memory buffers, and for files not read by
+	 * libavformat itself, in which case io.fd isn't -1 */
+	AVIOContext     *avio;
+	scan_mem         mem;
+	io_file          io;
+} scan_input;
+
+typedef struct {
+	const scan_source *src;
+
+	int            channels;
+	int            sample_rate;
+	unsigned       measure;
+	bool           fast_probe;
+
+	/* rate the loudness is measured at, and by what */
+	int            meter_rate;
+	unsigned       engine;
+
+	/* range of samples to measure, end is -1 for "until EOF" */
+	int64_t        start;
+	int64_t        end;
+
+	scan_summary   summary;
+
+	/* NULL if stats are disabled, else points to seg_stats */
+	scan_stats    *stats;
+	scan_stats     seg_stats;
+
+	pthread_t      thread;
+
+	/* set by the segment's thread if it failed */
+	int            rc;
+	char           error[SCAN_ERROR_LEN];
+} scan_segment;
+
+/* length of the filters interpolating between samples for true peaks, and
+ * most points they are evaluated at between two samples */
+#define SCAN_PEAK_TAPS       16
+#define SCAN_PEAK_MAX_PHASES 3
+
+/* Sample and true peak of an input that libebur128 only sees downsampled.
+ * True peaks are found by interpolating between samples up to at least
+ * SCAN_PEAK_RATE, which inputs above 48kHz only need 2x or 3x for. */
+typedef struct {
+	int      channels;
+
+	/* number of points interpolated between two samples */
+	int      nb_phases;
+	double   coeffs[SCAN_PEAK_MAX_PHASES][SCAN_PEAK_TAPS];
+
+	/* last SCAN_PEAK_TAPS samples of each channel, stored twice in a
+	 * row so that they can always be read in order from pos + 1 */
+	double  *history;
+	unsigned pos;
+
+	double   sample_peak;
+	double   true_peak;
+} scan_peak;
+
+typedef struct {
+	/* exactly one of them is set, but for benchmarks of the conversion
+	 * alone where neither is */
+	ebur128_state *ebur128;
+	bs1770        *builtin;
+
+	int            channels;
+
+	scan_summary  *summary;
+	scan_stats    *stats;
+
+	/* only used when downsampling, the meter measures true peaks and
+	 * the conversion kernels sample peaks otherwise */
+	bool           downsample;
+	scan_peak      peak;
+	double         sample_peak;
+
+	bool           short_term;
+
+	/* number of samples in 100ms, fed so far into the current 100ms
+	 * sub-block, and number of sub-blocks completed so far */
+	unsigned long  block_len;
+	unsigned long  block_fill;
+	unsigned long  nb_blocks;
+
+	/* blocks ending in a segment's pre-roll only prime the meter, they
+	 * are recorded by the segment before it */
+	unsigned long  record_from;
+} scan_meter;
+
+struct scan_context {
+	AVFrame   *frame;
+
+	/* only set up if have_conv and have_meter are, the meter for the
+	 * parameters below */
+	scan_conv  conv;
+	bool       have_conv;
+
+	scan_meter meter;
+	bool       have_meter;
+
+	int        channels;
+	int        sample_rate;
+	int        meter_rate;
+	unsigned   engine;
+	unsigned   measure;
+};
+
+/* don't split files into segments shorter than this (in seconds) */
+#define SCAN_SEGMENT_MIN_LEN 300
+
+/* How much to feed the meter before a segment's start (in seconds), so
+ * that the decoder and the filters are warmed up, and the gating blocks
+ * that overlap the start are whole, short-term ones being 3s long. */
+#define SCAN_SEGMENT_PREROLL 4
+
+/* probing limits with scan_opts.fast_probe, in bytes and microseconds */
+#define SCAN_FAST_PROBESIZE       "65536"
+#define SCAN_FAST_ANALYZEDURATION "500000"
+
+/* size of the AVIOContext buffer for memory inputs */
+#define SCAN_AVIO_BUFSIZE 32768
+
+/* what scan_opts.downsample measures loudness at, and the least rate true
+ * peaks are interpolated to (the one BS.1770 asks for) */
+#define SCAN_DOWNSAMPLE_RATE 48000
+#define SCAN_PEAK_RATE       192000
+
+static int scan_source_run(scan_job *job, const scan_source *src,
+                           const scan_opts *opts);
+static int scan_error(char *err, int rc, const char *fmt, ...);
+static double scan_window_error(const scan_segment *windows,
+                                unsigned nb_windows,
+                                const scan_summary *total, double fraction);
+static void scan_summary_scale(scan_summary *sum, double factor);
+
+static int scan_open(scan_input *in, const scan_source *src,
+                     bool fast_probe, char *err);
+static int scan_find_stream(AVFormatContext *container);
+static void scan_close(scan_input *in);
+static int scan_custom_io(scan_input *in, int buf_size, void *opaque,
+                          int (*read)(void *, uint8_t *, int),
+                          int64_t (*seek)(void *, int64_t, int));
+static int scan_mem_read(void *opaque, uint8_t *buf, int size);
+static int64_t scan_mem_seek(void *opaque, int64_t offset, int whence);
+static bool scan_frame_pos(scan_input *in, AVFrame *frame, int64_t *pos);
+static int scan_decode(scan_input *in, scan_segment *seg,
+                       scan_context *context,
+                       void (*progress)(unsigned, unsigned, unsigned,
+                                        unsigned));
+static void *scan_segment_worker(void *arg);
+
+static void scan_context_clear(scan_context *ctx);
+static void scan_context_end(scan_context *ctx, scan_context *local);
+static int scan_context_conv(scan_context *ctx, int channels,
+                             int in_rate, int out_rate);
+static int scan_context_meter(scan_context *ctx, scan_segment *seg);
+
+static int scan_meter_init(scan_meter *meter, scan_summary *summary,
+                           int channels, int sample_rate, int meter_rate,
+                           unsigned engine, unsigned measure);
+static void scan_meter_drop(scan_meter *meter);
+static void scan_meter_free(scan_meter *meter);
+static void scan_meter_reset(scan_meter *meter, scan_summary *summary,
+                             unsigned measure);
+static void scan_meter_seek(scan_meter *meter, int64_t pos, int64_t start);
+static int scan_meter_add(scan_meter *meter, enum AVSampleFormat fmt,
+                          const uint8_t *data, size_t nb_samples);
+static void scan_meter_block(scan_meter *meter);
+static void scan_meter_peaks(scan_meter *meter);
+static bs1770_format scan_bs1770_fmt(enum AVSampleFormat fmt);
+static void scan_hist_add(uint32_t *hist, double loudness);
+
+static int scan_peak_init(scan_peak *peak, int channels, int sample_rate,
+                          bool true_peak);
+static int scan_peak_add(scan_peak *peak, AVFrame *frame,
+                         int offset, int nb_samples);
+
+static int scan_conv_init(scan_conv *conv, int channels,
+                          int in_rate, int out_rate);
+static void scan_conv_free(scan_conv *conv);
+static uint8_t *scan_conv_reserve(scan_conv *conv, int size);
+static int scan_conv_setup(scan_conv *conv, AVFrame *frame,
+                           enum AVSampleFormat out_fmt, char *err);
+
+static int scan_frame(scan_meter *meter, AVFrame *frame, scan_conv *conv,
+                      int offset, int nb_samples, char *err);
+static int scan_frame_native(scan_meter *meter, AVFrame *frame,
+                             scan_conv *conv, int offset, int nb_samples);
+static int scan_frame_resample(scan_meter *meter, AVFrame *frame,
+                               scan_conv *conv, int offset, int nb_samples,
+                               char *err);
+static int scan_frame_downsample(scan_meter *meter, AVFrame *frame,
+                                 scan_conv *conv, int offset, int nb_samples,
+                                 char *err);
+static int scan_downsample_run(scan_meter *meter, scan_conv *conv,
+                               uint8_t **in, int in_linesize, int nb_samples,
+                               char *err);
+static void scan_init_once(void);
+static int scan_lockmgr(void **mutex, enum AVLockOp op);
 
-	scan_states = malloc(sizeof(ebur128_state *) * scan_nb_files);
-	if (scan_states == NULL)
-		fail_printf("OOM");
+#define LUFS_TO_RG(L) (-18 - L)
 
-	scan_files = malloc(sizeof(char *) * scan_nb_files);
-	if (scan_files == NULL)
-		fail_printf("OOM");
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+static int scan_init_rc;
 
-	scan_codecs = malloc(sizeof(enum AVCodecID) * scan_nb_files);
-	if (scan_codecs == NULL)
-		fail_printf("OOM");
+int scan_init(void) {
+	pthread_once(&scan_once, scan_init_once);
 
-	return 0;
+	return scan_init_rc;
 }
 
 void scan_deinit() {
-	int i;
+	av_lockmgr_register(NULL);
+}
+
+scan_context *scan_context_new(void) {
+	scan_context *ctx = calloc(1, sizeof(scan_context));
+	if (ctx == NULL)
+		return NULL;
 
-	for (i = 0; i < scan_nb_files; i++) {
-		ebur128_destroy(&scan_states[i]);
-		free(scan_files[i]);
+	ctx -> frame = av_frame_alloc();
+	if (ctx -> frame == NULL) {
+		free(ctx);
+		return NULL;
 	}
 
-	free(scan_states);
+	return ctx;
 }
 
-int scan_file(const char *file, unsigned index) {
-	int i, rc, stream_id = -1;
-	double start = 0, len = 0;
+void scan_context_free(scan_context *ctx) {
+	if (ctx == NULL)
+		return;
 
-	AVFormatContext *container = NULL;
+	scan_context_clear(ctx);
 
-	AVCodec *codec;
-	AVCodecContext *ctx;
-
-	AVFrame *frame;
-	AVPacket packet;
+	av_frame_free(&ctx -> frame);
 
-	AVAudioResampleContext *avr;
+	free(ctx);
+}
 
-	ebur128_state **ebur128 = &scan_states[index];
+int scan_file(scan_job *job, const char *file, const scan_opts *opts) {
+	scan_source src = { file, NULL, 0, opts -> io, opts -> ring };
 
-	int buffer_size = 192000 + FF_INPUT_BUFFER_PADDING_SIZE;
+	return scan_source_run(job, &src, opts);
+}
 
-	uint8_t buffer[buffer_size];
+int scan_buffer(scan_job *job, const char *name, const void *data,
+                size_t size, const scan_opts *opts) {
+	scan_source src = {
+		name ? name : "", data, size, SCAN_IO_DEFAULT, NULL
+	};
 
-	if (index >= scan_nb_files) {
-		err_printf("Index too high");
-		return -1;
+	/* NULL data would mean a file, an empty buffer just fails to open */
+	if (data == NULL) {
+		src.data = (const uint8_t *) "";
+		src.size = 0;
 	}
 
-	scan_files[index] = strdup(file);
+	return scan_source_run(job, &src, opts);
+}
+
+static int scan_source_run(scan_job *job, const scan_source *src,
+                           const scan_opts *opts) {
+	int rc;
+	unsigned i, nb_segments = 1, nb_threads;
+	int64_t nb_samples = 0, window = 0;
+
+	bool sampled = false;
+
+	scan_input in;
+	scan_segment *segments;
+
+	stats_mark mark, open_mark;
+	scan_stats *stats = opts -> stats ? &job -> stats : NULL;
+
+	stats_begin(stats, &mark);
+
+	job -> error[0]       = '\0';
+	job -> loudness_error = 0.0;
+	job -> estimated      = false;
+	job -> downsampled    = false;
+
+	job -> file = strdup(src -> file);
+	if (job -> file == NULL)
+		return scan_error(job -> error, 0, "OOM");
+
+	job -> summary = calloc(1, sizeof(scan_summary));
+	if (job -> summary == NULL)
+		return scan_error(job -> error, 0, "OOM");
+
+	stats_begin(stats, &open_mark);
+	rc = scan_open(&in, src, opts -> fast_probe, job -> error);
+	stats_end(stats, STATS_OPEN, &open_mark);
 
-	rc = avformat_open_input(&container, file, NULL, NULL);
 	if (rc < 0) {
-		char errbuf[2048];
-		av_strerror(rc, errbuf, 2048);
+		free(job -> summary);
+		job -> summary = NULL;
 
-		fail_printf("Could not open input: %s", errbuf);
+		return rc;
 	}
 
-	rc = avformat_find_stream_info(container, NULL);
-	if (rc < 0) {
-		char errbuf[2048];
-		av_strerror(rc, errbuf, 2048);
+	job -> codec_id = in.ctx -> codec_id;
 
-		fail_printf("Could not find stream info: %s", errbuf);
+	if (in.stream -> duration != AV_NOPTS_VALUE)
+		nb_samples = av_rescale_q(
+			in.stream -> duration, in.stream -> time_base,
+			av_make_q(1, in.ctx -> sample_rate)
+		);
+
+	window = (int64_t) opts -> window_len * in.ctx -> sample_rate;
+
+	/* only sample files that the windows cover less than half of, any
+	 * more and a full scan doesn't cost much more */
+	if ((opts -> nb_windows > 0) && (window > 0) && (nb_samples > 0) &&
+	    (in.container -> pb != NULL) && in.container -> pb -> seekable &&
+	    (window * opts -> nb_windows * 2 <= nb_samples)) {
+		sampled     = true;
+		nb_segments = opts -> nb_windows;
 	}
 
-	for (i = 0; i < container -> nb_streams; i++) {
-		if (container -> streams[i] -> codec -> codec_type == AVMEDIA_TYPE_AUDIO) {
-			stream_id = i;
-			break;
+	/* only split files that are long enough for it to pay off and
+	 * that can be seeked into */
+	if (!sampled && (opts -> nb_segments > 1) && (nb_samples > 0) &&
+	    (in.container -> pb != NULL) && in.container -> pb -> seekable) {
+		int64_t max = nb_samples /
+		              ((int64_t) SCAN_SEGMENT_MIN_LEN * in.ctx -> sample_rate);
+
+		nb_segments = FFMAX(FFMIN(opts -> nb_segments, max), 1);
+	}
+
+	segments = calloc(nb_segments, sizeof(scan_segment));
+	if (segments == NULL) {
+		scan_close(&in);
+
+		free(job -> summary);
+		job -> summary = NULL;
+
+		return scan_error(job -> error, 0, "OOM");
+	}
+
+	for (i = 0; i < nb_segments; i++) {
+		scan_segment *seg = &segments[i];
+
+		seg -> src         = src;
+		seg -> channels    = in.ctx -> channels;
+		seg -> sample_rate = in.ctx -> sample_rate;
+		seg -> measure     = opts -> measure;
+		seg -> fast_probe  = opts -> fast_probe;
+		seg -> meter_rate  = seg -> sample_rate;
+		seg -> engine      = opts -> engine;
+
+		if (opts -> downsample &&
+		    (seg -> sample_rate > SCAN_DOWNSAMPLE_RATE))
+			seg -> meter_rate = SCAN_DOWNSAMPLE_RATE;
+		seg -> stats       = stats ? &seg -> seg_stats : NULL;
+
+		if (sampled) {
+			/* one window in the middle of each of nb_segments
+			 * equal parts of the file */
+			seg -> start = (nb_samples - window) * (2 * i + 1) /
+			               (2 * nb_segments);
+			seg -> end   = seg -> start + window;
+			continue;
+		}
+
+		seg -> start = nb_samples * i / nb_segments;
+		seg -> end   = (i == nb_segments - 1) ? -1 :
+		               nb_samples * (i + 1) / nb_segments;
+	}
+
+	if (sampled) {
+		/* windows are short, so they're all read through the same
+		 * input, seeking from one to the next */
+		for (i = 0; i < nb_segments; i++) {
+			segments[i].rc = scan_decode(&in, &segments[i],
+			                             opts -> context, NULL);
+			if (segments[i].rc < 0)
+				break;
 		}
+	} else {
+		for (nb_threads = 1; nb_threads < nb_segments; nb_threads++) {
+			rc = pthread_create(
+				&segments[nb_threads].thread, NULL,
+				scan_segment_worker, &segments[nb_threads]
+			);
+			if (rc != 0)
+				break;
+		}
+
+		/* the first segment doesn't need to seek, so it reuses the
+		 * input that was opened for probing */
+		segments[0].rc = scan_decode(&in, &segments[0],
+		                             opts -> context, opts -> progress);
+
+		/* segments that didn't get a thread are scanned here */
+		for (i = nb_threads; i < nb_segments; i++)
+			scan_segment_worker(&segments[i]);
+
+		for (i = 1; i < nb_threads; i++)
+			pthread_join(segments[i].thread, NULL);
+	}
+
+	scan_close(&in);
+
+	job -> summary -> measure = opts -> measure;
+
+	for (i = 0, rc = 0; i < nb_segments; i++) {
+		if ((segments[i].rc < 0) && (rc == 0)) {
+			rc = segments[i].rc;
+			strcpy(job -> error, segments[i].error);
+		}
+
+		scan_summary_merge(job -> summary, &segments[i].summary);
+
+		if (stats != NULL)
+			stats_merge(stats, &segments[i].seg_stats);
 	}
 
-	if (stream_id < 0)
-		fail_printf("Could not find audio stream");
+	/* scale the histograms up to the length of the whole file, so that
+	 * sampled tracks weigh as much as they should in an album */
+	if ((rc == 0) && sampled) {
+		double covered = (double) window * nb_segments;
+
+		job -> estimated      = true;
+		job -> loudness_error = scan_window_error(
+			segments, nb_segments, job -> summary,
+			covered / nb_samples
+		);
 
-	ctx   = container -> streams[stream_id] -> codec;
-	codec = avcodec_find_decoder(ctx -> codec_id);
+		scan_summary_scale(job -> summary, nb_samples / covered);
+	}
+
+	job -> downsampled = segments[0].meter_rate != segments[0].sample_rate;
 
-	if (codec == NULL)
-		fail_printf("Could not find codec!");
+	free(segments);
 
-	rc = avcodec_open2(ctx, codec, NULL);
 	if (rc < 0) {
-		char errbuf[2048];
-		av_strerror(rc, errbuf, 2048);
+		free(job -> summary);
+		job -> summary = NULL;
 
-		fail_printf("Could not open codec: %s", errbuf);
+		return rc;
 	}
 
-	scan_codecs[index] = codec -> id;
+	if (stats != NULL)
+		stats_stop(&mark, &stats -> scan);
 
-	av_init_packet(&packet);
+	return 0;
+}
 
-	packet.data = buffer;
-	packet.size = buffer_size;
+/* Reduce the job to its track values, merging its histograms into the
+ * album ones (if any), so the summary can be freed right away. */
+void scan_job_reduce(scan_job *job, scan_summary *album) {
+	if (job -> summary == NULL)
+		return;
 
-	avr = avresample_alloc_context();
+	job -> loudness       = scan_summary_loudness(job -> summary);
+	job -> loudness_range = scan_summary_loudness_range(job -> summary);
+	job -> sample_peak    = job -> summary -> sample_peak;
+	job -> true_peak      = job -> summary -> true_peak;
 
-	*ebur128 = ebur128_init(
-		ctx -> channels, ctx -> sample_rate,
-		EBUR128_MODE_S | EBUR128_MODE_I | EBUR128_MODE_LRA |
-		EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_TRUE_PEAK
-	);
-	if (*ebur128 == NULL)
-		fail_printf("Could not initialize EBU R128 scanner");
+	if (album != NULL)
+		scan_summary_merge(album, job -> summary);
 
-	frame = av_frame_alloc();
-	if (frame == NULL)
-		fail_printf("OOM");
+	free(job -> summary);
+	job -> summary = NULL;
+}
 
-	if (container -> streams[stream_id] -> start_time != AV_NOPTS_VALUE)
-		start = container -> streams[stream_id] -> start_time *
-		        av_q2d(container -> streams[stream_id] -> time_base);
+void scan_job_free(scan_job *job) {
+	free(job -> summary);
+	job -> summary = NULL;
 
-	if (container -> streams[stream_id] -> duration != AV_NOPTS_VALUE)
-		len   = container -> streams[stream_id] -> duration *
-		        av_q2d(container -> streams[stream_id] -> time_base);
+	free(job -> file);
+	job -> file = NULL;
+}
 
-	progress_bar(0, 0, 0, 0);
+void scan_summary_merge(scan_summary *dst, const scan_summary *src) {
+	unsigned i;
 
-	while (av_read_frame(container, &packet) >= 0) {
-		if (packet.stream_index == stream_id) {
-			int got_frame = 0;
+	for (i = 0; i < SCAN_HIST_BINS; i++) {
+		dst -> block_hist[i]      += src -> block_hist[i];
+		dst -> short_term_hist[i] += src -> short_term_hist[i];
+	}
 
-			avcodec_decode_audio4(ctx, frame, &got_frame, &packet);
+	dst -> sample_peak = FFMAX(dst -> sample_peak, src -> sample_peak);
+	dst -> true_peak   = FFMAX(dst -> true_peak, src -> true_peak);
 
-			if (got_frame) {
-				double pos = frame -> pkt_dts *
-				             av_q2d(container -> streams[stream_id] -> time_base);
-				scan_frame(*ebur128, frame, avr);
+	dst -> measure    &= src -> measure;
+}
 
-				progress_bar(1, pos - start, len, 0);
-			}
-		}
+/* Jackknife estimate of the error of the loudness of a sampled file: the
+ * loudness is measured again without each window in turn, and the spread
+ * of those tells how much the result depends on where the windows fell.
+ * Returns twice the standard error, so that about 95% of full scans should
+ * be within it, or NAN if there are too few windows with any loudness. */
+static double scan_window_error(const scan_segment *windows,
+                                unsigned nb_windows,
+                                const scan_summary *total, double fraction) {
+	unsigned i, j, n = 0;
+	double mean = 0.0, var = 0.0;
+
+	double *loudness = calloc(nb_windows, sizeof(double));
+	scan_summary *rest = malloc(sizeof(scan_summary));
+
+	if ((loudness == NULL) || (rest == NULL)) {
+		free(loudness);
+		free(rest);
+		return NAN;
+	}
 
-		av_free_packet(&packet);
+	for (i = 0; i < nb_windows; i++) {
+		double l;
+
+		for (j = 0; j < SCAN_HIST_BINS; j++)
+			rest -> block_hist[j] = total -> block_hist[j] -
+			                        windows[i].summary.block_hist[j];
+
+		l = scan_summary_loudness(rest);
+		if (isfinite(l))
+			loudness[n++] = l;
 	}
 
-	progress_bar(2, 0, 0, 0);
+	for (i = 0; i < n; i++)
+		mean += loudness[i] / n;
+
+	for (i = 0; i < n; i++)
+		var += (loudness[i] - mean) * (loudness[i] - mean);
 
-	av_frame_free(&frame);
+	free(loudness);
+	free(rest);
 
-	avresample_free(&avr);
+	if (n < 2)
+		return NAN;
 
-	avcodec_close(ctx);
+	/* the jackknife variance is (n - 1) / n times the sum of squares,
+	 * and only the part of the file that wasn't measured adds to it */
+	return 2.0 * sqrt(var * (n - 1) / n * FFMAX(1.0 - fraction, 0.0));
+}
 
-	avformat_close_input(&container);
+static void scan_summary_scale(scan_summary *sum, double factor) {
+	unsigned i;
 
-	return 0;
+	for (i = 0; i < SCAN_HIST_BINS; i++) {
+		sum -> block_hist[i] =
+			(uint32_t) (sum -> block_hist[i] * factor + 0.5);
+		sum -> short_term_hist[i] =
+			(uint32_t) (sum -> short_term_hist[i] * factor + 0.5);
+	}
 }
 
-scan_result *scan_get_track_result(unsigned index, double pre_gain) {
-	unsigned ch;
+/* Energy at the lower boundary and at the center of a histogram bin. The
+ * gating below follows what libebur128 does in EBUR128_MODE_HISTOGRAM. */
+#define HIST_BOUNDARY(I) pow(10.0, ((I) / 10.0 - 70.0 + 0.691) / 10.0)
+#define HIST_ENERGY(I)   pow(10.0, ((I) / 10.0 - 69.95 + 0.691) / 10.0)
 
-	double global, range, peak = 0.0;
+#define ENERGY_TO_LUFS(E) (10 * log10(E) - 0.691)
 
-	scan_result *result = NULL;
-	ebur128_state *ebur128 = NULL;
+/* index of the first bin whose energy is above the given threshold */
+static unsigned scan_hist_gate(double threshold) {
+	unsigned i;
 
-	if (index >= scan_nb_files) {
-		err_printf("Index too high");
-		return NULL;
+	if (threshold < HIST_BOUNDARY(0))
+		return 0;
+
+	for (i = 0; i < SCAN_HIST_BINS - 1; i++) {
+		if (threshold < HIST_BOUNDARY(i + 1))
+			break;
 	}
 
-	result = malloc(sizeof(scan_result));
-	if (result == NULL)
-		fail_printf("OOM");
+	if (threshold > HIST_ENERGY(i))
+		i++;
+
+	return i;
+}
+
+double scan_summary_loudness(const scan_summary *sum) {
+	unsigned i, start;
 
-	ebur128 = scan_states[index];
+	double power = 0.0;
+	uint64_t count = 0;
 
-	if (ebur128_loudness_global(ebur128, &global) != EBUR128_SUCCESS)
-		global = 0.0;
+	for (i = 0; i < SCAN_HIST_BINS; i++) {
+		power += sum -> block_hist[i] * HIST_ENERGY(i);
+		count += sum -> block_hist[i];
+	}
 
-	if (ebur128_loudness_range(ebur128, &range) != EBUR128_SUCCESS)
-		range = 0.0;
+	if (count == 0)
+		return -HUGE_VAL;
 
-	for (ch = 0; ch < ebur128 -> channels; ch++) {
-		double tmp;
+	/* relative gate at -10 LU */
+	start = scan_hist_gate(power / count * 0.1);
 
-		if (ebur128_true_peak(ebur128, ch, &tmp) != EBUR128_SUCCESS)
-			continue;
+	power = 0.0;
+	count = 0;
+
+	for (i = start; i < SCAN_HIST_BINS; i++) {
+		power += sum -> block_hist[i] * HIST_ENERGY(i);
+		count += sum -> block_hist[i];
+	}
+
+	if (count == 0)
+		return -HUGE_VAL;
+
+	return ENERGY_TO_LUFS(power / count);
+}
+
+double scan_summary_loudness_range(const scan_summary *sum) {
+	unsigned i, j, start;
+
+	double power = 0.0, low, high;
+	uint64_t count = 0, size, pct_low, pct_high;
+
+	const uint32_t *hist = sum -> short_term_hist;
 
-		peak = FFMAX(peak, tmp);
+	for (i = 0; i < SCAN_HIST_BINS; i++) {
+		power += hist[i] * HIST_ENERGY(i);
+		count += hist[i];
 	}
 
-	result -> file                 = scan_files[index];
-	result -> codec_id             = scan_codecs[index];
+	if (count == 0)
+		return 0.0;
+
+	/* relative gate at -20 LU */
+	start = scan_hist_gate(power / count * 0.01);
+
+	count = 0;
+
+	for (i = start; i < SCAN_HIST_BINS; i++)
+		count += hist[i];
+
+	if (count == 0)
+		return 0.0;
+
+	pct_low  = (uint64_t) ((count - 1) * 0.10 + 0.5);
+	pct_high = (uint64_t) ((count - 1) * 0.95 + 0.5);
+
+	size = 0;
+	j = start;
+
+	while (size <= pct_low)
+		size += hist[j++];
+
+	low = HIST_ENERGY(j - 1);
+
+	while (size <= pct_high)
+		size += hist[j++];
+
+	high = HIST_ENERGY(j - 1);
+
+	return ENERGY_TO_LUFS(high) - ENERGY_TO_LUFS(low);
+}
+
+scan_result *scan_get_track_result(scan_job *job, double pre_gain) {
+	scan_result *result = NULL;
+
+	if ((job -> file == NULL) || (job -> error[0] != '\0'))
+		return NULL;
+
+	scan_job_reduce(job, NULL);
+
+	result = malloc(sizeof(scan_result));
+	if (result == NULL)
+		return NULL;
+
+	result -> file                 = job -> file;
+	result -> codec_id             = job -> codec_id;
 
-	result -> track_gain           = LUFS_TO_RG(global) + pre_gain;
-	result -> track_peak           = peak;
-	result -> track_loudness       = global;
-	result -> track_loudness_range = range;
+	result -> track_gain           = LUFS_TO_RG(job -> loudness) + pre_gain;
+	result -> track_peak           = FFMAX(job -> true_peak, job -> sample_peak);
+	result -> track_loudness       = job -> loudness;
+	result -> track_loudness_range = job -> loudness_range;
 
 	result -> album_gain           = 0.f;
 	result -> album_peak           = 0.f;
@@ -265,70 +788,1489 @@ scan_result *scan_get_track_result(unsigned index, double pre_gain) {
 	return result;
 }
 
-void scan_set_album_result(scan_result *result, double pre_gain) {
-	double global, range;
+/* The album summary holds the merged histograms of all of its tracks,
+ * and so the highest peak of all of them too. */
+scan_album *scan_get_album_result(const scan_summary *sum, double pre_gain) {
+	scan_album *album = malloc(sizeof(scan_album));
+	if (album == NULL)
+		return NULL;
 
-	if (ebur128_loudness_global_multiple(
-		scan_states, scan_nb_files, &global
-	) != EBUR128_SUCCESS)
-		global = 0.0;
+	album -> loudness       = scan_summary_loudness(sum);
+	album -> loudness_range = scan_summary_loudness_range(sum);
+	album -> gain           = LUFS_TO_RG(album -> loudness) + pre_gain;
+	album -> peak           = FFMAX(sum -> true_peak, sum -> sample_peak);
 
-	if (ebur128_loudness_range_multiple(
-		scan_states, scan_nb_files, &range
-	) != EBUR128_SUCCESS)
-		range = 0.0;
+	return album;
+}
 
-	result -> album_gain           = LUFS_TO_RG(global) + pre_gain;
-	result -> album_peak           = result -> track_peak;
-	result -> album_loudness       = global;
-	result -> album_loudness_range = range;
+void scan_set_album_result(scan_result *result, const scan_album *album) {
+	result -> album_gain           = album -> gain;
+	result -> album_peak           = album -> peak;
+	result -> album_loudness       = album -> loudness;
+	result -> album_loudness_range = album -> loudness_range;
 }
 
-static void scan_frame(ebur128_state *ebur128, AVFrame *frame,
-                       AVAudioResampleContext *avr) {
-	int rc;
+/* Format an error message into err, followed by the description of the
+ * libav error code rc if it's negative. Always returns -1. */
+static int scan_error(char *err, int rc, const char *fmt, ...) {
+	size_t len;
+	va_list args;
 
-	uint8_t            *out_data;
-	size_t              out_size;
-	int                 out_linesize;
-	enum AVSampleFormat out_fmt = AV_SAMPLE_FMT_S16;
+	va_start(args, fmt);
+	vsnprintf(err, SCAN_ERROR_LEN, fmt, args);
+	va_end(args);
 
-	av_opt_set_int(avr, "in_channel_layout", frame -> channel_layout, 0);
-	av_opt_set_int(avr, "out_channel_layout", frame -> channel_layout, 0);
-	av_opt_set_int(avr, "in_sample_fmt", frame -> format, 0);
-	av_opt_set_int(avr, "out_sample_fmt", out_fmt, 0);
+	len = strlen(err);
+
+	if ((rc < 0) && (len + 2 < SCAN_ERROR_LEN)) {
+		strcpy(err + len, ": ");
+		av_strerror(rc, err + len + 2, SCAN_ERROR_LEN - len - 2);
+	}
+
+	return -1;
+}
+
+static int scan_open(scan_input *in, const scan_source *src,
+                     bool fast_probe, char *err) {
+	int i, rc = 0, stream_id = -1;
+
+	AVCodec *codec;
+	AVDictionary *options = NULL;
+
+	in -> container = NULL;
+	in -> ctx       = NULL;
+	in -> avio      = NULL;
+	in -> io.fd     = -1;
+
+	/* every input gets its own read position, so that segments can
+	 * read the same buffer or file at once */
+	if (src -> data != NULL) {
+		in -> mem.data = src -> data;
+		in -> mem.size = src -> size;
+		in -> mem.pos  = 0;
+
+		rc = scan_custom_io(in, SCAN_AVIO_BUFSIZE, &in -> mem,
+		                    scan_mem_read, scan_mem_seek);
+	} else if (((src -> io == SCAN_IO_URING) &&
+	            (io_ring_take(src -> ring, src -> file, &in -> io) == 0)) ||
+	           ((src -> io != SCAN_IO_DEFAULT) &&
+	            (io_open(&in -> io, src -> file,
+	                     src -> io == SCAN_IO_MMAP) == 0))) {
+		/* what io_open() can't open, like pipes, is left to
+		 * libavformat, which also reports errors as usual */
+		rc = scan_custom_io(in, (in -> io.map != NULL) ?
+		                        SCAN_AVIO_BUFSIZE : IO_CHUNK,
+		                    &in -> io, io_read, io_seek);
+	}
 
-	rc = avresample_open(avr);
 	if (rc < 0) {
-		char errbuf[2048];
-		av_strerror(rc, errbuf, 2048);
+		scan_close(in);
 
-		fail_printf("Could not open AVResample: %s", errbuf);
+		return scan_error(err, 0, "OOM");
 	}
 
-	out_size = av_samples_get_buffer_size(
-		&out_linesize, 2, frame -> nb_samples, out_fmt, 0
-	);
+	if (fast_probe) {
+		av_dict_set(&options, "probesize", SCAN_FAST_PROBESIZE, 0);
+		av_dict_set(&options, "analyzeduration",
+		            SCAN_FAST_ANALYZEDURATION, 0);
+	}
+
+	rc = avformat_open_input(&in -> container, src -> file, NULL, &options);
+	av_dict_free(&options);
 
-	out_data = av_malloc(out_size);
+	if (rc < 0) {
+		scan_close(in);
+
+		return scan_error(err, rc, "Could not open input");
+	}
 
-	if (avresample_convert(
-		avr, &out_data, out_linesize, frame -> nb_samples,
-		frame -> data, frame -> linesize[0], frame -> nb_samples
-	) < 0)
-		fail_printf("Cannor convert");
+	/* most audio containers describe their streams well enough in the
+	 * header, in which case there's no need to read any packets */
+	if (fast_probe)
+		stream_id = scan_find_stream(in -> container);
 
-	rc = ebur128_add_frames_short(
-		ebur128, (short *) out_data, frame -> nb_samples
-	);
+	if (stream_id < 0) {
+		rc = avformat_find_stream_info(in -> container, NULL);
+		if (rc < 0) {
+			scan_close(in);
+
+			return scan_error(err, rc, "Could not find stream info");
+		}
+
+		for (i = 0; i < in -> container -> nb_streams; i++) {
+			if (in -> container -> streams[i] -> codec -> codec_type == AVMEDIA_TYPE_AUDIO) {
+				stream_id = i;
+				break;
+			}
+		}
+	}
+
+	if (stream_id < 0) {
+		scan_close(in);
+
+		return scan_error(err, 0, "Could not find audio stream");
+	}
+
+	/* so that the demuxer skips cover art, video and other tracks
+	 * instead of handing us packets we'd only throw away */
+	for (i = 0; i < in -> container -> nb_streams; i++) {
+		if (i != stream_id)
+			in -> container -> streams[i] -> discard = AVDISCARD_ALL;
+	}
+
+	in -> stream_id = stream_id;
+	in -> stream    = in -> container -> streams[stream_id];
+	in -> ctx       = in -> stream -> codec;
+
+	codec = avcodec_find_decoder(in -> ctx -> codec_id);
+
+	if (codec == NULL) {
+		scan_close(in);
+
+		return scan_error(err, 0, "Could not find codec");
+	}
+
+	rc = avcodec_open2(in -> ctx, codec, NULL);
+	if (rc < 0) {
+		scan_close(in);
+
+		return scan_error(err, rc, "Could not open codec");
+	}
+
+	return 0;
+}
+
+/* First audio stream whose parameters are all known from the container
+ * header, or -1. */
+static int scan_find_stream(AVFormatContext *container) {
+	int i;
+
+	for (i = 0; i < container -> nb_streams; i++) {
+		AVCodecContext *ctx = container -> streams[i] -> codec;
+
+		if (ctx -> codec_type != AVMEDIA_TYPE_AUDIO)
+			continue;
+
+		/* the sample format is only needed once decoding starts,
+		 * and the decoder sets it itself */
+		if ((ctx -> codec_id == AV_CODEC_ID_NONE) ||
+		    (ctx -> sample_rate <= 0) || (ctx -> channels <= 0))
+			return -1;
+
+		return i;
+	}
+
+	return -1;
+}
+
+static void scan_close(scan_input *in) {
+	if (in -> ctx != NULL)
+		avcodec_close(in -> ctx);
+
+	avformat_close_input(&in -> container);
+
+	/* libavformat leaves custom I/O contexts alone, and may have
+	 * replaced the buffer */
+	if (in -> avio != NULL) {
+		av_freep(&in -> avio -> buffer);
+		av_freep(&in -> avio);
+	}
+
+	io_close(&in -> io);
+}
+
+/* Have libavformat read the input through the given callbacks. */
+static int scan_custom_io(scan_input *in, int buf_size, void *opaque,
+                          int (*read)(void *, uint8_t *, int),
+                          int64_t (*seek)(void *, int64_t, int)) {
+	uint8_t *buf = av_malloc(buf_size);
+
+	in -> container = avformat_alloc_context();
+
+	if (buf != NULL)
+		in -> avio = avio_alloc_context(buf, buf_size, 0, opaque,
+		                                read, NULL, seek);
+
+	if ((in -> container == NULL) || (in -> avio == NULL)) {
+		if (in -> avio == NULL)
+			av_free(buf);
+
+		avformat_free_context(in -> container);
+		in -> container = NULL;
+
+		return -1;
+	}
 
-	if (rc != EBUR128_SUCCESS)
-		err_printf("Error filtering");
+	in -> container -> pb     = in -> avio;
+	in -> container -> flags |= AVFMT_FLAG_CUSTOM_IO;
 
-	avresample_close(avr);
-	av_free(out_data);
+	return 0;
+}
+
+static int scan_mem_read(void *opaque, uint8_t *buf, int size) {
+	scan_mem *mem = opaque;
+	int64_t left = mem -> size - mem -> pos;
+
+	if (left <= 0)
+		return AVERROR_EOF;
+
+	size = FFMIN(size, left);
+
+	memcpy(buf, mem -> data + mem -> pos, size);
+	mem -> pos += size;
+
+	return size;
+}
+
+static int64_t scan_mem_seek(void *opaque, int64_t offset, int whence) {
+	scan_mem *mem = opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return mem -> size;
+
+		case SEEK_SET:
+			break;
+
+		case SEEK_CUR:
+			offset += mem -> pos;
+			break;
+
+		case SEEK_END:
+			offset += mem -> size;
+			break;
+
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if ((offset < 0) || (offset > mem -> size))
+		return AVERROR(EINVAL);
+
+	mem -> pos = offset;
+
+	return offset;
+}
+
+/* Position of the first sample of the frame, counted from the start of the
+ * stream. Returns false if the frame has no timestamp. */
+static bool scan_frame_pos(scan_input *in, AVFrame *frame, int64_t *pos) {
+	int64_t ts = frame -> pkt_pts;
+	int64_t start = 0;
+
+	if (ts == AV_NOPTS_VALUE)
+		ts = frame -> pkt_dts;
+
+	if (ts == AV_NOPTS_VALUE)
+		return false;
+
+	if (in -> stream -> start_time != AV_NOPTS_VALUE)
+		start = in -> stream -> start_time;
+
+	*pos = av_rescale_q(
+		ts - start, in -> stream -> time_base,
+		av_make_q(1, in -> ctx -> sample_rate)
+	);
+
+	return true;
 }
 
-static void scan_av_log(void *avcl, int level, const char *fmt, va_list args) {
+static int scan_decode(scan_input *in, scan_segment *seg,
+                       scan_context *context,
+                       void (*progress)(unsigned, unsigned, unsigned,
+                                        unsigned)) {
+	int rc = 0;
+	bool have_pos = false;
+
+	stats_mark mark;
+
+	int64_t pos = 0;
+	int64_t len = seg -> end;
+
+	/* where the pre-roll starts, and whether the meter was told */
+	int64_t feed = 0;
+	bool    fed  = false;
+
+	AVFrame *frame;
+	AVPacket packet;
+
+	scan_conv *conv;
+	scan_meter *meter;
+
+	/* without a context everything is set up for this segment alone */
+	scan_context local, *ctx = context;
+
+	if (seg -> start > 0) {
+		int64_t preroll = (int64_t) SCAN_SEGMENT_PREROLL * seg -> sample_rate;
+		int64_t block   = (seg -> meter_rate + 5) / 10;
+		int64_t ts;
+
+		/* on a 100ms boundary of the whole file, like a serial scan's
+		 * blocks */
+		feed = av_rescale(FFMAX(seg -> start - preroll, 0),
+		                  seg -> meter_rate, seg -> sample_rate);
+		feed = av_rescale(feed - feed % block,
+		                  seg -> sample_rate, seg -> meter_rate);
+
+		ts = av_rescale_q(
+			feed, av_make_q(1, seg -> sample_rate),
+			in -> stream -> time_base
+		);
+
+		if (in -> stream -> start_time != AV_NOPTS_VALUE)
+			ts += in -> stream -> start_time;
+
+		rc = av_seek_frame(
+			in -> container, in -> stream_id, ts, AVSEEK_FLAG_BACKWARD
+		);
+		if (rc < 0)
+			return scan_error(seg -> error, rc, "Could not seek");
+
+		/* only failures are negative, rc is the decoding status from
+		 * here on */
+		rc = 0;
+
+		/* the input may have been decoding elsewhere before */
+		avcodec_flush_buffers(in -> ctx);
+	} else {
+		/* the start of the stream is sample 0 by definition */
+		have_pos = true;
+	}
+
+	if (len < 0) {
+		len = 0;
+
+		if (in -> stream -> duration != AV_NOPTS_VALUE)
+			len = av_rescale_q(
+				in -> stream -> duration, in -> stream -> time_base,
+				av_make_q(1, seg -> sample_rate)
+			);
+	}
+
+	av_init_packet(&packet);
+
+	packet.data = NULL;
+	packet.size = 0;
+
+	if (ctx == NULL) {
+		memset(&local, 0, sizeof(local));
+
+		local.frame = av_frame_alloc();
+		if (local.frame == NULL)
+			return scan_error(seg -> error, 0, "OOM");
+
+		ctx = &local;
+	}
+
+	if (scan_context_conv(ctx, in -> ctx -> channels,
+	                      seg -> sample_rate, seg -> meter_rate) < 0) {
+		scan_context_end(ctx, &local);
+
+		return scan_error(seg -> error, 0, "OOM");
+	}
+
+	if (scan_context_meter(ctx, seg) < 0) {
+		scan_context_end(ctx, &local);
+
+		return scan_error(seg -> error, 0,
+		                  "Could not initialize EBU R128 scanner");
+	}
+
+	frame = ctx -> frame;
+	conv  = &ctx -> conv;
+	meter = &ctx -> meter;
+
+	meter -> stats = seg -> stats;
+
+	if (progress != NULL)
+		progress(0, 0, 0, 0);
+
+	stats_begin(seg -> stats, &mark);
+
+	while (av_read_frame(in -> container, &packet) >= 0) {
+		stats_end(seg -> stats, STATS_READ, &mark);
+
+		if (seg -> stats != NULL)
+			seg -> stats -> bytes_read += packet.size;
+
+		if (packet.stream_index == in -> stream_id) {
+			int got_frame = 0;
+
+			stats_begin(seg -> stats, &mark);
+			avcodec_decode_audio4(in -> ctx, frame, &got_frame, &packet);
+			stats_end(seg -> stats, STATS_DECODE, &mark);
+
+			if (got_frame && !have_pos)
+				have_pos = scan_frame_pos(in, frame, &pos);
+
+			if (got_frame && have_pos) {
+				int offset = 0, nb_samples = frame -> nb_samples;
+
+				/* drop what the seek went back to before the
+				 * pre-roll, and anything past the end of the
+				 * segment */
+				if (pos < feed)
+					offset = FFMIN(feed - pos, nb_samples);
+
+				if ((seg -> end >= 0) && (pos + nb_samples > seg -> end))
+					nb_samples = FFMAX(seg -> end - pos, 0);
+
+				if ((nb_samples > offset) && !fed) {
+					scan_meter_seek(
+						meter,
+						av_rescale(pos + offset,
+						           seg -> meter_rate,
+						           seg -> sample_rate),
+						av_rescale(seg -> start,
+						           seg -> meter_rate,
+						           seg -> sample_rate)
+					);
+
+					fed = true;
+				}
+
+				if (nb_samples > offset) {
+					stats_begin(seg -> stats, &mark);
+					rc = scan_frame(
+						meter, frame, conv, offset,
+						nb_samples - offset, seg -> error
+					);
+					stats_end(seg -> stats, STATS_CONVERT,
+					          &mark);
+
+					/* the pre-roll is counted by the
+					 * segment before */
+					if (seg -> stats != NULL)
+						seg -> stats -> samples += FFMAX(
+							nb_samples - FFMAX(
+								offset,
+								seg -> start - pos
+							), 0
+						);
+				}
+
+				pos += frame -> nb_samples;
+
+				if (progress != NULL)
+					progress(
+						1, pos / seg -> sample_rate,
+						len / seg -> sample_rate, 0
+					);
+			}
+		}
+
+		av_free_packet(&packet);
+
+		if (rc < 0)
+			break;
+
+		if (have_pos && (seg -> end >= 0) && (pos >= seg -> end))
+			break;
+
+		stats_begin(seg -> stats, &mark);
+	}
+
+	/* the resampler holds back a few samples until it's drained */
+	if ((rc == 0) && (conv -> in_rate != conv -> out_rate)) {
+		stats_begin(seg -> stats, &mark);
+		rc = scan_downsample_run(meter, conv, NULL, 0, 0, seg -> error);
+		stats_end(seg -> stats, STATS_CONVERT, &mark);
+	}
+
+	/* the meter was timed as part of the conversion */
+	if (seg -> stats != NULL) {
+		stats_time *convert = &seg -> stats -> stages[STATS_CONVERT];
+		stats_time *metered = &seg -> stats -> stages[STATS_METER];
+
+		convert -> wall_ns -= FFMIN(metered -> wall_ns, convert -> wall_ns);
+		convert -> cpu_ns  -= FFMIN(metered -> cpu_ns, convert -> cpu_ns);
+	}
+
+	if (progress != NULL)
+		progress(2, 0, 0, 0);
+
+	if (rc == 0)
+		scan_meter_peaks(meter);
+
+	scan_context_end(ctx, &local);
+
+	return rc;
+}
+
+int scan_bench_frame(AVFrame *frame, int channels, int sample_rate,
+                     int meter_rate, unsigned engine, unsigned measure,
+                     unsigned nb_runs, bool feed) {
+	int rc = 0;
+	unsigned i;
+
+	char err[SCAN_ERROR_LEN];
+
+	scan_conv conv;
+	scan_meter meter;
+	scan_summary summary;
+
+	memset(&summary, 0, sizeof(summary));
+
+	if (scan_conv_init(&conv, channels, sample_rate, meter_rate) < 0)
+		return -1;
+
+	if (scan_meter_init(&meter, &summary, channels, sample_rate,
+	                    meter_rate, engine, measure) < 0) {
+		scan_conv_free(&conv);
+		return -1;
+	}
+
+	if (!feed)
+		scan_meter_drop(&meter);
+
+	for (i = 0; (rc == 0) && (i < nb_runs); i++)
+		rc = scan_frame(&meter, frame, &conv,
+		                0, frame -> nb_samples, err);
+
+	scan_meter_free(&meter);
+
+	scan_conv_free(&conv);
+
+	return rc;
+}
+
+static void *scan_segment_worker(void *arg) {
+	scan_segment *seg = arg;
+	scan_input in;
+
+	stats_mark mark;
+
+	stats_begin(seg -> stats, &mark);
+	seg -> rc = scan_open(&in, seg -> src, seg -> fast_probe, seg -> error);
+	stats_end(seg -> stats, STATS_OPEN, &mark);
+
+	if (seg -> rc < 0)
+		return NULL;
+
+	if ((in.ctx -> channels != seg -> channels) ||
+	    (in.ctx -> sample_rate != seg -> sample_rate))
+		seg -> rc = scan_error(seg -> error, 0,
+		                       "Stream parameters changed while seeking");
+	else
+		seg -> rc = scan_decode(&in, seg, NULL, NULL);
+
+	scan_close(&in);
+
+	return NULL;
+}
+
+static void scan_context_clear(scan_context *ctx) {
+	if (ctx -> have_meter)
+		scan_meter_free(&ctx -> meter);
+
+	if (ctx -> have_conv)
+		scan_conv_free(&ctx -> conv);
+
+	ctx -> have_meter = false;
+	ctx -> have_conv  = false;
+}
+
+/* Done with a segment: free everything if it was scanned without a
+ * context, else just let go of the last frame. */
+static void scan_context_end(scan_context *ctx, scan_context *local) {
+	if (ctx == local) {
+		scan_context_clear(local);
+		av_frame_free(&local -> frame);
+		return;
+	}
+
+	av_frame_unref(ctx -> frame);
+}
+
+static int scan_context_conv(scan_context *ctx, int channels,
+                             int in_rate, int out_rate) {
+	scan_conv *conv = &ctx -> conv;
+
+	if (ctx -> have_conv && (conv -> channels != channels)) {
+		scan_conv_free(conv);
+		ctx -> have_conv = false;
+	}
+
+	if (!ctx -> have_conv) {
+		if (scan_conv_init(conv, channels, in_rate, out_rate) < 0)
+			return -1;
+
+		ctx -> have_conv = true;
+		return 0;
+	}
+
+	/* the resampler holds on to the last input's rates and samples,
+	 * scan_conv_setup() opens it again */
+	if ((in_rate != out_rate) || (conv -> in_rate != conv -> out_rate)) {
+		if (avresample_is_open(conv -> avr))
+			avresample_close(conv -> avr);
+
+		conv -> in_layout = 0;
+		conv -> in_fmt    = AV_SAMPLE_FMT_NONE;
+	}
+
+	if ((in_rate != out_rate) && (conv -> in_data == NULL)) {
+		conv -> in_data = calloc(channels, sizeof(uint8_t *));
+		if (conv -> in_data == NULL)
+			return -1;
+	}
+
+	conv -> in_rate  = in_rate;
+	conv -> out_rate = out_rate;
+
+	return 0;
+}
+
+/* Only the builtin meter can start over, libebur128 has no way to reset
+ * its state, so its meters are created again for every segment. */
+static int scan_context_meter(scan_context *ctx, scan_segment *seg) {
+	if (ctx -> have_meter && (ctx -> meter.builtin != NULL) &&
+	    (ctx -> channels == seg -> channels) &&
+	    (ctx -> sample_rate == seg -> sample_rate) &&
+	    (ctx -> meter_rate == seg -> meter_rate) &&
+	    (ctx -> engine == seg -> engine) &&
+	    (ctx -> measure == seg -> measure)) {
+		scan_meter_reset(&ctx -> meter, &seg -> summary,
+		                 seg -> measure);
+		return 0;
+	}
+
+	if (ctx -> have_meter) {
+		scan_meter_free(&ctx -> meter);
+		ctx -> have_meter = false;
+	}
+
+	if (scan_meter_init(&ctx -> meter, &seg -> summary, seg -> channels,
+	                    seg -> sample_rate, seg -> meter_rate,
+	                    seg -> engine, seg -> measure) < 0)
+		return -1;
+
+	ctx -> have_meter  = true;
+	ctx -> channels    = seg -> channels;
+	ctx -> sample_rate = seg -> sample_rate;
+	ctx -> meter_rate  = seg -> meter_rate;
+	ctx -> engine      = seg -> engine;
+	ctx -> measure     = seg -> measure;
+
+	return 0;
+}
+
+static int scan_conv_init(scan_conv *conv, int channels,
+                          int in_rate, int out_rate) {
+	conv -> avr = avresample_alloc_context();
+	if (conv -> avr == NULL)
+		return -1;
+
+	conv -> channels   = channels;
+	conv -> in_layout  = 0;
+	conv -> in_fmt     = AV_SAMPLE_FMT_NONE;
+	conv -> kernel_fmt = AV_SAMPLE_FMT_NONE;
+	conv -> kernel     = NULL;
+	conv -> in_rate    = in_rate;
+	conv -> out_rate   = out_rate;
+	conv -> in_data    = NULL;
+
+	conv -> out_data   = NULL;
+	conv -> out_size   = 0;
+
+	if (in_rate != out_rate) {
+		conv -> in_data = calloc(channels, sizeof(uint8_t *));
+		if (conv -> in_data == NULL) {
+			avresample_free(&conv -> avr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void scan_conv_free(scan_conv *conv) {
+	avresample_free(&conv -> avr);
+
+	free(conv -> in_data);
+	conv -> in_data = NULL;
+
+	av_free(conv -> out_data);
+	conv -> out_data = NULL;
+	conv -> out_size = 0;
+}
+
+static uint8_t *scan_conv_reserve(scan_conv *conv, int size) {
+	/* grow the output buffer, it's never shrunk */
+	if (size > conv -> out_size) {
+		av_free(conv -> out_data);
+
+		conv -> out_size = 0;
+
+		conv -> out_data = av_malloc(size);
+		if (conv -> out_data == NULL)
+			return NULL;
+
+		conv -> out_size = size;
+	}
+
+	return conv -> out_data;
+}
+
+/* (Re)open the resampler for the frame's layout and format, but only when
+ * they actually change. */
+static int scan_conv_setup(scan_conv *conv, AVFrame *frame,
+                           enum AVSampleFormat out_fmt, char *err) {
+	int rc;
+
+	uint64_t layout = frame -> channel_layout;
+
+	if (layout == 0)
+		layout = av_get_default_channel_layout(conv -> channels);
+
+	if ((layout == conv -> in_layout) && (frame -> format == conv -> in_fmt))
+		return 0;
+
+	if (avresample_is_open(conv -> avr))
+		avresample_close(conv -> avr);
+
+	av_opt_set_int(conv -> avr, "in_channel_layout", layout, 0);
+	av_opt_set_int(conv -> avr, "out_channel_layout", layout, 0);
+	av_opt_set_int(conv -> avr, "in_sample_fmt", frame -> format, 0);
+	av_opt_set_int(conv -> avr, "out_sample_fmt", out_fmt, 0);
+	av_opt_set_int(conv -> avr, "in_sample_rate", conv -> in_rate, 0);
+	av_opt_set_int(conv -> avr, "out_sample_rate", conv -> out_rate, 0);
+
+	rc = avresample_open(conv -> avr);
+	if (rc < 0)
+		return scan_error(err, rc, "Could not open AVResample");
+
+	conv -> in_layout = layout;
+	conv -> in_fmt    = frame -> format;
+
+	return 0;
+}
+
+/* Measure nb_samples samples of the frame, starting at offset. */
+static int scan_frame(scan_meter *meter, AVFrame *frame, scan_conv *conv,
+                      int offset, int nb_samples, char *err) {
+	int rc;
+
+	if (conv -> in_rate != conv -> out_rate)
+		return scan_frame_downsample(meter, frame, conv,
+		                             offset, nb_samples, err);
+
+	rc = scan_frame_native(meter, frame, conv, offset, nb_samples);
+
+	if (rc > 0)
+		return scan_frame_resample(meter, frame, conv,
+		                           offset, nb_samples, err);
+
+	if (rc < 0)
+		return scan_error(err, 0, "Error filtering");
+
+	return 0;
+}
+
+/* Peaks are tracked as the lowest and highest values rather than as
+ * absolute values, which overflow for INT32_MIN and keep the loops easy to
+ * vectorize. */
+#define SCAN_KERNEL_PACKED(NAME, TYPE, SCALE)				\
+	static double NAME(uint8_t *out, uint8_t *const *in,		\
+	                   int channels, int offset, int nb_samples) {	\
+		int i;							\
+		TYPE lo = 0, hi = 0;					\
+		const TYPE *src = (const TYPE *) in[0] +		\
+		                  (size_t) offset * channels;		\
+									\
+		(void) out;						\
+									\
+		for (i = 0; i < nb_samples * channels; i++) {		\
+			hi = (src[i] > hi) ? src[i] : hi;		\
+			lo = (src[i] < lo) ? src[i] : lo;		\
+		}							\
+									\
+		return FFMAX((double) hi, -(double) lo) * (SCALE);	\
+	}
+
+/* CHANNELS is either a constant, so that the inner loop is unrolled, or
+ * just channels for the generic kernels. */
+#define SCAN_KERNEL_PLANAR(NAME, TYPE, SCALE, CHANNELS)			\
+	static double NAME(uint8_t *out, uint8_t *const *in,		\
+	                   int channels, int offset, int nb_samples) {	\
+		int s, c;						\
+		TYPE lo = 0, hi = 0;					\
+		TYPE *dst = (TYPE *) out;				\
+									\
+		(void) channels;					\
+									\
+		for (s = offset; s < offset + nb_samples; s++) {	\
+			for (c = 0; c < (CHANNELS); c++) {		\
+				TYPE v = ((const TYPE *) in[c])[s];	\
+									\
+				hi = (v > hi) ? v : hi;			\
+				lo = (v < lo) ? v : lo;			\
+									\
+				*dst++ = v;				\
+			}						\
+		}							\
+									\
+		return FFMAX((double) hi, -(double) lo) * (SCALE);	\
+	}
+
+/* the same scaling as libebur128 */
+#define SCAN_SCALE_S16 (1.0 / 32768.0)
+#define SCAN_SCALE_S32 (1.0 / 2147483648.0)
+
+SCAN_KERNEL_PACKED(scan_kernel_s16, int16_t, SCAN_SCALE_S16)
+SCAN_KERNEL_PACKED(scan_kernel_s32, int32_t, SCAN_SCALE_S32)
+SCAN_KERNEL_PACKED(scan_kernel_flt, float,   1.0)
+SCAN_KERNEL_PACKED(scan_kernel_dbl, double,  1.0)
+
+SCAN_KERNEL_PLANAR(scan_kernel_s16p_2, int16_t, SCAN_SCALE_S16, 2)
+SCAN_KERNEL_PLANAR(scan_kernel_s16p_6, int16_t, SCAN_SCALE_S16, 6)
+SCAN_KERNEL_PLANAR(scan_kernel_s16p_8, int16_t, SCAN_SCALE_S16, 8)
+SCAN_KERNEL_PLANAR(scan_kernel_s16p,   int16_t, SCAN_SCALE_S16, channels)
+
+SCAN_KERNEL_PLANAR(scan_kernel_s32p_2, int32_t, SCAN_SCALE_S32, 2)
+SCAN_KERNEL_PLANAR(scan_kernel_s32p_6, int32_t, SCAN_SCALE_S32, 6)
+SCAN_KERNEL_PLANAR(scan_kernel_s32p_8, int32_t, SCAN_SCALE_S32, 8)
+SCAN_KERNEL_PLANAR(scan_kernel_s32p,   int32_t, SCAN_SCALE_S32, channels)
+
+SCAN_KERNEL_PLANAR(scan_kernel_fltp_2, float, 1.0, 2)
+SCAN_KERNEL_PLANAR(scan_kernel_fltp_6, float, 1.0, 6)
+SCAN_KERNEL_PLANAR(scan_kernel_fltp_8, float, 1.0, 8)
+SCAN_KERNEL_PLANAR(scan_kernel_fltp,   float, 1.0, channels)
+
+SCAN_KERNEL_PLANAR(scan_kernel_dblp_2, double, 1.0, 2)
+SCAN_KERNEL_PLANAR(scan_kernel_dblp_6, double, 1.0, 6)
+SCAN_KERNEL_PLANAR(scan_kernel_dblp_8, double, 1.0, 8)
+SCAN_KERNEL_PLANAR(scan_kernel_dblp,   double, 1.0, channels)
+
+/* Picked top to bottom, a channel count of 0 matches any. Planar mono is
+ * laid out like packed mono. */
+static const struct {
+	enum AVSampleFormat fmt;
+	int                 channels;
+	scan_kernel         kernel;
+} scan_kernels[] = {
+	{ AV_SAMPLE_FMT_S16,  0, scan_kernel_s16 },
+	{ AV_SAMPLE_FMT_S32,  0, scan_kernel_s32 },
+	{ AV_SAMPLE_FMT_FLT,  0, scan_kernel_flt },
+	{ AV_SAMPLE_FMT_DBL,  0, scan_kernel_dbl },
+
+	{ AV_SAMPLE_FMT_S16P, 1, scan_kernel_s16 },
+	{ AV_SAMPLE_FMT_S16P, 2, scan_kernel_s16p_2 },
+	{ AV_SAMPLE_FMT_S16P, 6, scan_kernel_s16p_6 },
+	{ AV_SAMPLE_FMT_S16P, 8, scan_kernel_s16p_8 },
+	{ AV_SAMPLE_FMT_S16P, 0, scan_kernel_s16p },
+
+	{ AV_SAMPLE_FMT_S32P, 1, scan_kernel_s32 },
+	{ AV_SAMPLE_FMT_S32P, 2, scan_kernel_s32p_2 },
+	{ AV_SAMPLE_FMT_S32P, 6, scan_kernel_s32p_6 },
+	{ AV_SAMPLE_FMT_S32P, 8, scan_kernel_s32p_8 },
+	{ AV_SAMPLE_FMT_S32P, 0, scan_kernel_s32p },
+
+	{ AV_SAMPLE_FMT_FLTP, 1, scan_kernel_flt },
+	{ AV_SAMPLE_FMT_FLTP, 2, scan_kernel_fltp_2 },
+	{ AV_SAMPLE_FMT_FLTP, 6, scan_kernel_fltp_6 },
+	{ AV_SAMPLE_FMT_FLTP, 8, scan_kernel_fltp_8 },
+	{ AV_SAMPLE_FMT_FLTP, 0, scan_kernel_fltp },
+
+	{ AV_SAMPLE_FMT_DBLP, 1, scan_kernel_dbl },
+	{ AV_SAMPLE_FMT_DBLP, 2, scan_kernel_dblp_2 },
+	{ AV_SAMPLE_FMT_DBLP, 6, scan_kernel_dblp_6 },
+	{ AV_SAMPLE_FMT_DBLP, 8, scan_kernel_dblp_8 },
+	{ AV_SAMPLE_FMT_DBLP, 0, scan_kernel_dblp },
+};
+
+static scan_kernel scan_kernel_find(enum AVSampleFormat fmt, int channels) {
+	size_t i;
+
+	for (i = 0; i < sizeof(scan_kernels) / sizeof(scan_kernels[0]); i++) {
+		if ((scan_kernels[i].fmt == fmt) &&
+		    ((scan_kernels[i].channels == 0) ||
+		     (scan_kernels[i].channels == channels)))
+			return scan_kernels[i].kernel;
+	}
+
+	return NULL;
+}
+
+/* Feed samples that the meter can take as they are, interleaving planar
+ * data on the way if needed, and take their sample peak in the same pass.
+ * Returns 1 if the format needs converting. */
+static int scan_frame_native(scan_meter *meter, AVFrame *frame,
+                             scan_conv *conv, int offset, int nb_samples) {
+	uint8_t *data;
+	double peak;
+
+	int channels = conv -> channels;
+
+	enum AVSampleFormat fmt = frame -> format;
+
+	int bps = av_get_bytes_per_sample(fmt);
+
+	if (fmt != conv -> kernel_fmt) {
+		conv -> kernel     = scan_kernel_find(fmt, channels);
+		conv -> kernel_fmt = fmt;
+	}
+
+	if (conv -> kernel == NULL)
+		return 1;
+
+	if (!av_sample_fmt_is_planar(fmt) || (channels == 1)) {
+		data = frame -> extended_data[0] + offset * channels * bps;
+	} else {
+		data = scan_conv_reserve(conv, nb_samples * channels * bps);
+		if (data == NULL)
+			return -1;
+	}
+
+	peak = conv -> kernel(data, frame -> extended_data,
+	                      channels, offset, nb_samples);
+
+	meter -> sample_peak = FFMAX(meter -> sample_peak, peak);
+
+	return scan_meter_add(meter, av_get_packed_sample_fmt(fmt),
+	                      data, nb_samples);
+}
+
+static int scan_frame_resample(scan_meter *meter, AVFrame *frame,
+                               scan_conv *conv, int offset, int nb_samples,
+                               char *err) {
+	int rc;
+	double peak;
+
+	int                 out_size;
+	int                 out_linesize;
+	enum AVSampleFormat out_fmt = AV_SAMPLE_FMT_S16;
+
+	rc = scan_conv_setup(conv, frame, out_fmt, err);
+	if (rc < 0)
+		return rc;
+
+	out_size = av_samples_get_buffer_size(
+		&out_linesize, conv -> channels, frame -> nb_samples, out_fmt, 0
+	);
+
+	if (scan_conv_reserve(conv, out_size) == NULL)
+		return scan_error(err, 0, "OOM");
+
+	rc = avresample_convert(
+		conv -> avr, &conv -> out_data, out_linesize, frame -> nb_samples,
+		frame -> extended_data, frame -> linesize[0], frame -> nb_samples
+	);
+	if (rc < 0)
+		return scan_error(err, rc, "Cannot convert");
+
+	nb_samples = FFMIN(nb_samples, rc - offset);
+	if (nb_samples <= 0)
+		return 0;
+
+	peak = scan_kernel_s16(NULL, &conv -> out_data, conv -> channels,
+	                       offset, nb_samples);
+
+	meter -> sample_peak = FFMAX(meter -> sample_peak, peak);
+
+	rc = scan_meter_add(
+		meter, out_fmt,
+		conv -> out_data + offset * conv -> channels * sizeof(short),
+		nb_samples
+	);
+	if (rc < 0)
+		return scan_error(err, 0, "Error filtering");
+
+	return 0;
+}
+
+/* Measure peaks on the input as it is, and loudness on a 48kHz float copy
+ * of it. */
+static int scan_frame_downsample(scan_meter *meter, AVFrame *frame,
+                                 scan_conv *conv, int offset, int nb_samples,
+                                 char *err) {
+	int rc, c, planes = 1;
+
+	int bps = av_get_bytes_per_sample(frame -> format);
+
+	if (scan_peak_add(&meter -> peak, frame, offset, nb_samples) < 0)
+		return scan_error(err, 0, "Unsupported sample format");
+
+	rc = scan_conv_setup(conv, frame, AV_SAMPLE_FMT_FLT, err);
+	if (rc < 0)
+		return rc;
+
+	if (av_sample_fmt_is_planar(frame -> format))
+		planes = conv -> channels;
+	else
+		bps *= conv -> channels;
+
+	for (c = 0; c < planes; c++)
+		conv -> in_data[c] = frame -> extended_data[c] + offset * bps;
+
+	return scan_downsample_run(meter, conv, conv -> in_data,
+	                           frame -> linesize[0], nb_samples, err);
+}
+
+/* Resample nb_samples samples of in and feed whatever comes out to the
+ * meter. A NULL in drains the resampler. */
+static int scan_downsample_run(scan_meter *meter, scan_conv *conv,
+                               uint8_t **in, int in_linesize, int nb_samples,
+                               char *err) {
+	int rc, out_size, out_linesize, out_samples;
+
+	/* nothing was ever fed to it */
+	if (!avresample_is_open(conv -> avr))
+		return 0;
+
+	out_samples = av_rescale_rnd(
+		avresample_get_delay(conv -> avr) + nb_samples,
+		conv -> out_rate, conv -> in_rate, AV_ROUND_UP
+	);
+
+	if (out_samples <= 0)
+		return 0;
+
+	out_size = av_samples_get_buffer_size(
+		&out_linesize, conv -> channels, out_samples,
+		AV_SAMPLE_FMT_FLT, 0
+	);
+
+	if (scan_conv_reserve(conv, out_size) == NULL)
+		return scan_error(err, 0, "OOM");
+
+	rc = avresample_convert(
+		conv -> avr, &conv -> out_data, out_linesize, out_samples,
+		in, in_linesize, nb_samples
+	);
+	if (rc < 0)
+		return scan_error(err, rc, "Cannot convert");
+
+	if ((rc > 0) &&
+	    (scan_meter_add(meter, AV_SAMPLE_FMT_FLT, conv -> out_data, rc) < 0))
+		return scan_error(err, 0, "Error filtering");
+
+	return 0;
+}
+
+static int scan_meter_init(scan_meter *meter, scan_summary *summary,
+                           int channels, int sample_rate, int meter_rate,
+                           unsigned engine, unsigned measure) {
+	/* integrated loudness and range come from our own histograms, so
+	 * libebur128 doesn't need to keep any gating blocks around */
+	int mode = EBUR128_MODE_M;
+	unsigned builtin_mode = 0;
+
+	meter -> ebur128     = NULL;
+	meter -> builtin     = NULL;
+	meter -> channels    = channels;
+	meter -> downsample  = (meter_rate != sample_rate);
+	meter -> sample_peak = 0.0;
+
+	if (meter -> downsample) {
+		/* peaks of downsampled audio are not those of the input */
+		if (scan_peak_init(&meter -> peak, channels, sample_rate,
+		                   measure & SCAN_MEASURE_TRUE_PEAK) < 0)
+			return -1;
+	} else if (measure & SCAN_MEASURE_TRUE_PEAK) {
+		/* 4x oversampling, by far the most expensive part; sample
+		 * peaks are taken by the conversion kernels */
+		mode |= EBUR128_MODE_TRUE_PEAK;
+		builtin_mode |= BS1770_TRUE_PEAK;
+	}
+
+	if (measure & SCAN_MEASURE_LRA) {
+		mode |= EBUR128_MODE_S;
+		builtin_mode |= BS1770_SHORT_TERM;
+	}
+
+	if (engine == SCAN_ENGINE_BUILTIN)
+		meter -> builtin = bs1770_new(channels, meter_rate,
+		                              builtin_mode);
+	else
+		meter -> ebur128 = ebur128_init(channels, meter_rate, mode);
+
+	if ((meter -> ebur128 == NULL) && (meter -> builtin == NULL)) {
+		if (meter -> downsample)
+			free(meter -> peak.history);
+
+		return -1;
+	}
+
+	summary -> measure = measure;
+
+	meter -> summary    = summary;
+	meter -> stats      = NULL;
+	meter -> short_term = measure & SCAN_MEASURE_LRA;
+	meter -> block_len  = (meter_rate + 5) / 10;
+	meter -> block_fill = 0;
+	meter -> nb_blocks  = 0;
+
+	meter -> record_from = 0;
+
+	return 0;
+}
+
+static void scan_meter_free(scan_meter *meter) {
+	scan_meter_drop(meter);
+
+	if (meter -> downsample) {
+		free(meter -> peak.history);
+		meter -> peak.history = NULL;
+	}
+}
+
+/* Start over on another input, with the same parameters as before. */
+static void scan_meter_reset(scan_meter *meter, scan_summary *summary,
+                             unsigned measure) {
+	if (meter -> builtin != NULL)
+		bs1770_reset(meter -> builtin);
+
+	if (meter -> downsample) {
+		memset(meter -> peak.history, 0,
+		       meter -> channels * 2 * SCAN_PEAK_TAPS * sizeof(double));
+
+		meter -> peak.pos         = 0;
+		meter -> peak.sample_peak = 0.0;
+		meter -> peak.true_peak   = 0.0;
+	}
+
+	summary -> measure = measure;
+
+	meter -> summary     = summary;
+	meter -> stats       = NULL;
+	meter -> sample_peak = 0.0;
+	meter -> block_fill  = 0;
+	meter -> nb_blocks   = 0;
+	meter -> record_from = 0;
+}
+
+/* Tell the meter that the next sample is pos samples (at the meter's rate)
+ * into the file, and that blocks are only recorded once they end past
+ * start. What comes before start is only fed to prime the filters and the
+ * blocks that overlap it. */
+static void scan_meter_seek(scan_meter *meter, int64_t pos, int64_t start) {
+	meter -> nb_blocks   = pos / meter -> block_len;
+	meter -> block_fill  = pos % meter -> block_len;
+	meter -> record_from = start / meter -> block_len + 1;
+}
+
+/* Free the loudness meter, after which samples are only converted. */
+static void scan_meter_drop(scan_meter *meter) {
+	if (meter -> ebur128 != NULL)
+		ebur128_destroy(&meter -> ebur128);
+
+	bs1770_free(meter -> builtin);
+	meter -> builtin = NULL;
+}
+
+/* Feed samples to the meter, stopping at every 100ms boundary to record
+ * the loudness of the gating blocks that just completed. Samples are only
+ * converted and then dropped if there's no meter (benchmarks). */
+static int scan_meter_add(scan_meter *meter, enum AVSampleFormat fmt,
+                          const uint8_t *data, size_t nb_samples) {
+	int rc = EBUR128_SUCCESS;
+	size_t frame_size;
+	stats_mark mark;
+
+	if ((meter -> ebur128 == NULL) && (meter -> builtin == NULL))
+		return 0;
+
+	stats_begin(meter -> stats, &mark);
+
+	frame_size = av_get_bytes_per_sample(fmt) * meter -> channels;
+
+	while ((nb_samples > 0) && (rc == EBUR128_SUCCESS)) {
+		size_t n = FFMIN(nb_samples,
+		                 meter -> block_len - meter -> block_fill);
+
+		if (meter -> builtin != NULL) {
+			rc = bs1770_add(meter -> builtin, scan_bs1770_fmt(fmt),
+			                data, n);
+			if (rc < 0)
+				rc = EBUR128_ERROR_INVALID_MODE;
+		} else switch (fmt) {
+			case AV_SAMPLE_FMT_S16:
+				rc = ebur128_add_frames_short(
+					meter -> ebur128, (const short *) data, n
+				);
+				break;
+
+			case AV_SAMPLE_FMT_S32:
+				rc = ebur128_add_frames_int(
+					meter -> ebur128, (const int *) data, n
+				);
+				break;
+
+			case AV_SAMPLE_FMT_FLT:
+				rc = ebur128_add_frames_float(
+					meter -> ebur128, (const float *) data, n
+				);
+				break;
+
+			case AV_SAMPLE_FMT_DBL:
+				rc = ebur128_add_frames_double(
+					meter -> ebur128, (const double *) data, n
+				);
+				break;
+
+			default:
+				rc = EBUR128_ERROR_INVALID_MODE;
+				break;
+		}
+
+		data       += n * frame_size;
+		nb_samples -= n;
+
+		meter -> block_fill += n;
+
+		if (meter -> block_fill == meter -> block_len) {
+			meter -> block_fill = 0;
+			meter -> nb_blocks++;
+
+			scan_meter_block(meter);
+		}
+	}
+
+	stats_end(meter -> stats, STATS_METER, &mark);
+
+	return (rc == EBUR128_SUCCESS) ? 0 : -1;
+}
+
+static void scan_meter_block(scan_meter *meter) {
+	double loudness;
+
+	if (meter -> nb_blocks < meter -> record_from)
+		return;
+
+	/* gating blocks are 400ms long and a new one starts every 100ms */
+	if (meter -> nb_blocks >= 4) {
+		if (meter -> builtin != NULL)
+			scan_hist_add(meter -> summary -> block_hist,
+			              bs1770_momentary(meter -> builtin));
+		else if (ebur128_loudness_momentary(meter -> ebur128,
+		                                    &loudness) == EBUR128_SUCCESS)
+			scan_hist_add(meter -> summary -> block_hist, loudness);
+	}
+
+	/* short-term blocks are 3s long and a new one starts every second */
+	if (meter -> short_term &&
+	    (meter -> nb_blocks >= 30) && (meter -> nb_blocks % 10 == 0)) {
+		if (meter -> builtin != NULL)
+			scan_hist_add(meter -> summary -> short_term_hist,
+			              bs1770_short_term(meter -> builtin));
+		else if (ebur128_loudness_shortterm(meter -> ebur128,
+		                                    &loudness) == EBUR128_SUCCESS)
+			scan_hist_add(meter -> summary -> short_term_hist,
+			              loudness);
+	}
+}
+
+/* Copy the peaks seen so far into the summary. */
+static void scan_meter_peaks(scan_meter *meter) {
+	int ch;
+	scan_summary *summary = meter -> summary;
+
+	if (meter -> downsample) {
+		summary -> sample_peak = FFMAX(summary -> sample_peak,
+		                               meter -> peak.sample_peak);
+
+		if (summary -> measure & SCAN_MEASURE_TRUE_PEAK)
+			summary -> true_peak = FFMAX(summary -> true_peak,
+			                             meter -> peak.true_peak);
+
+		return;
+	}
+
+	summary -> sample_peak = FFMAX(summary -> sample_peak,
+	                               meter -> sample_peak);
+
+	if (!(summary -> measure & SCAN_MEASURE_TRUE_PEAK))
+		return;
+
+	/* the true peak is never below the sample peak */
+	summary -> true_peak = FFMAX(summary -> true_peak, meter -> sample_peak);
+
+	for (ch = 0; ch < meter -> channels; ch++) {
+		double peak;
+
+		if (meter -> builtin != NULL)
+			summary -> true_peak = FFMAX(
+				summary -> true_peak,
+				bs1770_true_peak(meter -> builtin, ch)
+			);
+		else if (ebur128_true_peak(meter -> ebur128, ch, &peak) ==
+		         EBUR128_SUCCESS)
+			summary -> true_peak = FFMAX(summary -> true_peak, peak);
+	}
+}
+
+static bs1770_format scan_bs1770_fmt(enum AVSampleFormat fmt) {
+	switch (fmt) {
+		case AV_SAMPLE_FMT_S16: return BS1770_S16;
+		case AV_SAMPLE_FMT_S32: return BS1770_S32;
+		case AV_SAMPLE_FMT_FLT: return BS1770_FLT;
+		default:                return BS1770_DBL;
+	}
+}
+
+static void scan_hist_add(uint32_t *hist, double loudness) {
+	int bin;
+
+	/* absolute gate at -70 LUFS */
+	if (!(loudness >= -70.0))
+		return;
+
+	bin = (int) ((loudness + 70.0) * 10.0);
+
+	hist[FFMIN(bin, SCAN_HIST_BINS - 1)]++;
+}
+
+static int scan_peak_init(scan_peak *peak, int channels, int sample_rate,
+                          bool true_peak) {
+	int p, i, factor;
+
+	memset(peak, 0, sizeof(scan_peak));
+
+	peak -> channels = channels;
+
+	peak -> history = calloc(channels * 2 * SCAN_PEAK_TAPS, sizeof(double));
+	if (peak -> history == NULL)
+		return -1;
+
+	if (!true_peak)
+		return 0;
+
+	/* 2x for 96kHz, 3x for 88.2kHz and none from 192kHz up */
+	factor = (SCAN_PEAK_RATE + sample_rate - 1) / sample_rate;
+	peak -> nb_phases = FFMIN(factor, SCAN_PEAK_MAX_PHASES + 1) - 1;
+
+	/* Hann windowed sinc, centered between the two middle taps */
+	for (p = 0; p < peak -> nb_phases; p++) {
+		double sum = 0.0;
+		double frac = (double) (p + 1) / (peak -> nb_phases + 1);
+
+		for (i = 0; i < SCAN_PEAK_TAPS; i++) {
+			double x = i - (SCAN_PEAK_TAPS / 2 - 1) - frac;
+			double w = 0.5 + 0.5 * cos(M_PI * x / (SCAN_PEAK_TAPS / 2));
+
+			peak -> coeffs[p][i] = w * sin(M_PI * x) / (M_PI * x);
+			sum += peak -> coeffs[p][i];
+		}
+
+		for (i = 0; i < SCAN_PEAK_TAPS; i++)
+			peak -> coeffs[p][i] /= sum;
+	}
+
+	return 0;
+}
+
+static inline void scan_peak_sample(scan_peak *peak, int ch, double v) {
+	int p, i;
+
+	double *h = peak -> history + ch * 2 * SCAN_PEAK_TAPS;
+
+	h[peak -> pos] = h[peak -> pos + SCAN_PEAK_TAPS] = v;
+
+	peak -> sample_peak = FFMAX(peak -> sample_peak, fabs(v));
+	peak -> true_peak   = FFMAX(peak -> true_peak, fabs(v));
+
+	/* the points between the two samples in the middle of the last
+	 * SCAN_PEAK_TAPS, oldest first */
+	h += peak -> pos + 1;
+
+	for (p = 0; p < peak -> nb_phases; p++) {
+		double y = 0.0;
+
+		for (i = 0; i < SCAN_PEAK_TAPS; i++)
+			y += peak -> coeffs[p][i] * h[i];
+
+		peak -> true_peak = FFMAX(peak -> true_peak, fabs(y));
+	}
+}
+
+#define SCAN_PEAK_LOOP(TYPE, PEAK, FRAME, OFFSET, NB_SAMPLES, SCALE, BIAS) \
+	do {								\
+		int s, c;						\
+		int channels = (PEAK) -> channels;			\
+		bool planar = av_sample_fmt_is_planar((FRAME) -> format); \
+									\
+		for (s = (OFFSET); s < (OFFSET) + (NB_SAMPLES); s++) {	\
+			for (c = 0; c < channels; c++) {		\
+				TYPE x = planar ?			\
+					((TYPE *) (FRAME) -> extended_data[c])[s] : \
+					((TYPE *) (FRAME) -> extended_data[0])[s * channels + c]; \
+									\
+				scan_peak_sample((PEAK), c,		\
+				                 ((double) x - (BIAS)) * (SCALE)); \
+			}						\
+									\
+			(PEAK) -> pos = ((PEAK) -> pos + 1) % SCAN_PEAK_TAPS; \
+		}							\
+	} while (0)
+
+/* Look for peaks in nb_samples samples of the frame, starting at offset.
+ * Returns -1 if the sample format is unknown. */
+static int scan_peak_add(scan_peak *peak, AVFrame *frame,
+                         int offset, int nb_samples) {
+	switch (av_get_packed_sample_fmt(frame -> format)) {
+		case AV_SAMPLE_FMT_U8:
+			SCAN_PEAK_LOOP(uint8_t, peak, frame, offset, nb_samples,
+			               1.0 / 128, 128);
+			break;
+
+		case AV_SAMPLE_FMT_S16:
+			SCAN_PEAK_LOOP(int16_t, peak, frame, offset, nb_samples,
+			               1.0 / 32768, 0);
+			break;
+
+		case AV_SAMPLE_FMT_S32:
+			SCAN_PEAK_LOOP(int32_t, peak, frame, offset, nb_samples,
+			               1.0 / 2147483648.0, 0);
+			break;
+
+		case AV_SAMPLE_FMT_FLT:
+			SCAN_PEAK_LOOP(float, peak, frame, offset, nb_samples,
+			               1.0, 0);
+			break;
+
+		case AV_SAMPLE_FMT_DBL:
+			SCAN_PEAK_LOOP(double, peak, frame, offset, nb_samples,
+			               1.0, 0);
+			break;
+
+		default:
+			return -1;
+	}
+
+	return 0;
+}
+
+static void scan_init_once(void) {
+	av_register_all();
+
+	/* avcodec_open2() is only safe to call from several threads at
+	 * once if a lock manager has been registered */
+	if (av_lockmgr_register(scan_lockmgr) != 0)
+		scan_init_rc = -1;
+}
+
+static int scan_lockmgr(void **mutex, enum AVLockOp op) {
+	switch (op) {
+		case AV_LOCK_CREATE:
+			*mutex = malloc(sizeof(pthread_mutex_t));
+			if (*mutex == NULL)
+				return 1;
+
+			return pthread_mutex_init(*mutex, NULL) != 0;
+
+		case AV_LOCK_OBTAIN:
+			return pthread_mutex_lock(*mutex) != 0;
+
+		case AV_LOCK_RELEASE:
+			return pthread_mutex_unlock(*mutex) != 0;
+
+		case AV_LOCK_DESTROY:
+			pthread_mutex_destroy(*mutex);
+			free(*mutex);
+			*mutex = NULL;
+			return 0;
+	}
 
+	return 1;
 }
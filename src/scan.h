@@ -28,10 +28,133 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ebur128.h>
+
+#include "stats.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* loudness histograms have 0.1 LU wide bins from -70 to +30 LUFS */
+#define SCAN_HIST_BINS 1000
+
+/* what to measure on top of integrated loudness and sample peak */
+#define SCAN_MEASURE_LRA       (1 << 0)
+#define SCAN_MEASURE_TRUE_PEAK (1 << 1)
+
+#define SCAN_MEASURE_GAIN      0
+#define SCAN_MEASURE_GAIN_LRA  SCAN_MEASURE_LRA
+#define SCAN_MEASURE_FULL      (SCAN_MEASURE_LRA | SCAN_MEASURE_TRUE_PEAK)
+
+/* what measures loudness and peaks: libebur128, or the in-tree SIMD
+ * implementation in bs1770.c */
+#define SCAN_ENGINE_EBUR128 0
+#define SCAN_ENGINE_BUILTIN 1
+
+/* how local files are read: by libavformat, mapped, or with large aligned
+ * reads, the last two with readahead and page cache hints (see io.c), and
+ * the last also opened through scan_opts.ring when queued there */
+#define SCAN_IO_DEFAULT 0
+#define SCAN_IO_MMAP    1
+#define SCAN_IO_READ    2
+#define SCAN_IO_URING   3
+
+/* size of the error message buffers, including the terminating null */
+#define SCAN_ERROR_LEN 256
+
+typedef struct {
+	/* 400ms gating blocks, used for the integrated loudness */
+	uint32_t block_hist[SCAN_HIST_BINS];
+
+	/* 3s short-term blocks, used for the loudness range */
+	uint32_t short_term_hist[SCAN_HIST_BINS];
+
+	double   sample_peak;
+	double   true_peak;
+
+	/* SCAN_MEASURE_* flags of what was actually measured */
+	uint32_t measure;
+} scan_summary;
+
+struct io_ring;
+
+/* The decoded frame, sample conversion and loudness meter of a scan, kept
+ * between files by a thread that scans many of them (see serve.c) so that
+ * they're only set up again when the stream parameters change. */
+typedef struct scan_context scan_context;
+
+typedef struct {
+	/* maximum number of threads a single long file is split across */
+	unsigned nb_segments;
+
+	/* SCAN_MEASURE_* flags */
+	unsigned measure;
+
+	/* skip or limit stream probing when the container header has
+	 * enough information */
+	bool     fast_probe;
+
+	/* only measure nb_windows windows of window_len seconds spread
+	 * across the file, and estimate the rest (0 = measure everything) */
+	unsigned nb_windows;
+	unsigned window_len;
+
+	/* measure the loudness of inputs above 48kHz at 48kHz, peaks are
+	 * still measured at the input's rate */
+	bool     downsample;
+
+	/* SCAN_ENGINE_* */
+	unsigned engine;
+
+	/* SCAN_IO_*, and where SCAN_IO_URING takes files from */
+	unsigned io;
+	struct io_ring *ring;
+
+	/* reused for the part of a file scanned by the calling thread, or
+	 * NULL, only one thread at a time can scan with a context */
+	scan_context *context;
+
+	/* whether to fill in scan_job.stats */
+	bool     stats;
+
+	/* called like printf.c's progress_bar() as the file is decoded, or
+	 * NULL */
+	void   (*progress)(unsigned ctrl, unsigned x, unsigned n, unsigned w);
+} scan_opts;
+
+typedef struct {
+	char         *file;
+	int           codec_id;
+
+	/* set by scan_file(), released by scan_job_reduce() */
+	scan_summary *summary;
+
+	/* set by scan_job_reduce() */
+	double        loudness;
+	double        loudness_range;
+	double        sample_peak;
+	double        true_peak;
+
+	/* set by scan_file() if only windows of the file were measured, the
+	 * error is in LU and NAN if unknown */
+	bool          estimated;
+	double        loudness_error;
+
+	/* set by scan_file() if the loudness was measured at a lower rate
+	 * than the file's (scan_opts.downsample) */
+	bool          downsampled;
+
+	scan_stats    stats;
+
+	/* why scan_file() failed, empty if it didn't */
+	char          error[SCAN_ERROR_LEN];
+} scan_job;
+
 typedef struct {
 	char *file;
 	int   codec_id;
@@ -49,13 +172,49 @@ typedef struct {
 	double album_loudness_range;
 } scan_result;
 
-int scan_init(unsigned nb_files);
+typedef struct {
+	double gain;
+	double peak;
+
+	double loudness;
+	double loudness_range;
+} scan_album;
+
+/* scan_init() only does anything the first time it's called */
+int scan_init(void);
 void scan_deinit(void);
 
-int scan_file(const char *file, unsigned index);
+/* NULL if out of memory */
+scan_context *scan_context_new(void);
+void scan_context_free(scan_context *ctx);
+
+/* These return -1 and describe the error in job -> error on failure. Any
+ * number of jobs can be scanned at once from different threads. */
+int scan_file(scan_job *job, const char *file, const scan_opts *opts);
+int scan_buffer(scan_job *job, const char *name, const void *data,
+                size_t size, const scan_opts *opts);
+void scan_job_reduce(scan_job *job, scan_summary *album);
+void scan_job_free(scan_job *job);
+
+void scan_summary_merge(scan_summary *dst, const scan_summary *src);
+double scan_summary_loudness(const scan_summary *sum);
+double scan_summary_loudness_range(const scan_summary *sum);
+
+/* NULL if the job failed or was never scanned */
+scan_result *scan_get_track_result(scan_job *job, double pre_gain);
+scan_album *scan_get_album_result(const scan_summary *album,
+                                  double pre_gain);
+void scan_set_album_result(scan_result *result, const scan_album *album);
+
+struct AVFrame;
 
-scan_result *scan_get_track_result(unsigned index, double pre_gain);
-void scan_set_album_result(scan_result *result, double pre_amp);
+/* Run a decoded frame nb_runs times through the sample conversion done by
+ * scan_file(), and through the loudness meter too if feed is true, so that
+ * loudgain-bench can time the two separately. The meter runs at meter_rate,
+ * which is either sample_rate or lower as with scan_opts.downsample. */
+int scan_bench_frame(struct AVFrame *frame, int channels, int sample_rate,
+                     int meter_rate, unsigned engine, unsigned measure,
+                     unsigned nb_runs, bool feed);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,942 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+
+#include "scan.h"
+#include "serve.h"
+#include "cache.h"
+#include "tag.h"
+#include "printf.h"
+
+/* how many requests per worker may wait in the queue before connections
+ * stop being read from */
+#define SERVE_QUEUE_LEN 16
+
+/* latency percentiles are computed over this many of the latest requests */
+#define SERVE_LATENCIES 1024
+
+/* maximum number of fields in a request */
+#define SERVE_MAX_FIELDS 16
+
+typedef struct serve_server serve_server;
+
+typedef struct {
+	serve_server    *server;
+
+	FILE            *in;
+	FILE            *out;
+
+	/* responses from different workers must not interleave */
+	pthread_mutex_t  lock;
+
+	/* the reader thread and every pending request hold a reference */
+	unsigned         refs;
+} serve_conn;
+
+typedef struct serve_request {
+	serve_conn           *conn;
+
+	/* the request's "id", echoed back as it was given, or NULL */
+	char                 *id;
+	bool                  id_string;
+
+	char                 *file;
+	unsigned              measure;
+	char                  tag_mode;
+
+	uint64_t              received_ns;
+
+	struct serve_request *next;
+} serve_request;
+
+struct serve_server {
+	const serve_opts *opts;
+
+	/* requests waiting for a worker, oldest first */
+	serve_request    *head;
+	serve_request    *tail;
+	unsigned          nb_queued;
+	unsigned          max_queued;
+
+	pthread_mutex_t   lock;
+	pthread_cond_t    queued;
+	pthread_cond_t    not_full;
+
+	/* for the status command, also under lock */
+	uint64_t          start_ns;
+	uint64_t          nb_requests;
+	uint64_t          nb_errors;
+	unsigned          nb_active;
+	unsigned          nb_conns;
+
+	double            latency_sum;
+	double            latency_max;
+	double            latencies[SERVE_LATENCIES];
+};
+
+typedef struct {
+	const char *key;
+
+	/* unescaped if string is set, else the raw token */
+	const char *value;
+	bool        string;
+} serve_field;
+
+static const struct {
+	const char *name;
+	unsigned    measure;
+} serve_measures[] = {
+	{ "gain",     SCAN_MEASURE_GAIN },
+	{ "gain+lra", SCAN_MEASURE_GAIN_LRA },
+	{ "full",     SCAN_MEASURE_FULL },
+};
+
+static serve_conn *serve_conn_new(serve_server *server, int fd);
+static void serve_conn_unref(serve_conn *conn);
+static void *serve_reader(void *arg);
+static void *serve_worker(void *arg);
+
+static serve_request *serve_request_new(serve_server *server,
+                                        serve_conn *conn,
+                                        serve_field *fields, int nb_fields,
+                                        const char **error);
+static void serve_request_free(serve_request *req);
+static void serve_handle(serve_server *server, serve_request *req,
+                         scan_context *ctx);
+static const char *serve_tags(char mode, scan_result *scan);
+
+static void serve_reply_begin(serve_conn *conn, const char *id,
+                              bool id_string);
+static void serve_reply_end(serve_conn *conn);
+static void serve_reply_error(serve_conn *conn, const char *id,
+                              bool id_string, const char *error);
+static void serve_reply_status(serve_server *server, serve_conn *conn,
+                               const char *id, bool id_string);
+static void serve_json_number(FILE *out, const char *key, double value);
+
+static int serve_parse(char *p, serve_field *fields, unsigned max);
+static serve_field *serve_field_get(serve_field *fields, int nb_fields,
+                                    const char *key);
+static uint64_t serve_now(void);
+
+int serve_run(const char *path, const serve_opts *opts) {
+	int fd;
+	unsigned i;
+
+	struct stat st;
+	struct sockaddr_un addr;
+
+	serve_server server;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fail_printf("Socket path '%s' is too long", path);
+
+	/* only replace stale sockets, never anything else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			fail_printf("'%s' exists and is not a socket", path);
+
+		unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		sysf_printf("Could not create socket");
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		sysf_printf("Could not bind to '%s'", path);
+
+	if (listen(fd, SOMAXCONN) < 0)
+		sysf_printf("Could not listen on '%s'", path);
+
+	/* clients going away are noticed when writing to them */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&server, 0, sizeof(server));
+
+	server.opts       = opts;
+	server.max_queued = opts -> nb_threads * SERVE_QUEUE_LEN;
+	server.start_ns   = serve_now();
+
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.queued, NULL);
+	pthread_cond_init(&server.not_full, NULL);
+
+	/* the workers live as long as the process, so libav, the codecs
+	 * and the cache stay warm between requests */
+	for (i = 0; i < opts -> nb_threads; i++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, serve_worker, &server) != 0)
+			fail_printf("Could not create worker thread");
+
+		pthread_detach(thread);
+	}
+
+	ok_printf("Listening on '%s'", path);
+
+	for (;;) {
+		pthread_t thread;
+		serve_conn *conn;
+
+		int client = accept(fd, NULL, NULL);
+
+		if (client < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+
+			/* wait for some clients to go away */
+			if ((errno == EMFILE) || (errno == ENFILE)) {
+				usleep(100000);
+				continue;
+			}
+
+			err_printf("Could not accept connection: %s",
+			           strerror(errno));
+			break;
+		}
+
+		conn = serve_conn_new(&server, client);
+		if (conn == NULL)
+			continue;
+
+		pthread_mutex_lock(&server.lock);
+		server.nb_conns++;
+		pthread_mutex_unlock(&server.lock);
+
+		if (pthread_create(&thread, NULL, serve_reader, conn) != 0) {
+			pthread_mutex_lock(&server.lock);
+			server.nb_conns--;
+			pthread_mutex_unlock(&server.lock);
+
+			serve_conn_unref(conn);
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+
+	close(fd);
+	unlink(path);
+
+	return 1;
+}
+
+/* Takes over fd, which is closed on failure. */
+static serve_conn *serve_conn_new(serve_server *server, int fd) {
+	int in_fd;
+	serve_conn *conn = calloc(1, sizeof(serve_conn));
+
+	if (conn == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	conn -> out = fdopen(fd, "w");
+	if (conn -> out == NULL) {
+		close(fd);
+		free(conn);
+		return NULL;
+	}
+
+	in_fd = dup(fd);
+	if (in_fd >= 0)
+		conn -> in = fdopen(in_fd, "r");
+
+	if (conn -> in == NULL) {
+		if (in_fd >= 0)
+			close(in_fd);
+
+		fclose(conn -> out);
+		free(conn);
+		return NULL;
+	}
+
+	conn -> server = server;
+	conn -> refs   = 1;
+
+	pthread_mutex_init(&conn -> lock, NULL);
+
+	return conn;
+}
+
+static void serve_conn_unref(serve_conn *conn) {
+	bool last;
+
+	pthread_mutex_lock(&conn -> lock);
+	last = --conn -> refs == 0;
+	pthread_mutex_unlock(&conn -> lock);
+
+	if (!last)
+		return;
+
+	fclose(conn -> in);
+	fclose(conn -> out);
+
+	pthread_mutex_destroy(&conn -> lock);
+
+	free(conn);
+}
+
+/* Read requests from a connection and queue them up for the workers, one
+ * JSON object per line. Status commands are answered right away. */
+static void *serve_reader(void *arg) {
+	serve_conn *conn = arg;
+	serve_server *server = conn -> server;
+
+	char *line = NULL;
+	size_t size = 0;
+
+	while (getline(&line, &size, conn -> in) >= 0) {
+		int nb_fields;
+		const char *error = NULL;
+
+		serve_field fields[SERVE_MAX_FIELDS];
+		serve_field *id, *cmd;
+		serve_request *req;
+
+		if (line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		nb_fields = serve_parse(line, fields, SERVE_MAX_FIELDS);
+		if (nb_fields < 0) {
+			serve_reply_error(conn, NULL, false, "Invalid request");
+			continue;
+		}
+
+		id  = serve_field_get(fields, nb_fields, "id");
+		cmd = serve_field_get(fields, nb_fields, "cmd");
+
+		if (cmd != NULL) {
+			if (!strcmp(cmd -> value, "status"))
+				serve_reply_status(
+					server, conn,
+					id ? id -> value : NULL, id && id -> string
+				);
+			else
+				serve_reply_error(
+					conn, id ? id -> value : NULL,
+					id && id -> string, "Unknown command"
+				);
+			continue;
+		}
+
+		req = serve_request_new(server, conn, fields, nb_fields, &error);
+		if (req == NULL) {
+			serve_reply_error(conn, id ? id -> value : NULL,
+			                  id && id -> string, error);
+			continue;
+		}
+
+		pthread_mutex_lock(&server -> lock);
+
+		/* stop reading while the workers are behind */
+		while (server -> nb_queued >= server -> max_queued)
+			pthread_cond_wait(&server -> not_full, &server -> lock);
+
+		if (server -> tail != NULL)
+			server -> tail -> next = req;
+		else
+			server -> head = req;
+
+		server -> tail = req;
+		server -> nb_queued++;
+
+		pthread_cond_signal(&server -> queued);
+		pthread_mutex_unlock(&server -> lock);
+	}
+
+	free(line);
+
+	pthread_mutex_lock(&server -> lock);
+	server -> nb_conns--;
+	pthread_mutex_unlock(&server -> lock);
+
+	serve_conn_unref(conn);
+
+	return NULL;
+}
+
+static void *serve_worker(void *arg) {
+	serve_server *server = arg;
+
+	/* kept across requests, they're just scanned without it if this
+	 * fails */
+	scan_context *ctx = scan_context_new();
+
+	for (;;) {
+		serve_request *req;
+
+		pthread_mutex_lock(&server -> lock);
+
+		while (server -> head == NULL)
+			pthread_cond_wait(&server -> queued, &server -> lock);
+
+		req = server -> head;
+
+		server -> head = req -> next;
+		if (server -> head == NULL)
+			server -> tail = NULL;
+
+		server -> nb_queued--;
+		server -> nb_active++;
+
+		pthread_cond_signal(&server -> not_full);
+		pthread_mutex_unlock(&server -> lock);
+
+		serve_handle(server, req, ctx);
+
+		serve_request_free(req);
+	}
+
+	scan_context_free(ctx);
+
+	return NULL;
+}
+
+static serve_request *serve_request_new(serve_server *server,
+                                        serve_conn *conn,
+                                        serve_field *fields, int nb_fields,
+                                        const char **error) {
+	unsigned i;
+
+	serve_field *id       = serve_field_get(fields, nb_fields, "id");
+	serve_field *file     = serve_field_get(fields, nb_fields, "file");
+	serve_field *measure  = serve_field_get(fields, nb_fields, "measure");
+	serve_field *tag_mode = serve_field_get(fields, nb_fields, "tag_mode");
+
+	serve_request *req;
+
+	if ((file == NULL) || !file -> string || (file -> value[0] == '\0')) {
+		*error = "Missing file";
+		return NULL;
+	}
+
+	req = calloc(1, sizeof(serve_request));
+	if (req == NULL) {
+		*error = "OOM";
+		return NULL;
+	}
+
+	req -> measure  = server -> opts -> scan.measure;
+	req -> tag_mode = server -> opts -> tag_mode;
+
+	if (measure != NULL) {
+		for (i = 0; i < FF_ARRAY_ELEMS(serve_measures); i++) {
+			if (!strcmp(measure -> value, serve_measures[i].name))
+				break;
+		}
+
+		if (i == FF_ARRAY_ELEMS(serve_measures)) {
+			free(req);
+
+			*error = "Invalid measurement profile";
+			return NULL;
+		}
+
+		req -> measure = serve_measures[i].measure;
+	}
+
+	if (tag_mode != NULL) {
+		if (!tag_mode -> string || (strlen(tag_mode -> value) != 1) ||
+		    !strchr("sid", tag_mode -> value[0])) {
+			free(req);
+
+			*error = "Invalid tag mode";
+			return NULL;
+		}
+
+		req -> tag_mode = tag_mode -> value[0];
+	}
+
+	req -> file = strdup(file -> value);
+
+	if (id != NULL) {
+		req -> id        = strdup(id -> value);
+		req -> id_string = id -> string;
+	}
+
+	if ((req -> file == NULL) || ((id != NULL) && (req -> id == NULL))) {
+		serve_request_free(req);
+
+		*error = "OOM";
+		return NULL;
+	}
+
+	pthread_mutex_lock(&conn -> lock);
+	conn -> refs++;
+	pthread_mutex_unlock(&conn -> lock);
+
+	req -> conn        = conn;
+	req -> received_ns = serve_now();
+
+	return req;
+}
+
+static void serve_request_free(serve_request *req) {
+	if (req -> conn != NULL)
+		serve_conn_unref(req -> conn);
+
+	free(req -> id);
+	free(req -> file);
+	free(req);
+}
+
+static void serve_handle(serve_server *server, serve_request *req,
+                         scan_context *ctx) {
+	int rc;
+	double latency;
+
+	scan_job job;
+	scan_result *scan = NULL;
+	scan_opts opts = server -> opts -> scan;
+
+	const char *error = NULL;
+
+	opts.measure  = req -> measure;
+	opts.progress = NULL;
+	opts.stats    = false;
+	opts.context  = ctx;
+
+	memset(&job, 0, sizeof(job));
+
+	rc = cache_scan_file(server -> opts -> cache, &job, req -> file, &opts);
+
+	if (rc < 0)
+		error = job.error;
+	else if ((scan = scan_get_track_result(&job, server -> opts -> pre_gain)) == NULL)
+		error = "OOM";
+
+	if (scan != NULL) {
+		if (server -> opts -> no_clip)
+			scan -> track_gain = FFMIN(scan -> track_gain,
+			                           1.0 / scan -> track_peak);
+
+		error = serve_tags(req -> tag_mode, scan);
+	}
+
+	latency = (serve_now() - req -> received_ns) / 1e6;
+
+	if (scan == NULL) {
+		serve_reply_error(req -> conn, req -> id, req -> id_string, error);
+	} else {
+		FILE *out = req -> conn -> out;
+
+		serve_reply_begin(req -> conn, req -> id, req -> id_string);
+
+		fputs("\"file\":", out);
+		stats_json_string(out, req -> file);
+
+		serve_json_number(out, "loudness", job.loudness);
+
+		if (job.estimated)
+			serve_json_number(out, "loudness_error",
+			                  job.loudness_error);
+
+		serve_json_number(out, "range", job.loudness_range);
+		serve_json_number(out, "gain", scan -> track_gain);
+		serve_json_number(out, "peak", scan -> track_peak);
+		serve_json_number(out, "sample_peak", job.sample_peak);
+		serve_json_number(out, "true_peak", job.true_peak);
+		serve_json_number(out, "ms", latency);
+
+		if (error != NULL) {
+			fputs(",\"error\":", out);
+			stats_json_string(out, error);
+		}
+
+		serve_reply_end(req -> conn);
+	}
+
+	free(scan);
+	scan_job_free(&job);
+
+	pthread_mutex_lock(&server -> lock);
+
+	server -> latencies[server -> nb_requests % SERVE_LATENCIES] = latency;
+
+	server -> nb_requests++;
+	server -> nb_errors   += error != NULL;
+	server -> nb_active--;
+	server -> latency_sum += latency;
+	server -> latency_max  = FFMAX(server -> latency_max, latency);
+
+	pthread_mutex_unlock(&server -> lock);
+}
+
+/* NULL if the tags were written (or left alone), else why not */
+static const char *serve_tags(char mode, scan_result *scan) {
+	int rc;
+
+	if (mode == 's')
+		return NULL;
+
+	if ((mode != 'i') && (mode != 'd'))
+		return "Invalid tag mode";
+
+	switch (scan -> codec_id) {
+		case AV_CODEC_ID_MP3:
+			rc = (mode == 'i') ? tag_write_mp3(scan)
+			                   : tag_clear_mp3(scan);
+			break;
+
+		case AV_CODEC_ID_FLAC:
+			rc = (mode == 'i') ? tag_write_flac(scan)
+			                   : tag_clear_flac(scan);
+			break;
+
+		default:
+			return "File type not supported";
+	}
+
+	return (rc < 0) ? "Could not write tags" : NULL;
+}
+
+static void serve_reply_begin(serve_conn *conn, const char *id,
+                              bool id_string) {
+	pthread_mutex_lock(&conn -> lock);
+
+	fputc('{', conn -> out);
+
+	if (id == NULL)
+		return;
+
+	fputs("\"id\":", conn -> out);
+
+	if (id_string)
+		stats_json_string(conn -> out, id);
+	else
+		fputs(id, conn -> out);
+
+	fputc(',', conn -> out);
+}
+
+static void serve_reply_end(serve_conn *conn) {
+	fputs("}\n", conn -> out);
+	fflush(conn -> out);
+
+	pthread_mutex_unlock(&conn -> lock);
+}
+
+static void serve_reply_error(serve_conn *conn, const char *id,
+                              bool id_string, const char *error) {
+	serve_reply_begin(conn, id, id_string);
+
+	fputs("\"error\":", conn -> out);
+	stats_json_string(conn -> out, error);
+
+	serve_reply_end(conn);
+}
+
+static int serve_cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void serve_reply_status(serve_server *server, serve_conn *conn,
+                               const char *id, bool id_string) {
+	unsigned i, nb_latencies;
+	double uptime, mean = 0.0, pct[3] = { 0.0, 0.0, 0.0 };
+
+	static const double pct_at[3] = { 0.50, 0.95, 0.99 };
+
+	double latencies[SERVE_LATENCIES];
+	serve_server copy;
+
+	/* copy everything so that the workers aren't held up by the
+	 * sorting and writing */
+	pthread_mutex_lock(&server -> lock);
+	memcpy(&copy, server, sizeof(copy));
+	pthread_mutex_unlock(&server -> lock);
+
+	nb_latencies = FFMIN(copy.nb_requests, SERVE_LATENCIES);
+
+	memcpy(latencies, copy.latencies, nb_latencies * sizeof(double));
+	qsort(latencies, nb_latencies, sizeof(double), serve_cmp_double);
+
+	if (nb_latencies > 0) {
+		mean = copy.latency_sum / copy.nb_requests;
+
+		for (i = 0; i < 3; i++)
+			pct[i] = latencies[(unsigned)
+			                   ((nb_latencies - 1) * pct_at[i] + 0.5)];
+	}
+
+	uptime = (serve_now() - copy.start_ns) / 1e9;
+
+	serve_reply_begin(conn, id, id_string);
+
+	fprintf(conn -> out,
+	        "\"status\":{\"uptime_seconds\":%.3f,\"threads\":%u,"
+	        "\"connections\":%u,\"active\":%u,\"queued\":%u,"
+	        "\"requests\":%llu,\"errors\":%llu,"
+	        "\"requests_per_second\":%.3f,"
+	        "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p95\":%.3f,"
+	        "\"p99\":%.3f,\"max\":%.3f}}",
+	        uptime, server -> opts -> nb_threads,
+	        copy.nb_conns, copy.nb_active, copy.nb_queued,
+	        (unsigned long long) copy.nb_requests,
+	        (unsigned long long) copy.nb_errors,
+	        (uptime > 0.0) ? copy.nb_requests / uptime : 0.0,
+	        mean, pct[0], pct[1], pct[2], copy.latency_max);
+
+	serve_reply_end(conn);
+}
+
+/* ",key:value", with null for silence */
+static void serve_json_number(FILE *out, const char *key, double value) {
+	if (isfinite(value))
+		fprintf(out, ",\"%s\":%.6f", key, value);
+	else
+		fprintf(out, ",\"%s\":null", key);
+}
+
+static char *serve_skip(char *p) {
+	return p + strspn(p, " \t\r\n");
+}
+
+static int serve_hex4(const char *p, unsigned *out) {
+	unsigned i;
+
+	*out = 0;
+
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+
+		*out <<= 4;
+
+		if ((c >= '0') && (c <= '9'))
+			*out |= c - '0';
+		else if ((c >= 'a') && (c <= 'f'))
+			*out |= c - 'a' + 10;
+		else if ((c >= 'A') && (c <= 'F'))
+			*out |= c - 'A' + 10;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Unescape the JSON string starting at the quote at *p, in place since
+ * escapes never get longer once decoded, and move *p past it. */
+static char *serve_parse_string(char **p) {
+	char *src = *p + 1, *dst = src, *str = src;
+
+	while (*src != '"') {
+		unsigned cp, low;
+
+		if ((unsigned char) *src < 0x20)
+			return NULL;
+
+		if (*src != '\\') {
+			*dst++ = *src++;
+			continue;
+		}
+
+		switch (*++src) {
+			case '"':
+			case '\\':
+			case '/': *dst++ = *src; break;
+			case 'b': *dst++ = '\b'; break;
+			case 'f': *dst++ = '\f'; break;
+			case 'n': *dst++ = '\n'; break;
+			case 'r': *dst++ = '\r'; break;
+			case 't': *dst++ = '\t'; break;
+
+			case 'u':
+				if (serve_hex4(src + 1, &cp) < 0)
+					return NULL;
+
+				src += 4;
+
+				/* surrogate pairs take two escapes */
+				if ((cp >= 0xd800) && (cp < 0xdc00) &&
+				    (src[1] == '\\') && (src[2] == 'u') &&
+				    (serve_hex4(src + 3, &low) == 0) &&
+				    (low >= 0xdc00) && (low < 0xe000)) {
+					cp = 0x10000 + ((cp - 0xd800) << 10) +
+					     (low - 0xdc00);
+					src += 6;
+				}
+
+				if (cp == 0)
+					return NULL;
+
+				if (cp < 0x80) {
+					*dst++ = cp;
+				} else if (cp < 0x800) {
+					*dst++ = 0xc0 | (cp >> 6);
+					*dst++ = 0x80 | (cp & 0x3f);
+				} else if (cp < 0x10000) {
+					*dst++ = 0xe0 | (cp >> 12);
+					*dst++ = 0x80 | ((cp >> 6) & 0x3f);
+					*dst++ = 0x80 | (cp & 0x3f);
+				} else {
+					*dst++ = 0xf0 | (cp >> 18);
+					*dst++ = 0x80 | ((cp >> 12) & 0x3f);
+					*dst++ = 0x80 | ((cp >> 6) & 0x3f);
+					*dst++ = 0x80 | (cp & 0x3f);
+				}
+				break;
+
+			default:
+				return NULL;
+		}
+
+		src++;
+	}
+
+	*dst = '\0';
+	*p   = src + 1;
+
+	return str;
+}
+
+/* Parse a flat JSON object in place, values can be strings, numbers,
+ * booleans or null. Returns the number of fields, or -1. */
+static int serve_parse(char *p, serve_field *fields, unsigned max) {
+	unsigned n = 0;
+
+	p = serve_skip(p);
+	if (*p++ != '{')
+		return -1;
+
+	p = serve_skip(p);
+	if (*p == '}')
+		return (*serve_skip(p + 1) == '\0') ? 0 : -1;
+
+	for (;;) {
+		char sep;
+
+		if ((n == max) || (*p != '"'))
+			return -1;
+
+		fields[n].key = serve_parse_string(&p);
+		if (fields[n].key == NULL)
+			return -1;
+
+		p = serve_skip(p);
+		if (*p++ != ':')
+			return -1;
+
+		p = serve_skip(p);
+
+		if (*p == '"') {
+			fields[n].value  = serve_parse_string(&p);
+			fields[n].string = true;
+
+			if (fields[n].value == NULL)
+				return -1;
+
+			p   = serve_skip(p);
+			sep = *p;
+		} else {
+			char *end, *token = p;
+
+			p += strcspn(p, " \t\r\n,}");
+			if (p == token)
+				return -1;
+
+			end = p;
+			p   = serve_skip(p);
+			sep = *p;
+
+			*end = '\0';
+
+			if (strcmp(token, "true") && strcmp(token, "false") &&
+			    strcmp(token, "null")) {
+				char *rest;
+
+				strtod(token, &rest);
+				if (*rest != '\0')
+					return -1;
+			}
+
+			fields[n].value  = token;
+			fields[n].string = false;
+		}
+
+		n++;
+		p++;
+
+		if (sep == '}')
+			break;
+
+		if (sep != ',')
+			return -1;
+
+		p = serve_skip(p);
+	}
+
+	return (*serve_skip(p) == '\0') ? (int) n : -1;
+}
+
+static serve_field *serve_field_get(serve_field *fields, int nb_fields,
+                                    const char *key) {
+	int i;
+
+	for (i = 0; i < nb_fields; i++) {
+		if (!strcmp(fields[i].key, key))
+			return &fields[i];
+	}
+
+	return NULL;
+}
+
+static uint64_t serve_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,200 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "printf.h"
+
+/* how many of the slowest files are listed */
+#define STATS_NB_SLOWEST 10
+
+typedef struct {
+	char      *file;
+	scan_stats stats;
+} stats_file;
+
+struct stats_report {
+	scan_stats total;
+	unsigned   nb_files;
+
+	stats_mark start;
+
+	/* sorted by scan time, slowest first */
+	stats_file slowest[STATS_NB_SLOWEST];
+	unsigned   nb_slowest;
+};
+
+static const char *stage_names[STATS_NB_STAGES] = {
+	"open", "read", "decode", "convert", "meter", "tags"
+};
+
+static void stats_json_time(FILE *out, const stats_time *time);
+
+stats_report *stats_report_new(void) {
+	stats_report *report = calloc(1, sizeof(stats_report));
+	if (report == NULL)
+		fail_printf("OOM");
+
+	stats_start(&report -> start);
+
+	return report;
+}
+
+void stats_report_add(stats_report *report, const char *file,
+                      const scan_stats *stats) {
+	unsigned i;
+	uint64_t wall = stats -> scan.wall_ns + stats -> stages[STATS_TAGS].wall_ns;
+
+	stats_merge(&report -> total, stats);
+	report -> nb_files++;
+
+	for (i = report -> nb_slowest; i > 0; i--) {
+		const scan_stats *prev = &report -> slowest[i - 1].stats;
+
+		if (prev -> scan.wall_ns + prev -> stages[STATS_TAGS].wall_ns >= wall)
+			break;
+	}
+
+	if (i >= STATS_NB_SLOWEST)
+		return;
+
+	if (report -> nb_slowest == STATS_NB_SLOWEST)
+		free(report -> slowest[--report -> nb_slowest].file);
+
+	memmove(&report -> slowest[i + 1], &report -> slowest[i],
+	        (report -> nb_slowest - i) * sizeof(stats_file));
+
+	report -> slowest[i].file  = strdup(file);
+	report -> slowest[i].stats = *stats;
+
+	if (report -> slowest[i].file == NULL)
+		fail_printf("OOM");
+
+	report -> nb_slowest++;
+}
+
+void stats_report_write(stats_report *report, FILE *out, unsigned nb_threads) {
+	unsigned i;
+
+	stats_time run = { 0, 0 };
+	const scan_stats *total = &report -> total;
+
+	stats_stop(&report -> start, &run);
+
+	/* all threads, not just the calling one */
+	run.cpu_ns = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+	fprintf(out, "{\"files\":%u,\"cached\":%u,\"threads\":%u,",
+	        report -> nb_files, total -> cached, nb_threads);
+
+	fprintf(out, "\"run\":");
+	stats_json_time(out, &run);
+
+	fprintf(out, ",\"bytes_read\":%llu,\"samples\":%llu,",
+	        (unsigned long long) total -> bytes_read,
+	        (unsigned long long) total -> samples);
+
+	fprintf(out, "\"samples_per_sec\":%.0f,\"files_per_sec\":%.3f,",
+	        run.wall_ns ? total -> samples * 1e9 / run.wall_ns : 0,
+	        run.wall_ns ? report -> nb_files * 1e9 / run.wall_ns : 0);
+
+	fprintf(out, "\"scan\":");
+	stats_json_time(out, &total -> scan);
+
+	fprintf(out, ",\"stages\":{");
+
+	for (i = 0; i < STATS_NB_STAGES; i++) {
+		fprintf(out, "%s\"%s\":", i ? "," : "", stage_names[i]);
+		stats_json_time(out, &total -> stages[i]);
+	}
+
+	fprintf(out, "},\"slowest\":[");
+
+	for (i = 0; i < report -> nb_slowest; i++) {
+		const stats_file *f = &report -> slowest[i];
+
+		fprintf(out, "%s{\"file\":", i ? "," : "");
+		stats_json_string(out, f -> file);
+
+		fprintf(out, ",\"cached\":%s,\"bytes_read\":%llu,"
+		        "\"samples\":%llu,\"scan\":",
+		        f -> stats.cached ? "true" : "false",
+		        (unsigned long long) f -> stats.bytes_read,
+		        (unsigned long long) f -> stats.samples);
+		stats_json_time(out, &f -> stats.scan);
+
+		fprintf(out, ",\"tags\":");
+		stats_json_time(out, &f -> stats.stages[STATS_TAGS]);
+
+		fprintf(out, "}");
+	}
+
+	fprintf(out, "]}\n");
+	fflush(out);
+}
+
+void stats_report_free(stats_report *report) {
+	unsigned i;
+
+	if (report == NULL)
+		return;
+
+	for (i = 0; i < report -> nb_slowest; i++)
+		free(report -> slowest[i].file);
+
+	free(report);
+}
+
+
+static void stats_json_time(FILE *out, const stats_time *time) {
+	fprintf(out, "{\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f}",
+	        time -> wall_ns / 1e9, time -> cpu_ns / 1e9);
+}
+
+void stats_json_string(FILE *out, const char *str) {
+	fputc('"', out);
+
+	for (; *str != '\0'; str++) {
+		unsigned char c = *str;
+
+		if ((c == '"') || (c == '\\'))
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+
+	fputc('"', out);
+}
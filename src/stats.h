@@ -0,0 +1,135 @@
+/*
+ * Loudness normalizer based on the EBU R128 standard
+ *
+ * Copyright (c) 2014, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	STATS_OPEN,     /* avformat_open_input() and find_stream_info() */
+	STATS_READ,     /* demuxing, including the actual file I/O */
+	STATS_DECODE,
+	STATS_CONVERT,  /* sample format conversion and interleaving */
+	STATS_METER,    /* libebur128 and our histograms */
+	STATS_TAGS,     /* reading and writing tags */
+	STATS_NB_STAGES
+} stats_stage;
+
+typedef struct {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+} stats_time;
+
+typedef struct {
+	stats_time stages[STATS_NB_STAGES];
+
+	/* the whole scan_file() call, CPU time only counts the calling
+	 * thread and not segment threads (those are in the stages) */
+	stats_time scan;
+
+	uint64_t   bytes_read;
+	uint64_t   samples;
+
+	unsigned   cached;
+} scan_stats;
+
+/* start of a timed section, CPU time is that of the calling thread */
+typedef struct {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+} stats_mark;
+
+typedef struct stats_report stats_report;
+
+/* these are used while scanning, and kept here so that scan.c doesn't
+ * depend on the reports (which only the command line tool writes) */
+static inline uint64_t stats_clock(clockid_t clock) {
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) < 0)
+		return 0;
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stats_start(stats_mark *mark) {
+	mark -> wall_ns = stats_clock(CLOCK_MONOTONIC);
+	mark -> cpu_ns  = stats_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static inline void stats_stop(const stats_mark *mark, stats_time *time) {
+	time -> wall_ns += stats_clock(CLOCK_MONOTONIC) - mark -> wall_ns;
+	time -> cpu_ns  += stats_clock(CLOCK_THREAD_CPUTIME_ID) - mark -> cpu_ns;
+}
+
+/* same as the above, doing nothing if stats is NULL (stats disabled) */
+static inline void stats_begin(scan_stats *stats, stats_mark *mark) {
+	if (stats != NULL)
+		stats_start(mark);
+}
+
+static inline void stats_end(scan_stats *stats, stats_stage stage,
+                             const stats_mark *mark) {
+	if (stats != NULL)
+		stats_stop(mark, &stats -> stages[stage]);
+}
+
+static inline void stats_merge(scan_stats *dst, const scan_stats *src) {
+	unsigned i;
+
+	for (i = 0; i < STATS_NB_STAGES; i++) {
+		dst -> stages[i].wall_ns += src -> stages[i].wall_ns;
+		dst -> stages[i].cpu_ns  += src -> stages[i].cpu_ns;
+	}
+
+	dst -> scan.wall_ns += src -> scan.wall_ns;
+	dst -> scan.cpu_ns  += src -> scan.cpu_ns;
+
+	dst -> bytes_read += src -> bytes_read;
+	dst -> samples    += src -> samples;
+	dst -> cached     += src -> cached;
+}
+
+stats_report *stats_report_new(void);
+void stats_report_add(stats_report *report, const char *file,
+                      const scan_stats *stats);
+void stats_report_write(stats_report *report, FILE *out, unsigned nb_threads);
+void stats_report_free(stats_report *report);
+
+/* write str as a quoted and escaped JSON string */
+void stats_json_string(FILE *out, const char *str);
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,6 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
 #include <taglib.h>
 
 #include <textidentificationframe.h>
@@ -40,42 +44,73 @@
 
 #include "scan.h"
 #include "tag.h"
-#include "printf.h"
 
-static void tag_add_txxx(TagLib::ID3v2::Tag *tag, char *name, char *value) {
-	TagLib::ID3v2::UserTextIdentificationFrame *frame =
-		new TagLib::ID3v2::UserTextIdentificationFrame;
+static const char *tag_names[] = {
+	"REPLAYGAIN_TRACK_GAIN", "REPLAYGAIN_TRACK_PEAK",
+	"REPLAYGAIN_ALBUM_GAIN", "REPLAYGAIN_ALBUM_PEAK"
+};
 
-	frame -> setDescription(name);
-	frame -> setText(value);
+#define TAG_NB_NAMES (sizeof(tag_names) / sizeof(tag_names[0]))
 
-	tag -> addFrame(frame);
-}
-
-void tag_write_mp3(scan_result *scan) {
+static void tag_values(scan_result *scan, TagLib::String *values) {
 	char value[2048];
 
-	TagLib::MPEG::File f(scan -> file);
-	TagLib::ID3v2::Tag *tag = f.ID3v2Tag(true);
-
 	snprintf(value, sizeof(value), "%f dB", scan -> track_gain);
-	tag_add_txxx(tag, const_cast<char *>("REPLAYGAIN_TRACK_GAIN"), value);
+	values[0] = value;
 
 	snprintf(value, sizeof(value), "%f", scan -> track_peak);
-	tag_add_txxx(tag, const_cast<char *>("REPLAYGAIN_TRACK_PEAK"), value);
+	values[1] = value;
 
 	snprintf(value, sizeof(value), "%f dB", scan -> album_gain);
-	tag_add_txxx(tag, const_cast<char *>("REPLAYGAIN_ALBUM_GAIN"), value);
+	values[2] = value;
 
 	snprintf(value, sizeof(value), "%f", scan -> album_peak);
-	tag_add_txxx(tag, const_cast<char *>("REPLAYGAIN_ALBUM_PEAK"), value);
+	values[3] = value;
+}
+
+static int tag_index(const TagLib::String &name) {
+	TagLib::String desc = name.upper();
 
-	f.save(TagLib::MPEG::File::ID3v2, false);
+	for (unsigned i = 0; i < TAG_NB_NAMES; i++) {
+		if (desc == tag_names[i])
+			return i;
+	}
+
+	return -1;
+}
+
+static void tag_add_txxx(TagLib::ID3v2::Tag *tag, const char *name,
+                         const TagLib::String &value) {
+	TagLib::ID3v2::UserTextIdentificationFrame *frame =
+		new TagLib::ID3v2::UserTextIdentificationFrame;
+
+	frame -> setDescription(name);
+	frame -> setText(value);
+
+	tag -> addFrame(frame);
 }
 
-void tag_clear_mp3(scan_result *scan) {
-	TagLib::MPEG::File f(scan -> file);
-	TagLib::ID3v2::Tag *tag = f.ID3v2Tag(true);
+/* Replace (or just remove, if !write) the ReplayGain frames with a single
+ * open and save. Frames that already hold the right value are left alone,
+ * and the file is not saved at all if nothing changed. TagLib reuses the
+ * existing tag padding when the new tag fits, so the audio data is only
+ * moved if the tag grows past it. */
+static int tag_update_mp3(scan_result *scan, bool write) {
+	bool changed = false, seen[TAG_NB_NAMES] = { false };
+	TagLib::String values[TAG_NB_NAMES];
+
+	TagLib::MPEG::File f(scan -> file, false);
+
+	if (!f.isValid())
+		return -1;
+
+	TagLib::ID3v2::Tag *tag = f.ID3v2Tag(write);
+
+	if (tag == NULL)
+		return 0;
+
+	if (write)
+		tag_values(scan, values);
 
 	TagLib::ID3v2::FrameList::Iterator it;
 	TagLib::ID3v2::FrameList frames = tag -> frameList("TXXX");
@@ -84,49 +119,190 @@ void tag_clear_mp3(scan_result *scan) {
 		TagLib::ID3v2::UserTextIdentificationFrame *frame =
 		 dynamic_cast<TagLib::ID3v2::UserTextIdentificationFrame*>(*it);
 
-		if (frame && frame -> fieldList().size() >= 2) {
-			TagLib::String desc = frame -> description().upper();
+		if (!frame || frame -> fieldList().size() < 2)
+			continue;
+
+		int i = tag_index(frame -> description());
+		if (i < 0)
+			continue;
 
-			if ((desc == "REPLAYGAIN_TRACK_GAIN") ||
-			    (desc == "REPLAYGAIN_TRACK_PEAK") ||
-			    (desc == "REPLAYGAIN_ALBUM_GAIN") ||
-			    (desc == "REPLAYGAIN_ALBUM_PEAK"))
-				tag -> removeFrame(frame);
+		if (write && !seen[i] && (frame -> fieldList().size() == 2) &&
+		    (frame -> fieldList()[1] == values[i])) {
+			seen[i] = true;
+			continue;
 		}
+
+		tag -> removeFrame(frame);
+		changed = true;
 	}
 
-	f.save(TagLib::MPEG::File::ID3v2, false);
+	for (unsigned i = 0; write && (i < TAG_NB_NAMES); i++) {
+		if (seen[i])
+			continue;
+
+		tag_add_txxx(tag, tag_names[i], values[i]);
+		changed = true;
+	}
+
+	if (changed && !f.save(TagLib::MPEG::File::ID3v2, false))
+		return -1;
+
+	return 0;
 }
 
-void tag_write_flac(scan_result *scan) {
-	char value[2048];
+int tag_write_mp3(scan_result *scan) {
+	return tag_update_mp3(scan, true);
+}
 
-	TagLib::FLAC::File f(scan -> file);
-	TagLib::Ogg::XiphComment *tag = f.xiphComment(true);
+int tag_clear_mp3(scan_result *scan) {
+	return tag_update_mp3(scan, false);
+}
 
-	snprintf(value, sizeof(value), "%f dB", scan -> track_gain);
-	tag -> addField("REPLAYGAIN_TRACK_GAIN", value);
+/* same as tag_update_mp3(), TagLib fills the new comment into the existing
+ * PADDING block where possible */
+static int tag_update_flac(scan_result *scan, bool write) {
+	bool changed = false;
+	TagLib::String values[TAG_NB_NAMES];
 
-	snprintf(value, sizeof(value), "%f", scan -> track_peak);
-	tag -> addField("REPLAYGAIN_TRACK_PEAK", value);
+	TagLib::FLAC::File f(scan -> file, false);
 
-	snprintf(value, sizeof(value), "%f dB", scan -> album_gain);
-	tag -> addField("REPLAYGAIN_ALBUM_GAIN", value);
+	if (!f.isValid())
+		return -1;
 
-	snprintf(value, sizeof(value), "%f", scan -> album_peak);
-	tag -> addField("REPLAYGAIN_ALBUM_PEAK", value);
+	TagLib::Ogg::XiphComment *tag = f.xiphComment(write);
+
+	if (tag == NULL)
+		return 0;
+
+	if (write)
+		tag_values(scan, values);
+
+	for (unsigned i = 0; i < TAG_NB_NAMES; i++) {
+		const TagLib::Ogg::FieldListMap &fields = tag -> fieldListMap();
+
+		bool present = fields.contains(tag_names[i]);
 
-	f.save();
+		if (write && present && (fields[tag_names[i]].size() == 1) &&
+		    (fields[tag_names[i]].front() == values[i]))
+			continue;
+
+		if (!write && !present)
+			continue;
+
+		if (write)
+			tag -> addField(tag_names[i], values[i], true);
+		else
+			tag -> removeField(tag_names[i]);
+
+		changed = true;
+	}
+
+	if (changed && !f.save())
+		return -1;
+
+	return 0;
+}
+
+int tag_write_flac(scan_result *scan) {
+	return tag_update_flac(scan, true);
+}
+
+int tag_clear_flac(scan_result *scan) {
+	return tag_update_flac(scan, false);
+}
+
+static bool tag_parse(const TagLib::String &str, double *out) {
+	char *rest = NULL;
+	std::string value = str.to8Bit();
+
+	*out = strtod(value.c_str(), &rest);
+
+	return rest != value.c_str();
+}
+
+static void tag_set_value(scan_result *result, const TagLib::String &name,
+                          const TagLib::String &value, unsigned *found) {
+	TagLib::String desc = name.upper();
+
+	if ((desc == "REPLAYGAIN_TRACK_GAIN") &&
+	    tag_parse(value, &result -> track_gain))
+		*found |= 1;
+	else if ((desc == "REPLAYGAIN_TRACK_PEAK") &&
+	         tag_parse(value, &result -> track_peak))
+		*found |= 2;
+	else if ((desc == "REPLAYGAIN_ALBUM_GAIN") &&
+	         tag_parse(value, &result -> album_gain))
+		*found |= 4;
+	else if ((desc == "REPLAYGAIN_ALBUM_PEAK") &&
+	         tag_parse(value, &result -> album_peak))
+		*found |= 8;
 }
 
-void tag_clear_flac(scan_result *scan) {
-	TagLib::FLAC::File f(scan -> file);
-	TagLib::Ogg::XiphComment *tag = f.xiphComment(true);
+static unsigned tag_read_mp3(const char *file, scan_result *result) {
+	unsigned found = 0;
+
+	TagLib::MPEG::File f(file, false);
+	TagLib::ID3v2::Tag *tag = f.ID3v2Tag(false);
+
+	if (tag == NULL)
+		return 0;
+
+	TagLib::ID3v2::FrameList::Iterator it;
+	TagLib::ID3v2::FrameList frames = tag -> frameList("TXXX");
 
-	tag -> removeField("REPLAYGAIN_TRACK_GAIN");
-	tag -> removeField("REPLAYGAIN_TRACK_PEAK");
-	tag -> removeField("REPLAYGAIN_ALBUM_GAIN");
-	tag -> removeField("REPLAYGAIN_ALBUM_PEAK");
+	for (it = frames.begin(); it != frames.end(); ++it) {
+		TagLib::ID3v2::UserTextIdentificationFrame *frame =
+		 dynamic_cast<TagLib::ID3v2::UserTextIdentificationFrame*>(*it);
+
+		if (frame && frame -> fieldList().size() >= 2)
+			tag_set_value(result, frame -> description(),
+			              frame -> fieldList()[1], &found);
+	}
+
+	return found;
+}
+
+static unsigned tag_read_flac(const char *file, scan_result *result) {
+	unsigned found = 0;
+
+	TagLib::FLAC::File f(file, false);
+	TagLib::Ogg::XiphComment *tag = f.xiphComment(false);
+
+	if (tag == NULL)
+		return 0;
+
+	const TagLib::Ogg::FieldListMap &fields = tag -> fieldListMap();
+
+	for (unsigned i = 0; i < TAG_NB_NAMES; i++) {
+		if (fields.contains(tag_names[i]) && !fields[tag_names[i]].isEmpty())
+			tag_set_value(result, tag_names[i],
+			              fields[tag_names[i]].front(), &found);
+	}
+
+	return found;
+}
+
+scan_result *tag_read(const char *file, bool album) {
+	unsigned found = 0, needed = album ? 15 : 3;
+	const char *ext = strrchr(file, '.');
+
+	scan_result *result = (scan_result *) calloc(1, sizeof(scan_result));
+	/* as if untagged, the file just gets scanned */
+	if (result == NULL)
+		return NULL;
+
+	result -> file = const_cast<char *>(file);
+
+	/* go by the extension, so that no decoding library gets involved */
+	if (ext != NULL && !strcasecmp(ext, ".mp3"))
+		found = tag_read_mp3(file, result);
+	else if (ext != NULL && !strcasecmp(ext, ".flac"))
+		found = tag_read_flac(file, result);
+
+	if ((found & needed) != needed) {
+		free(result);
+		return NULL;
+	}
 
-	f.save();
+	return result;
 }
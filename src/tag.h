@@ -32,11 +32,16 @@
 extern "C" {
 #endif
 
-void tag_write_mp3(scan_result *scan);
-void tag_clear_mp3(scan_result *scan);
+scan_result *tag_read(const char *file, bool album);
 
-void tag_write_flac(scan_result *scan);
-void tag_clear_flac(scan_result *scan);
+/* tag_write_*() replace any existing ReplayGain tags, all of these return
+ * -1 if the file could not be opened or saved */
+
+int tag_write_mp3(scan_result *scan);
+int tag_clear_mp3(scan_result *scan);
+
+int tag_write_flac(scan_result *scan);
+int tag_clear_flac(scan_result *scan);
 
 #ifdef __cplusplus
 }